@@ -0,0 +1,496 @@
+/* Copyright (c) 2006-2013 Jonas Fonseca <fonseca@diku.dk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "tig.h"
+#include "index.h"
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+/* The index file starts with a header followed by the entries sorted by
+ * path and optional extensions, all in network byte order. Version 4
+ * prefix compresses the paths and drops the padding of the entries. */
+
+#define INDEX_SIGNATURE		"DIRC"
+#define INDEX_HEADER_SIZE	12
+#define INDEX_ENTRY_SIZE	62	/* Up to and including the flags. */
+#define INDEX_HASH_SIZE		20
+
+#define INDEX_FLAG_VALID	0x8000	/* Assume unchanged. */
+#define INDEX_FLAG_EXTENDED	0x4000
+#define INDEX_FLAG_STAGE	0x3000
+#define INDEX_FLAG_NAMEMASK	0x0fff
+#define INDEX_FLAG_SKIP_WORKTREE	0x4000	/* In the extended flags. */
+#define INDEX_FLAG_INTENT_TO_ADD	0x2000
+
+#ifdef __APPLE__
+#define ST_MTIME_NSEC(st)	((st)->st_mtimespec.tv_nsec)
+#else
+#define ST_MTIME_NSEC(st)	((st)->st_mtim.tv_nsec)
+#endif
+
+struct index_file {
+	const unsigned char *map;
+	size_t size;
+	unsigned int version;
+	uint32_t entries;
+	time_t mtime;
+	long mtime_nsec;
+};
+
+struct index_entry {
+	uint32_t mtime, mtime_nsec;
+	uint32_t ino, mode, size;
+	uint16_t flags, extended_flags;
+	const unsigned char *id;
+	char path[SIZEOF_STR];
+};
+
+static inline uint32_t
+get_be32(const unsigned char *data)
+{
+	return (uint32_t) data[0] << 24 | (uint32_t) data[1] << 16 |
+	       (uint32_t) data[2] << 8 | data[3];
+}
+
+static inline uint16_t
+get_be16(const unsigned char *data)
+{
+	return (uint16_t) (data[0] << 8 | data[1]);
+}
+
+static bool
+index_open(const char *git_dir, struct index_file *index)
+{
+	char path[SIZEOF_STR];
+	struct stat st;
+	void *map;
+	int fd;
+
+	memset(index, 0, sizeof(*index));
+
+	if (!string_format(path, "%s/index", git_dir) ||
+	    (fd = open(path, O_RDONLY)) == -1)
+		return FALSE;
+
+	if (fstat(fd, &st) || st.st_size < INDEX_HEADER_SIZE + INDEX_HASH_SIZE) {
+		close(fd);
+		return FALSE;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return FALSE;
+
+	index->map = map;
+	index->size = st.st_size;
+	index->version = get_be32(index->map + 4);
+	index->entries = get_be32(index->map + 8);
+	index->mtime = st.st_mtime;
+	index->mtime_nsec = ST_MTIME_NSEC(&st);
+
+	if (memcmp(index->map, INDEX_SIGNATURE, 4) ||
+	    index->version < 2 || index->version > 4) {
+		munmap(map, index->size);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+index_close(struct index_file *index)
+{
+	if (index->map)
+		munmap((void *) index->map, index->size);
+}
+
+/* Decode the offset of a version 4 entry the same way git does. */
+static bool
+index_get_varint(const unsigned char **pos, const unsigned char *end, size_t *value)
+{
+	const unsigned char *data = *pos;
+	size_t val;
+
+	if (data >= end)
+		return FALSE;
+
+	val = *data & 127;
+	while (*data++ & 128) {
+		if (data >= end || val > (SIZE_MAX >> 8))
+			return FALSE;
+		val = ((val + 1) << 7) | (*data & 127);
+	}
+
+	*pos = data;
+	*value = val;
+	return TRUE;
+}
+
+/* Read the entry at pos, which is updated to point to the next entry.
+ * The previous path is kept in the entry for version 4. */
+static bool
+index_read_entry(struct index_file *index, const unsigned char **pos,
+		 const unsigned char *end, struct index_entry *entry)
+{
+	const unsigned char *data = *pos;
+	size_t header = INDEX_ENTRY_SIZE;
+	size_t pathlen;
+
+	if (end - data < header)
+		return FALSE;
+
+	entry->mtime = get_be32(data + 8);
+	entry->mtime_nsec = get_be32(data + 12);
+	entry->ino = get_be32(data + 20);
+	entry->mode = get_be32(data + 24);
+	entry->size = get_be32(data + 36);
+	entry->id = data + 40;
+	entry->flags = get_be16(data + 60);
+	entry->extended_flags = 0;
+
+	if (entry->flags & INDEX_FLAG_EXTENDED) {
+		if (index->version < 3 || end - data < header + 2)
+			return FALSE;
+		entry->extended_flags = get_be16(data + header);
+		header += 2;
+	}
+
+	data += header;
+
+	if (index->version == 4) {
+		size_t strip, prefix = strlen(entry->path);
+		const unsigned char *name;
+
+		if (!index_get_varint(&data, end, &strip) || strip > prefix)
+			return FALSE;
+
+		name = data;
+		data = memchr(name, 0, end - name);
+		if (!data)
+			return FALSE;
+
+		pathlen = prefix - strip + (data - name);
+		if (pathlen >= sizeof(entry->path))
+			return FALSE;
+
+		memcpy(entry->path + prefix - strip, name, data - name);
+		entry->path[pathlen] = 0;
+		*pos = data + 1;
+		return TRUE;
+	}
+
+	pathlen = entry->flags & INDEX_FLAG_NAMEMASK;
+	if (pathlen == INDEX_FLAG_NAMEMASK) {
+		const unsigned char *nul = memchr(data, 0, end - data);
+
+		if (!nul)
+			return FALSE;
+		pathlen = nul - data;
+	}
+
+	if (pathlen >= sizeof(entry->path) || end - data <= pathlen)
+		return FALSE;
+
+	memcpy(entry->path, data, pathlen);
+	entry->path[pathlen] = 0;
+
+	/* Entries are NUL padded to a multiple of eight bytes. */
+	*pos = *pos + ((header + pathlen + 8) & ~7);
+	return *pos <= end;
+}
+
+/* Find an extension in the data following the entries. */
+static const unsigned char *
+index_find_extension(const unsigned char *pos, const unsigned char *end,
+		     const char *name, uint32_t *size)
+{
+	while (end - pos >= 8) {
+		const unsigned char *data = pos + 8;
+
+		*size = get_be32(pos + 4);
+		if (end - data < *size)
+			return NULL;
+		if (!memcmp(pos, name, 4))
+			return data;
+		pos = data + *size;
+	}
+
+	return NULL;
+}
+
+/* Compare the stat data of the entry with the file, returning whether the
+ * file has changed or only may have changed. */
+static enum index_status
+index_stat_entry(struct index_file *index, struct index_entry *entry, const char *path)
+{
+	struct stat st;
+
+	if (lstat(path, &st))
+		return errno == ENOENT || errno == ENOTDIR ? INDEX_CHANGED : INDEX_UNKNOWN;
+
+	if ((entry->mode & S_IFMT) != (st.st_mode & S_IFMT))
+		return INDEX_CHANGED;
+
+	/* The executable bit is ignored when core.fileMode is false. */
+	if (S_ISREG(st.st_mode) && (entry->mode & 0100) != (st.st_mode & 0100))
+		return INDEX_UNKNOWN;
+
+	/* Git zeroes the size of entries written too close to the index
+	 * to force the content to be checked. */
+	if (entry->size != (uint32_t) st.st_size)
+		return entry->size ? INDEX_CHANGED : INDEX_UNKNOWN;
+
+	if (entry->mtime != (uint32_t) st.st_mtime ||
+	    entry->mtime_nsec != (uint32_t) ST_MTIME_NSEC(&st) ||
+	    entry->ino != (uint32_t) st.st_ino)
+		return INDEX_UNKNOWN;
+
+	/* Racily clean entries can have been changed without it showing in
+	 * the stat data. */
+	if (entry->mtime > (uint32_t) index->mtime ||
+	    (entry->mtime == (uint32_t) index->mtime &&
+	     entry->mtime_nsec >= (uint32_t) index->mtime_nsec))
+		return INDEX_UNKNOWN;
+
+	return INDEX_CLEAN;
+}
+
+struct index_diff {
+	struct index_file index;
+	const unsigned char *pos, *end;
+	uint32_t entries;		/* Entries left to check. */
+	struct index_entry entry;
+	enum index_status status;
+	char worktree[SIZEOF_STR];
+};
+
+/* Start checking the worktree against the index. The check is done in
+ * steps so large worktrees do not block the caller. */
+struct index_diff *
+index_diff_worktree_start(const char *git_dir, const char *worktree)
+{
+	struct index_diff *diff = calloc(1, sizeof(*diff));
+
+	if (!diff)
+		return NULL;
+
+	if (!index_open(git_dir, &diff->index) ||
+	    !string_format(diff->worktree, "%s", worktree)) {
+		diff->status = INDEX_UNKNOWN;
+		return diff;
+	}
+
+	diff->pos = diff->index.map + INDEX_HEADER_SIZE;
+	diff->end = diff->index.map + diff->index.size - INDEX_HASH_SIZE;
+	diff->entries = diff->index.entries;
+	diff->status = INDEX_CLEAN;
+	return diff;
+}
+
+static bool
+index_diff_expired(struct timeval *deadline)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return timercmp(&now, deadline, >=);
+}
+
+/* Check entries for about the given time, returns TRUE if there are more
+ * to check. Stops at the first file that has definitely changed. */
+bool
+index_diff_worktree_step(struct index_diff *diff, int msecs)
+{
+	struct index_entry *entry = &diff->entry;
+	struct timeval deadline, budget = { 0, msecs * 1000 };
+	uint32_t checked = 0;
+	uint32_t size;
+
+	gettimeofday(&deadline, NULL);
+	timeradd(&deadline, &budget, &deadline);
+
+	for (; diff->entries && diff->status != INDEX_CHANGED; diff->entries--) {
+		char path[SIZEOF_STR];
+		enum index_status status;
+
+		if (++checked % 256 == 0 && index_diff_expired(&deadline))
+			return TRUE;
+
+		if (!index_read_entry(&diff->index, &diff->pos, diff->end, entry)) {
+			diff->status = INDEX_UNKNOWN;
+			break;
+		}
+
+		if ((entry->flags & INDEX_FLAG_STAGE) ||
+		    (entry->extended_flags & INDEX_FLAG_INTENT_TO_ADD)) {
+			diff->status = INDEX_CHANGED;
+			break;
+		}
+
+		if ((entry->flags & INDEX_FLAG_VALID) ||
+		    (entry->extended_flags & INDEX_FLAG_SKIP_WORKTREE))
+			continue;
+
+		/* Submodules are compared by their checked out commit. */
+		if ((entry->mode & S_IFMT) == 0160000) {
+			diff->status = INDEX_UNKNOWN;
+			continue;
+		}
+
+		if (!string_format(path, "%s/%s", diff->worktree, entry->path))
+			status = INDEX_UNKNOWN;
+		else
+			status = index_stat_entry(&diff->index, entry, path);
+
+		if (status != INDEX_CLEAN)
+			diff->status = status;
+	}
+
+	/* With a split index the other entries live in a shared index,
+	 * which is not checked. */
+	if (diff->status == INDEX_CLEAN &&
+	    index_find_extension(diff->pos, diff->end, "link", &size))
+		diff->status = INDEX_UNKNOWN;
+
+	diff->entries = 0;
+	return FALSE;
+}
+
+enum index_status
+index_diff_worktree_done(struct index_diff *diff)
+{
+	enum index_status status = diff->status;
+
+	index_close(&diff->index);
+	free(diff);
+	return status;
+}
+
+/* List the files which have changed according to their stat data, with
+ * 'M', 'D' or 'U' like git-diff-files. Files which only may have changed
+ * are left out, so the result is only a first approximation. Returns
+ * FALSE when the index cannot be read or is split. */
+bool
+index_diff_worktree_files(const char *git_dir, const char *worktree,
+			  index_file_fn fn, void *data)
+{
+	struct index_file index;
+	struct index_entry entry;
+	const unsigned char *pos, *end;
+	char unmerged[SIZEOF_STR] = "";
+	uint32_t i, size;
+	bool ok = TRUE;
+
+	if (!index_open(git_dir, &index))
+		return FALSE;
+
+	pos = index.map + INDEX_HEADER_SIZE;
+	end = index.map + index.size - INDEX_HASH_SIZE;
+	entry.path[0] = 0;
+
+	for (i = 0; ok && i < index.entries; i++) {
+		char path[SIZEOF_STR];
+		struct stat st;
+
+		if (!index_read_entry(&index, &pos, end, &entry)) {
+			ok = FALSE;
+			break;
+		}
+
+		/* Unmerged paths have an entry per stage. */
+		if (entry.flags & INDEX_FLAG_STAGE) {
+			if (strcmp(entry.path, unmerged)) {
+				string_copy(unmerged, entry.path);
+				ok = fn(entry.path, 'U', data);
+			}
+			continue;
+		}
+
+		if ((entry.flags & INDEX_FLAG_VALID) ||
+		    (entry.extended_flags & (INDEX_FLAG_SKIP_WORKTREE | INDEX_FLAG_INTENT_TO_ADD)) ||
+		    (entry.mode & S_IFMT) == 0160000 ||
+		    !string_format(path, "%s/%s", worktree, entry.path) ||
+		    index_stat_entry(&index, &entry, path) != INDEX_CHANGED)
+			continue;
+
+		ok = fn(entry.path, lstat(path, &st) ? 'D' : 'M', data);
+	}
+
+	if (ok && index_find_extension(pos, end, "link", &size))
+		ok = FALSE;
+
+	index_close(&index);
+	return ok;
+}
+
+/* Find the id of the root tree in the cache tree extension, if it is
+ * still valid for the whole index. */
+static bool
+index_root_tree(struct index_file *index, char id[SIZEOF_REV])
+{
+	const unsigned char *pos = index->map + INDEX_HEADER_SIZE;
+	const unsigned char *end = index->map + index->size - INDEX_HASH_SIZE;
+	const unsigned char *data, *hash;
+	struct index_entry entry;
+	uint32_t i, size;
+	int entry_count;
+	int j;
+
+	entry.path[0] = 0;
+	for (i = 0; i < index->entries; i++)
+		if (!index_read_entry(index, &pos, end, &entry))
+			return FALSE;
+
+	/* Other entries live in a shared index. */
+	if (index_find_extension(pos, end, "link", &size))
+		return FALSE;
+
+	data = index_find_extension(pos, end, "TREE", &size);
+	if (!data)
+		return FALSE;
+
+	/* The root entry comes first and has an empty path. */
+	if (size < 1 || *data)
+		return FALSE;
+	entry_count = atoi((const char *) data + 1);
+	hash = memchr(data, '\n', size);
+	if (entry_count < 0 || !hash || data + size - ++hash < INDEX_HASH_SIZE)
+		return FALSE;
+
+	for (j = 0; j < INDEX_HASH_SIZE; j++)
+		sprintf(id + j * 2, "%02x", hash[j]);
+	return TRUE;
+}
+
+/* Check the index against a tree, which can only be done while the cache
+ * tree is valid. */
+enum index_status
+index_diff_tree(const char *git_dir, const char *tree_id)
+{
+	struct index_file index;
+	char id[SIZEOF_REV];
+	enum index_status status = INDEX_UNKNOWN;
+
+	if (!*tree_id || !index_open(git_dir, &index))
+		return INDEX_UNKNOWN;
+
+	if (index_root_tree(&index, id))
+		status = strcmp(id, tree_id) ? INDEX_CHANGED : INDEX_CLEAN;
+
+	index_close(&index);
+	return status;
+}
+
+/* vim: set ts=8 sw=8 noexpandtab: */
@@ -0,0 +1,43 @@
+/* Copyright (c) 2006-2013 Jonas Fonseca <fonseca@diku.dk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef TIG_INDEX_H
+#define TIG_INDEX_H
+
+#include "tig.h"
+
+/*
+ * Quick change detection by reading $GIT_DIR/index directly. The answers
+ * are only definite when they can be given from the stat data and the
+ * cached tree; otherwise git has to be asked.
+ */
+
+enum index_status {
+	INDEX_UNKNOWN,
+	INDEX_CLEAN,
+	INDEX_CHANGED,
+};
+
+struct index_diff;
+
+typedef bool (*index_file_fn)(const char *path, char status, void *data);
+
+struct index_diff *index_diff_worktree_start(const char *git_dir, const char *worktree);
+bool index_diff_worktree_step(struct index_diff *diff, int msecs);
+enum index_status index_diff_worktree_done(struct index_diff *diff);
+bool index_diff_worktree_files(const char *git_dir, const char *worktree,
+			       index_file_fn fn, void *data);
+enum index_status index_diff_tree(const char *git_dir, const char *tree_id);
+
+#endif
+/* vim: set ts=8 sw=8 noexpandtab: */
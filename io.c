@@ -329,6 +329,38 @@ io_kill(struct io *io)
 	return io->pid == 0 || kill(io->pid, SIGKILL) != -1;
 }
 
+/* Close the pipe, e.g. to end the input of a command, without waiting
+ * for the command to exit. */
+void
+io_close(struct io *io)
+{
+	if (io->pipe != -1)
+		close(io->pipe);
+	io->pipe = -1;
+}
+
+/* Check without blocking whether the command has exited and whether it
+ * succeeded. The command is reaped, so io_done() will not wait for it. */
+bool
+io_exited(struct io *io, bool *success)
+{
+	int status;
+	pid_t waiting;
+
+	if (io->pid <= 0)
+		return TRUE;
+
+	waiting = waitpid(io->pid, &status, WNOHANG);
+	if (waiting == 0 || (waiting < 0 && errno == EINTR))
+		return FALSE;
+
+	if (waiting < 0)
+		io->error = errno;
+	*success = waiting == io->pid && !WIFSIGNALED(status) && !WEXITSTATUS(status);
+	io->pid = 0;
+	return TRUE;
+}
+
 bool
 io_done(struct io *io)
 {
@@ -362,8 +394,8 @@ io_done(struct io *io)
 	return TRUE;
 }
 
-static int
-open_trace(int devnull, const char *argv[])
+static const char *
+get_trace_file(void)
 {
 	static const char *trace_file;
 
@@ -373,6 +405,31 @@ open_trace(int devnull, const char *argv[])
 			trace_file = "";
 	}
 
+	return trace_file;
+}
+
+/* Log to the trace file next to the traced commands. */
+void
+io_trace(const char *fmt, ...)
+{
+	const char *trace_file = get_trace_file();
+	va_list args;
+	FILE *file;
+
+	if (!*trace_file || !(file = fopen(trace_file, "a")))
+		return;
+
+	va_start(args, fmt);
+	vfprintf(file, fmt, args);
+	va_end(args);
+	fclose(file);
+}
+
+static int
+open_trace(int devnull, const char *argv[])
+{
+	const char *trace_file = get_trace_file();
+
 	if (*trace_file) {
 		int fd = open(trace_file, O_RDWR | O_CREAT | O_APPEND, 0666);
 		int i;
@@ -399,12 +456,20 @@ io_run(struct io *io, enum io_type type, const char *dir, char * const env[], co
 	int pipefds[2] = { -1, -1 };
 	va_list args;
 	bool read_from_stdin = type == IO_RD_STDIN;
+	int stdin_fd = -1;
 
 	io_init(io);
 
 	if (read_from_stdin)
 		type = IO_RD;
 
+	if (type == IO_RD_FD) {
+		va_start(args, argv);
+		stdin_fd = va_arg(args, int);
+		va_end(args);
+		type = IO_RD;
+	}
+
 	if (dir && !strcmp(dir, argv[0]))
 		return io_open(io, "%s%s", dir, argv[1]);
 
@@ -438,6 +503,8 @@ io_run(struct io *io, enum io_type type, const char *dir, char * const env[], co
 			/* Inject stdin given on the command line. */
 			if (read_from_stdin)
 				readfd = dup(STDIN_FILENO);
+			else if (stdin_fd != -1)
+				readfd = stdin_fd;
 
 			dup2(readfd,  STDIN_FILENO);
 			dup2(writefd, STDOUT_FILENO);
@@ -614,6 +681,28 @@ io_write(struct io *io, const void *buf, size_t bufsize)
 	return written == bufsize;
 }
 
+/* Write what fits in the pipe without blocking. Returns the number of
+ * bytes written or -1 on error. */
+ssize_t
+io_write_some(struct io *io, const void *buf, size_t bufsize)
+{
+	int flags = fcntl(io->pipe, F_GETFL);
+	ssize_t size;
+
+	if (flags == -1 ||
+	    (!(flags & O_NONBLOCK) && fcntl(io->pipe, F_SETFL, flags | O_NONBLOCK) == -1)) {
+		io->error = errno;
+		return -1;
+	}
+
+	size = write(io->pipe, buf, bufsize);
+	if (size < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (size < 0)
+		io->error = errno;
+	return size;
+}
+
 bool
 io_printf(struct io *io, const char *fmt, ...)
 {
@@ -58,6 +58,7 @@ enum io_type {
 	IO_FG,			/* Execute command with same std{in,out,err}. */
 	IO_RD,			/* Read only fork+exec IO. */
 	IO_RD_STDIN,		/* Read only fork+exec IO with stdin. */
+	IO_RD_FD,		/* Read only fork+exec IO with stdin from a file descriptor. */
 	IO_WR,			/* Write only fork+exec IO. */
 	IO_AP,			/* Append fork+exec output to file. */
 };
@@ -79,6 +80,8 @@ typedef int (*io_read_fn)(char *, size_t, char *, size_t, void *data);
 bool io_open(struct io *io, const char *fmt, ...) PRINTF_LIKE(2, 3);
 bool io_kill(struct io *io);
 bool io_done(struct io *io);
+void io_close(struct io *io);
+bool io_exited(struct io *io, bool *success);
 bool io_run(struct io *io, enum io_type type, const char *dir, char * const env[], const char *argv[], ...);
 bool io_run_bg(const char **argv);
 bool io_run_fg(const char **argv, const char *dir);
@@ -90,9 +93,11 @@ bool io_can_read(struct io *io, bool can_block);
 ssize_t io_read(struct io *io, void *buf, size_t bufsize);
 char * io_get(struct io *io, int c, bool can_read);
 bool io_write(struct io *io, const void *buf, size_t bufsize);
+ssize_t io_write_some(struct io *io, const void *buf, size_t bufsize);
 bool io_printf(struct io *io, const char *fmt, ...) PRINTF_LIKE(2, 3);
 bool io_read_buf(struct io *io, char buf[], size_t bufsize);
 bool io_run_buf(const char **argv, char buf[], size_t bufsize);
+void io_trace(const char *fmt, ...) PRINTF_LIKE(1, 2);
 int io_load(struct io *io, const char *separators,
 	    io_read_fn read_property, void *data);
 int io_run_load(const char **argv, const char *separators,
@@ -0,0 +1,475 @@
+/* Copyright (c) 2006-2013 Jonas Fonseca <fonseca@diku.dk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "tig.h"
+#include "lastmod.h"
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+/* The index file consists of a header, fixed size records sorted by path
+ * and a table of NUL terminated strings referenced by offset from the
+ * records. It is written in host byte order and mapped read-only, so
+ * lookups binary search the mapping directly without parsing it. */
+
+#define LASTMOD_FILE		"tig-last-modified"
+#define LASTMOD_SIGNATURE	"TLMI"
+#define LASTMOD_VERSION		1
+
+struct lastmod_header {
+	char signature[4];
+	uint32_t version;
+	uint32_t record_size;	/* Guards against layout differences. */
+	uint32_t records;
+	uint32_t strings;	/* Size of the string table. */
+	char commit[SIZEOF_REV];
+};
+
+struct lastmod_record {
+	int64_t time;
+	int32_t tz;
+	uint32_t path;		/* Offsets into the string table. */
+	uint32_t author_name;
+	uint32_t author_email;
+	char id[SIZEOF_REV];
+};
+
+/* Changes which have not yet been written to the index file. */
+struct lastmod_update {
+	char *path;
+	struct lastmod lastmod;
+};
+
+static char lastmod_file[SIZEOF_STR];
+static char lastmod_commit_id[SIZEOF_REV];
+
+static void *lastmod_map;
+static size_t lastmod_map_size;
+static const struct lastmod_record *lastmod_records;
+static size_t lastmod_records_size;
+static const char *lastmod_strings;
+static size_t lastmod_strings_size;
+
+static struct lastmod_update *lastmod_updates;
+static size_t lastmod_updates_size;
+
+DEFINE_ALLOCATOR(realloc_lastmod_updates, struct lastmod_update, 256)
+
+static void
+lastmod_unmap(void)
+{
+	if (lastmod_map)
+		munmap(lastmod_map, lastmod_map_size);
+	lastmod_map = NULL;
+	lastmod_map_size = 0;
+	lastmod_records = NULL;
+	lastmod_records_size = 0;
+	lastmod_strings = NULL;
+	lastmod_strings_size = 0;
+}
+
+static void
+lastmod_free_updates(void)
+{
+	size_t i;
+
+	for (i = 0; i < lastmod_updates_size; i++) {
+		free(lastmod_updates[i].path);
+		free((void *) lastmod_updates[i].lastmod.author_name);
+		free((void *) lastmod_updates[i].lastmod.author_email);
+	}
+
+	free(lastmod_updates);
+	lastmod_updates = NULL;
+	lastmod_updates_size = 0;
+}
+
+static bool
+lastmod_map_file(void)
+{
+	const struct lastmod_header *header;
+	struct stat st;
+	int fd = open(lastmod_file, O_RDONLY);
+
+	lastmod_unmap();
+	lastmod_commit_id[0] = 0;
+
+	if (fd == -1)
+		return FALSE;
+
+	if (fstat(fd, &st) || st.st_size < sizeof(*header)) {
+		close(fd);
+		return FALSE;
+	}
+
+	lastmod_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (lastmod_map == MAP_FAILED) {
+		lastmod_map = NULL;
+		return FALSE;
+	}
+
+	lastmod_map_size = st.st_size;
+	header = lastmod_map;
+
+	if (memcmp(header->signature, LASTMOD_SIGNATURE, sizeof(header->signature)) ||
+	    header->version != LASTMOD_VERSION ||
+	    header->record_size != sizeof(*lastmod_records) ||
+	    sizeof(*header) + (size_t) header->records * sizeof(*lastmod_records)
+		+ header->strings != lastmod_map_size ||
+	    !header->strings) {
+		lastmod_unmap();
+		return FALSE;
+	}
+
+	lastmod_records = (const struct lastmod_record *) (header + 1);
+	lastmod_records_size = header->records;
+	lastmod_strings = (const char *) (lastmod_records + lastmod_records_size);
+	lastmod_strings_size = header->strings;
+
+	/* Ensure all strings are terminated. */
+	if (lastmod_strings[lastmod_strings_size - 1]) {
+		lastmod_unmap();
+		return FALSE;
+	}
+
+	string_ncopy(lastmod_commit_id, header->commit, strnlen(header->commit, SIZEOF_REV));
+	return TRUE;
+}
+
+bool
+lastmod_load(const char *git_dir)
+{
+	if (*lastmod_file)
+		return TRUE;
+
+	if (!string_format(lastmod_file, "%s/%s", git_dir, LASTMOD_FILE)) {
+		lastmod_file[0] = 0;
+		return FALSE;
+	}
+
+	lastmod_map_file();
+	return TRUE;
+}
+
+const char *
+lastmod_commit(void)
+{
+	return lastmod_commit_id;
+}
+
+void
+lastmod_set_commit(const char *commit)
+{
+	string_copy_rev(lastmod_commit_id, commit);
+}
+
+void
+lastmod_reset(const char *commit)
+{
+	lastmod_unmap();
+	lastmod_free_updates();
+	lastmod_set_commit(commit);
+}
+
+static const char *
+lastmod_string(uint32_t offset)
+{
+	return offset < lastmod_strings_size ? lastmod_strings + offset : NULL;
+}
+
+static const struct lastmod_record *
+lastmod_find_record(const char *path)
+{
+	size_t from = 0, to = lastmod_records_size;
+
+	while (from < to) {
+		size_t pos = (from + to) / 2;
+		const char *record_path = lastmod_string(lastmod_records[pos].path);
+		int cmp;
+
+		if (!record_path)
+			return NULL;
+
+		cmp = strcmp(path, record_path);
+		if (!cmp)
+			return &lastmod_records[pos];
+		if (cmp < 0)
+			to = pos;
+		else
+			from = pos + 1;
+	}
+
+	return NULL;
+}
+
+/* Returns the position of the update for the path or where to insert it. */
+static size_t
+lastmod_find_update(const char *path, bool *found)
+{
+	size_t from = 0, to = lastmod_updates_size;
+
+	*found = FALSE;
+
+	while (from < to) {
+		size_t pos = (from + to) / 2;
+		int cmp = strcmp(path, lastmod_updates[pos].path);
+
+		if (!cmp) {
+			*found = TRUE;
+			return pos;
+		}
+		if (cmp < 0)
+			to = pos;
+		else
+			from = pos + 1;
+	}
+
+	return from;
+}
+
+static bool
+lastmod_from_record(const struct lastmod_record *record, struct lastmod *lastmod)
+{
+	lastmod->author_name = lastmod_string(record->author_name);
+	lastmod->author_email = lastmod_string(record->author_email);
+	if (!lastmod->author_name || !lastmod->author_email)
+		return FALSE;
+
+	string_copy_rev(lastmod->id, record->id);
+	lastmod->time = record->time;
+	lastmod->tz = record->tz;
+	return TRUE;
+}
+
+bool
+lastmod_get(const char *path, struct lastmod *lastmod)
+{
+	const struct lastmod_record *record;
+	bool found;
+	size_t pos = lastmod_find_update(path, &found);
+
+	if (found) {
+		*lastmod = lastmod_updates[pos].lastmod;
+		return TRUE;
+	}
+
+	record = lastmod_find_record(path);
+	return record && lastmod_from_record(record, lastmod);
+}
+
+bool
+lastmod_set(const char *path, const struct lastmod *lastmod)
+{
+	struct lastmod_update update = { NULL, *lastmod };
+	bool found;
+	size_t pos = lastmod_find_update(path, &found);
+
+	update.path = strdup(path);
+	update.lastmod.author_name = strdup(lastmod->author_name);
+	update.lastmod.author_email = strdup(lastmod->author_email);
+	if (!update.path || !update.lastmod.author_name || !update.lastmod.author_email)
+		goto error;
+
+	if (found) {
+		free(lastmod_updates[pos].path);
+		free((void *) lastmod_updates[pos].lastmod.author_name);
+		free((void *) lastmod_updates[pos].lastmod.author_email);
+
+	} else {
+		if (!realloc_lastmod_updates(&lastmod_updates, lastmod_updates_size, 1))
+			goto error;
+		memmove(lastmod_updates + pos + 1, lastmod_updates + pos,
+			(lastmod_updates_size - pos) * sizeof(*lastmod_updates));
+		lastmod_updates_size++;
+	}
+
+	lastmod_updates[pos] = update;
+	return TRUE;
+
+error:
+	free(update.path);
+	free((void *) update.lastmod.author_name);
+	free((void *) update.lastmod.author_email);
+	return FALSE;
+}
+
+DEFINE_ALLOCATOR(realloc_lastmod_strings, char, 8192)
+
+struct lastmod_writer {
+	FILE *file;
+	char *strings;
+	size_t strings_size;
+	size_t records;
+	uint32_t *interned;	/* Hash of author strings to offset + 1. */
+	size_t interned_slots;	/* Number of hash slots; a power of two. */
+	size_t interned_size;
+};
+
+static bool
+lastmod_add_string(struct lastmod_writer *writer, const char *string, uint32_t *offset)
+{
+	size_t len = strlen(string) + 1;
+
+	if (writer->strings_size + len > UINT32_MAX ||
+	    !realloc_lastmod_strings(&writer->strings, writer->strings_size, len))
+		return FALSE;
+
+	memcpy(writer->strings + writer->strings_size, string, len);
+	*offset = writer->strings_size;
+	writer->strings_size += len;
+	return TRUE;
+}
+
+/* Author names and emails are shared by many records, so each is only
+ * stored once in the string table. */
+static bool
+lastmod_intern_string(struct lastmod_writer *writer, const char *string, uint32_t *offset)
+{
+	size_t slot;
+
+	if (writer->interned_size * 2 >= writer->interned_slots) {
+		size_t slots = writer->interned_slots ? writer->interned_slots * 2 : 256;
+		uint32_t *interned = calloc(slots, sizeof(*interned));
+		size_t i;
+
+		if (!interned)
+			return FALSE;
+
+		for (i = 0; i < writer->interned_slots; i++) {
+			uint32_t entry = writer->interned[i];
+
+			if (!entry)
+				continue;
+			slot = string_hash(writer->strings + entry - 1) & (slots - 1);
+			while (interned[slot])
+				slot = (slot + 1) & (slots - 1);
+			interned[slot] = entry;
+		}
+
+		free(writer->interned);
+		writer->interned = interned;
+		writer->interned_slots = slots;
+	}
+
+	slot = string_hash(string) & (writer->interned_slots - 1);
+	for (; writer->interned[slot]; slot = (slot + 1) & (writer->interned_slots - 1)) {
+		if (!strcmp(writer->strings + writer->interned[slot] - 1, string)) {
+			*offset = writer->interned[slot] - 1;
+			return TRUE;
+		}
+	}
+
+	if (!lastmod_add_string(writer, string, offset))
+		return FALSE;
+	writer->interned[slot] = *offset + 1;
+	writer->interned_size++;
+	return TRUE;
+}
+
+static bool
+lastmod_write_record(struct lastmod_writer *writer, const char *path, const struct lastmod *lastmod)
+{
+	struct lastmod_record record;
+
+	memset(&record, 0, sizeof(record));
+	record.time = lastmod->time;
+	record.tz = lastmod->tz;
+	string_copy_rev(record.id, lastmod->id);
+
+	if (!lastmod_add_string(writer, path, &record.path) ||
+	    !lastmod_intern_string(writer, lastmod->author_name, &record.author_name) ||
+	    !lastmod_intern_string(writer, lastmod->author_email, &record.author_email))
+		return FALSE;
+
+	writer->records++;
+	return fwrite(&record, sizeof(record), 1, writer->file) == 1;
+}
+
+/* Merge the pending updates with the mapped records into a new index
+ * file, which atomically replaces the old one. */
+bool
+lastmod_save(void)
+{
+	struct lastmod_writer writer = {};
+	struct lastmod_header header;
+	char tmp[SIZEOF_STR];
+	size_t record = 0, update = 0;
+	bool ok = TRUE;
+
+	if (!*lastmod_file || !*lastmod_commit_id ||
+	    !string_format(tmp, "%s.tmp", lastmod_file))
+		return FALSE;
+
+	writer.file = fopen(tmp, "w");
+	if (!writer.file)
+		return FALSE;
+
+	memset(&header, 0, sizeof(header));
+	ok = fwrite(&header, sizeof(header), 1, writer.file) == 1;
+
+	while (ok && (record < lastmod_records_size || update < lastmod_updates_size)) {
+		const char *path = record < lastmod_records_size
+				 ? lastmod_string(lastmod_records[record].path) : NULL;
+		struct lastmod lastmod;
+		int cmp;
+
+		if (record < lastmod_records_size && !path) {
+			ok = FALSE;
+			break;
+		}
+
+		cmp = !path ? 1 : update >= lastmod_updates_size ? -1
+		    : strcmp(path, lastmod_updates[update].path);
+
+		if (cmp < 0) {
+			ok = lastmod_from_record(&lastmod_records[record++], &lastmod) &&
+			     lastmod_write_record(&writer, path, &lastmod);
+		} else {
+			if (!cmp)
+				record++;
+			ok = lastmod_write_record(&writer, lastmod_updates[update].path,
+						  &lastmod_updates[update].lastmod);
+			update++;
+		}
+	}
+
+	/* The string table must never be empty. */
+	if (ok && !writer.strings_size)
+		ok = lastmod_add_string(&writer, "", &header.strings);
+
+	if (ok) {
+		memcpy(header.signature, LASTMOD_SIGNATURE, sizeof(header.signature));
+		header.version = LASTMOD_VERSION;
+		header.record_size = sizeof(struct lastmod_record);
+		header.records = writer.records;
+		header.strings = writer.strings_size;
+		string_copy_rev(header.commit, lastmod_commit_id);
+
+		ok = fwrite(writer.strings, writer.strings_size, 1, writer.file) == 1 &&
+		     !fseek(writer.file, 0, SEEK_SET) &&
+		     fwrite(&header, sizeof(header), 1, writer.file) == 1;
+	}
+
+	free(writer.strings);
+	free(writer.interned);
+	if (fclose(writer.file) || !ok || rename(tmp, lastmod_file)) {
+		unlink(tmp);
+		return FALSE;
+	}
+
+	lastmod_free_updates();
+	return lastmod_map_file();
+}
+
+/* vim: set ts=8 sw=8 noexpandtab: */
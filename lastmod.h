@@ -0,0 +1,42 @@
+/* Copyright (c) 2006-2013 Jonas Fonseca <fonseca@diku.dk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef TIG_LASTMOD_H
+#define TIG_LASTMOD_H
+
+#include "tig.h"
+
+/*
+ * Persistent index of the commits that last modified each path as of a
+ * given commit. It is stored in $GIT_DIR so that the tree view can show
+ * dates and authors without walking the history.
+ */
+
+struct lastmod {
+	char id[SIZEOF_REV];		/* Commit that last modified the path. */
+	const char *author_name;
+	const char *author_email;
+	time_t time;			/* Author date. */
+	int tz;				/* Author time zone offset in seconds. */
+};
+
+bool lastmod_load(const char *git_dir);
+const char *lastmod_commit(void);
+void lastmod_set_commit(const char *commit);
+void lastmod_reset(const char *commit);
+bool lastmod_get(const char *path, struct lastmod *lastmod);
+bool lastmod_set(const char *path, const struct lastmod *lastmod);
+bool lastmod_save(void);
+
+#endif
+/* vim: set ts=8 sw=8 noexpandtab: */
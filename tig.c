@@ -19,6 +19,9 @@
 #include "refs.h"
 #include "graph.h"
 #include "git.h"
+#include "lastmod.h"
+#include "watch.h"
+#include "index.h"
 
 static void report(const char *msg, ...) PRINTF_LIKE(1, 2);
 #define report_clear() report("%s", "")
@@ -316,6 +319,7 @@ DEFINE_ENUM(commit_order, COMMIT_ORDER_ENUM);
 	_(BLOB,   blob,   ref_blob), \
 	_(BLAME,  blame,  ref_commit), \
 	_(BRANCH, branch, ref_head), \
+	_(FINDER, finder, ref_commit), \
 	_(HELP,   help,   ""), \
 	_(PAGER,  pager,  ""), \
 	_(STATUS, status, "status"), \
@@ -351,8 +355,13 @@ DEFINE_ENUM(commit_order, COMMIT_ORDER_ENUM);
 	REQ_(STAGE_UPDATE_LINE,	"Update single line"), \
 	REQ_(STAGE_NEXT,	"Find next chunk to stage"), \
 	REQ_(STAGE_SPLIT_CHUNK,	"Split the current chunk"), \
+	REQ_(STAGE_SELECT_LINE,	"Select line or chunk to update"), \
 	REQ_(DIFF_CONTEXT_DOWN,	"Decrease the diff context"), \
 	REQ_(DIFF_CONTEXT_UP,	"Increase the diff context"), \
+	REQ_(DIFF_NEXT_FILE,	"Move to next file in the diff"), \
+	REQ_(DIFF_PREV_FILE,	"Move to previous file in the diff"), \
+	REQ_(DIFF_NEXT_CHUNK,	"Move to next chunk in the diff"), \
+	REQ_(DIFF_PREV_CHUNK,	"Move to previous chunk in the diff"), \
 	\
 	REQ_GROUP("Cursor navigation") \
 	REQ_(MOVE_UP,		"Move cursor one line up"), \
@@ -468,11 +477,16 @@ static bool opt_line_number		= FALSE;
 static bool opt_show_refs		= TRUE;
 static bool opt_show_changes		= TRUE;
 static bool opt_untracked_dirs_content	= TRUE;
+static bool opt_status_porcelain	= FALSE;
+static bool opt_auto_refresh		= FALSE;
 static bool opt_read_git_colors		= TRUE;
 static bool opt_wrap_lines		= FALSE;
 static bool opt_ignore_case		= FALSE;
 static bool opt_focus_child		= TRUE;
 static int opt_diff_context		= 3;
+static int opt_diff_lazy_files		= 0;
+static int opt_diff_cache_size		= 8192;
+static int opt_diff_prefetch		= 2;
 static char opt_diff_context_arg[9]	= "";
 static enum ignore_space opt_ignore_space	= IGNORE_SPACE_NO;
 static char opt_ignore_space_arg[22]	= "";
@@ -502,6 +516,7 @@ static char opt_git_dir[SIZEOF_STR]	= "";
 static signed char opt_is_inside_work_tree	= -1; /* set to TRUE or FALSE */
 static char opt_editor[SIZEOF_STR]	= "";
 static bool opt_editor_lineno		= TRUE;
+static bool opt_tree_date_index		= FALSE;
 static FILE *opt_tty			= NULL;
 static const char **opt_diff_argv	= NULL;
 static const char **opt_rev_argv	= NULL;
@@ -905,6 +920,7 @@ static struct keybinding default_keybindings[] = {
 	{ 'f',		REQ_VIEW_BLOB },
 	{ 'B',		REQ_VIEW_BLAME },
 	{ 'H',		REQ_VIEW_BRANCH },
+	{ 'T',		REQ_VIEW_FINDER },
 	{ 'p',		REQ_VIEW_PAGER },
 	{ 'h',		REQ_VIEW_HELP },
 	{ 'S',		REQ_VIEW_STATUS },
@@ -932,8 +948,13 @@ static struct keybinding default_keybindings[] = {
 	{ '1',		REQ_STAGE_UPDATE_LINE },
 	{ '@',		REQ_STAGE_NEXT },
 	{ '\\',		REQ_STAGE_SPLIT_CHUNK },
+	{ 'x',		REQ_STAGE_SELECT_LINE },
 	{ '[',		REQ_DIFF_CONTEXT_DOWN },
 	{ ']',		REQ_DIFF_CONTEXT_UP },
+	{ '}',		REQ_DIFF_NEXT_FILE },
+	{ '{',		REQ_DIFF_PREV_FILE },
+	{ ')',		REQ_DIFF_NEXT_CHUNK },
+	{ '(',		REQ_DIFF_PREV_CHUNK },
 
 	/* Cursor navigation */
 	{ 'k',		REQ_MOVE_UP },
@@ -1583,6 +1604,15 @@ option_set_command(int argc, const char *argv[])
 		return code;
 	}
 
+	if (!strcmp(argv[0], "diff-lazy-files"))
+		return parse_int(&opt_diff_lazy_files, argv[2], 0, 999999);
+
+	if (!strcmp(argv[0], "diff-cache-size"))
+		return parse_int(&opt_diff_cache_size, argv[2], 0, 4 * 1024 * 1024);
+
+	if (!strcmp(argv[0], "diff-prefetch"))
+		return parse_int(&opt_diff_prefetch, argv[2], 0, DIFF_PREFETCH_MAX);
+
 	if (!strcmp(argv[0], "ignore-space")) {
 		enum status_code code = parse_enum(&opt_ignore_space, argv[2], ignore_space_map);
 
@@ -1602,6 +1632,12 @@ option_set_command(int argc, const char *argv[])
 	if (!strcmp(argv[0], "status-untracked-dirs"))
 		return parse_bool(&opt_untracked_dirs_content, argv[2]);
 
+	if (!strcmp(argv[0], "status-porcelain"))
+		return parse_bool(&opt_status_porcelain, argv[2]);
+
+	if (!strcmp(argv[0], "auto-refresh"))
+		return parse_bool(&opt_auto_refresh, argv[2]);
+
 	if (!strcmp(argv[0], "read-git-colors"))
 		return parse_bool(&opt_read_git_colors, argv[2]);
 
@@ -1645,6 +1681,9 @@ option_set_command(int argc, const char *argv[])
 	if (!strcmp(argv[0], "editor-line-number"))
 		return parse_bool(&opt_editor_lineno, argv[2]);
 
+	if (!strcmp(argv[0], "tree-date-index"))
+		return parse_bool(&opt_tree_date_index, argv[2]);
+
 	return ERROR_UNKNOWN_VARIABLE_NAME;
 }
 
@@ -3394,6 +3433,68 @@ update_view(struct view *view)
 	return TRUE;
 }
 
+/*
+ * Background jobs
+ *
+ * Jobs are polled from the input loop and return TRUE while they have
+ * more work to do. While any job is active the input loop wakes up
+ * regularly so they can make progress without waiting for key presses.
+ */
+
+#define BACKGROUND_POLL_DELAY	20	/* Milliseconds between polls when idle. */
+
+typedef bool (*background_fn)(void *data);
+
+struct background_job {
+	background_fn poll;
+	void *data;
+	bool again;		/* Added again while being polled. */
+};
+
+static struct background_job background_jobs[16];
+static size_t background_jobs_size;
+
+static bool
+background_add(background_fn poll, void *data)
+{
+	size_t i;
+
+	for (i = 0; i < background_jobs_size; i++) {
+		if (background_jobs[i].poll == poll && background_jobs[i].data == data) {
+			background_jobs[i].again = TRUE;
+			return TRUE;
+		}
+	}
+
+	if (background_jobs_size >= ARRAY_SIZE(background_jobs))
+		return FALSE;
+
+	background_jobs[background_jobs_size].poll = poll;
+	background_jobs[background_jobs_size].data = data;
+	background_jobs[background_jobs_size++].again = FALSE;
+	return TRUE;
+}
+
+static bool
+background_poll(void)
+{
+	size_t i = 0;
+
+	while (i < background_jobs_size) {
+		struct background_job *job = &background_jobs[i];
+
+		job->again = FALSE;
+		if (job->poll(job->data) || job->again) {
+			i++;
+			continue;
+		}
+
+		memmove(job, job + 1, (--background_jobs_size - i) * sizeof(*job));
+	}
+
+	return background_jobs_size > 0;
+}
+
 DEFINE_ALLOCATOR(realloc_lines, struct line, 256)
 
 static struct line *
@@ -3421,10 +3522,12 @@ add_line_at(struct view *view, unsigned long pos, const void *data, enum line_ty
 		line = view->line + pos;
 		lineno = line->lineno;
 
-		memmove(line + 1, line, (view->lines - pos) * sizeof(*view->line));
-		while (pos < view->lines) {
-			view->line[pos].lineno++;
-			view->line[pos++].dirty = 1;
+		memmove(line + 1, line, (view->lines - pos - 1) * sizeof(*view->line));
+		while (++pos < view->lines) {
+			/* Custom lines are not numbered. */
+			if (!custom)
+				view->line[pos].lineno++;
+			view->line[pos].dirty = 1;
 		}
 	} else {
 		line = &view->line[view->lines++];
@@ -3531,10 +3634,14 @@ load_view(struct view *view, struct view *prev, enum open_flags flags)
 	if (view->pipe)
 		end_update(view, TRUE);
 	if (view->ops->private_size) {
-		if (!view->private)
+		if (!view->private) {
 			view->private = calloc(1, view->ops->private_size);
-		else
+		} else {
+			/* Free what the old state owns before clearing it. */
+			if (view->ops->done)
+				view->ops->done(view);
 			memset(view->private, 0, view->ops->private_size);
+		}
 	}
 
 	/* When prev == view it means this is the first loaded view. */
@@ -3746,6 +3853,8 @@ open_run_request(struct view *view, enum request request)
  * User request switch noodle
  */
 
+static bool status_update_stop(void);
+
 static int
 view_driver(struct view *view, enum request request)
 {
@@ -3792,6 +3901,7 @@ view_driver(struct view *view, enum request request)
 	case REQ_VIEW_TREE:
 	case REQ_VIEW_HELP:
 	case REQ_VIEW_BRANCH:
+	case REQ_VIEW_FINDER:
 	case REQ_VIEW_BLAME:
 	case REQ_VIEW_BLOB:
 	case REQ_VIEW_STATUS:
@@ -3915,6 +4025,8 @@ view_driver(struct view *view, enum request request)
 				report("Stopped loading the %s view", view->name),
 			end_update(view, TRUE);
 		}
+		if (status_update_stop())
+			report("Stopped updating files");
 		break;
 
 	case REQ_SHOW_VERSION:
@@ -4165,9 +4277,15 @@ parse_author_line(char *ident, const struct ident **author, struct time *time)
 	}
 }
 
+static struct line *diff_index_find(struct view *view, struct line *line, enum line_type type, int direction);
+
 static struct line *
 find_line_by_type(struct view *view, struct line *line, enum line_type type, int direction)
 {
+	if (view_has_flags(view, VIEW_DIFF_LIKE) &&
+	    (type == LINE_DIFF_HEADER || type == LINE_DIFF_CHUNK))
+		return diff_index_find(view, line, type, direction);
+
 	for (; view_has_line(view, line); line += direction)
 		if (line->type == type)
 			return line;
@@ -4640,25 +4758,325 @@ static struct view_ops log_ops = {
 	log_select,
 };
 
+/* Line numbers of file or chunk headers in the order they were read. */
+struct diff_index {
+	unsigned long *lines;
+	size_t size;
+};
+
 struct diff_state {
 	bool after_commit_title;
 	bool after_diff;
 	bool reading_diff_stat;
 	bool combined_diff;
+	bool index_stale;	/* Lines have been inserted or removed. */
+	bool lazy;		/* Patches are loaded per file. */
+	struct diff_index headers;
+	struct diff_index chunks;
 };
 
+/* The stage view draws with the diff view and uses 2 for STAGE_LINE_SELECTED. */
 #define DIFF_LINE_COMMIT_TITLE 1
+#define DIFF_LINE_LAZY 4	/* The file's patch has not been loaded. */
+#define DIFF_LINE_FOLDED 8	/* The file's patch has been hidden. */
+
+DEFINE_ALLOCATOR(realloc_diff_index, unsigned long, 256)
 
 static bool
-diff_open(struct view *view, enum open_flags flags)
+diff_index_add(struct diff_index *index, unsigned long lineno)
 {
-	static const char *diff_argv[] = {
-		"git", "show", encoding_arg, "--pretty=fuller", "--root",
-			"--patch-with-stat",
-			opt_notes_arg, opt_diff_context_arg, opt_ignore_space_arg,
-			"%(diffargs)", "--no-color", "%(commit)", "--", "%(fileargs)", NULL
-	};
+	if (!realloc_diff_index(&index->lines, index->size, 1))
+		return FALSE;
+	index->lines[index->size++] = lineno;
+	return TRUE;
+}
+
+static void
+diff_index_free(struct diff_state *state)
+{
+	free(state->headers.lines);
+	free(state->chunks.lines);
+	memset(&state->headers, 0, sizeof(state->headers));
+	memset(&state->chunks, 0, sizeof(state->chunks));
+}
+
+static bool
+diff_index_update(struct view *view, struct diff_state *state)
+{
+	size_t i;
+
+	if (!state->index_stale)
+		return TRUE;
+
+	diff_index_free(state);
+	for (i = 0; i < view->lines; i++) {
+		enum line_type type = view->line[i].type;
+
+		if ((type == LINE_DIFF_HEADER && !diff_index_add(&state->headers, i)) ||
+		    (type == LINE_DIFF_CHUNK && !diff_index_add(&state->chunks, i)))
+			return FALSE;
+	}
+
+	state->index_stale = FALSE;
+	return TRUE;
+}
+
+/* The number of entries at or before the line. */
+static size_t
+diff_index_count(struct diff_index *index, unsigned long lineno)
+{
+	size_t low = 0, high = index->size;
+
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+
+		if (index->lines[mid] <= lineno)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+static struct diff_index *
+diff_get_index(struct view *view, enum line_type type)
+{
+	struct diff_state *state = view->private;
+
+	if (!diff_index_update(view, state))
+		return NULL;
+	return type == LINE_DIFF_HEADER ? &state->headers : &state->chunks;
+}
+
+/* Find the closest file or chunk header at or before (direction < 0) or
+ * at or after the line. */
+static struct line *
+diff_index_find(struct view *view, struct line *line, enum line_type type, int direction)
+{
+	struct diff_index *index = diff_get_index(view, type);
+	unsigned long lineno;
+	size_t pos;
+
+	if (!index || !view_has_line(view, line))
+		return NULL;
+
+	lineno = line - view->line;
+	pos = diff_index_count(index, lineno);
+	if (direction > 0 && !(pos && index->lines[pos - 1] == lineno))
+		pos++;
+
+	if (!pos || pos > index->size || index->lines[pos - 1] >= view->lines)
+		return NULL;
+	return &view->line[index->lines[pos - 1]];
+}
+
+/* Cache of loaded diffs keyed by the arguments used to load them, which
+ * include the commit, the diff options and the file filter, so revisiting
+ * a commit does not need to rerun git. The least recently used diffs are
+ * evicted when the cache grows beyond the 'diff-cache-size' option. */
+
+struct diff_cache {
+	char *key;		/* Arguments of the diff joined by newlines. */
+	char **line;		/* The lines as read from git. */
+	size_t lines;
+	size_t bytes;		/* Memory used by this diff. */
+};
+
+/* Ordered from least to most recently used. */
+static struct diff_cache *diff_cache;
+static size_t diff_cache_size;
+static size_t diff_cache_bytes;
+
+DEFINE_ALLOCATOR(realloc_diff_cache, struct diff_cache, 16)
+
+static char *
+diff_cache_key(const char *argv[])
+{
+	size_t size = 1, i;
+	char *key;
+
+	for (i = 0; argv && argv[i]; i++)
+		size += strlen(argv[i]) + 1;
+
+	key = malloc(size);
+	if (!key)
+		return NULL;
+
+	for (size = 0, i = 0; argv && argv[i]; i++) {
+		size_t len = strlen(argv[i]);
+
+		memcpy(key + size, argv[i], len);
+		key[size + len] = '\n';
+		size += len + 1;
+	}
+	key[size] = 0;
+
+	return key;
+}
+
+static void
+diff_cache_remove(size_t pos)
+{
+	struct diff_cache *cache = &diff_cache[pos];
+	size_t i;
+
+	for (i = 0; i < cache->lines; i++)
+		free(cache->line[i]);
+	free(cache->line);
+	free(cache->key);
+	diff_cache_bytes -= cache->bytes;
+
+	memmove(cache, cache + 1, (diff_cache_size - pos - 1) * sizeof(*cache));
+	diff_cache_size--;
+}
+
+static struct diff_cache *
+diff_cache_find(const char *key)
+{
+	size_t i;
+
+	for (i = 0; key && i < diff_cache_size; i++) {
+		struct diff_cache cache = diff_cache[i];
+
+		if (strcmp(cache.key, key))
+			continue;
+
+		/* Mark as the most recently used diff. */
+		memmove(&diff_cache[i], &diff_cache[i + 1], (diff_cache_size - i - 1) * sizeof(cache));
+		diff_cache[diff_cache_size - 1] = cache;
+		return &diff_cache[diff_cache_size - 1];
+	}
+
+	return NULL;
+}
+
+/* Add the lines of a diff to the cache, which takes ownership of the key
+ * and the lines, also on failure. */
+static bool
+diff_cache_add(char *key, char **line, size_t lines)
+{
+	size_t budget = (size_t) opt_diff_cache_size * 1024;
+	struct diff_cache *cache;
+	size_t bytes = lines * sizeof(*line);
+	size_t i;
+
+	for (i = 0; i < lines; i++)
+		bytes += strlen(line[i]) + 1;
+
+	if (!key || bytes > budget || !realloc_diff_cache(&diff_cache, diff_cache_size, 1)) {
+		for (i = 0; i < lines; i++)
+			free(line[i]);
+		free(line);
+		free(key);
+		return FALSE;
+	}
+
+	if (diff_cache_find(key))
+		diff_cache_remove(diff_cache_size - 1);
+
+	cache = &diff_cache[diff_cache_size++];
+	cache->key = key;
+	cache->line = line;
+	cache->lines = lines;
+	cache->bytes = bytes;
+	diff_cache_bytes += bytes;
+
+	while (diff_cache_bytes > budget && diff_cache_size > 1)
+		diff_cache_remove(0);
+	return TRUE;
+}
+
+/* Save a completely loaded diff of a commit. */
+static void
+diff_cache_save(struct view *view)
+{
+	char **line = NULL;
+	size_t lines = 0, i;
+
+	if (!opt_diff_cache_size || !iscommit(view->vid) ||
+	    !(line = calloc(view->lines, sizeof(*line))))
+		return;
+
+	for (i = 0; i < view->lines; i++) {
+		/* Refs are added while reading the commit line. */
+		if (view->line[i].type == LINE_PP_REFS)
+			continue;
+		if (view->line[i].wrapped ||
+		    !(line[lines] = strdup(view->line[i].data)))
+			break;
+		lines++;
+	}
+
+	if (i < view->lines) {
+		while (lines > 0)
+			free(line[--lines]);
+		free(line);
+		return;
+	}
+
+	diff_cache_add(diff_cache_key(view->argv), line, lines);
+}
 
+static bool
+diff_cache_load(struct view *view, const char *argv[], enum open_flags flags)
+{
+	bool reload = !!(flags & (OPEN_RELOAD | OPEN_REFRESH | OPEN_PREPARED | OPEN_EXTRA | OPEN_PAGER_MODE));
+	bool file_filter = !view_has_flags(view, VIEW_FILE_FILTER) || opt_file_filter;
+	struct diff_cache *cache;
+	struct diff_state *state = view->private;
+	char *key;
+	size_t i;
+
+	if (!opt_diff_cache_size || !iscommit((char *) view->id) ||
+	    (flags & ~(OPEN_SPLIT | OPEN_RELOAD)) ||
+	    (!reload && !strcmp(view->vid, view->id)))
+		return FALSE;
+
+	view->dir = NULL;
+	if (!format_argv(view, &view->argv, argv, !view->prev, file_filter))
+		return FALSE;
+
+	key = diff_cache_key(view->argv);
+	cache = diff_cache_find(key);
+	free(key);
+	if (!cache)
+		return FALSE;
+
+	if (view->pipe)
+		end_update(view, TRUE);
+	view->unrefreshable = FALSE;
+	string_copy_rev(view->ref, view->id);
+	setup_update(view, view->id);
+	view->pipe = NULL;
+
+	for (i = 0; i < cache->lines; i++) {
+		if (!view->ops->read(view, cache->line[i])) {
+			reset_view(view);
+			return FALSE;
+		}
+	}
+
+	/* Like a loaded diff, a different commit starts at the top. */
+	if (!(flags & OPEN_RELOAD))
+		clear_position(&view->prev_pos);
+
+	state->index_stale = TRUE;
+	return TRUE;
+}
+
+static const char *diff_argv[] = {
+	"git", "show", encoding_arg, "--pretty=fuller", "--root",
+		"--patch-with-stat",
+		opt_notes_arg, opt_diff_context_arg, opt_ignore_space_arg,
+		"%(diffargs)", "--no-color", "%(commit)", "--", "%(fileargs)", NULL
+};
+
+static bool
+diff_open(struct view *view, enum open_flags flags)
+{
+	if (diff_cache_load(view, diff_argv, flags))
+		return TRUE;
 	return begin_update(view, NULL, diff_argv, flags);
 }
 
@@ -4716,2746 +5134,7272 @@ diff_common_read(struct view *view, const char *data, struct diff_state *state)
 	if (!state->combined_diff && (type == LINE_DIFF_ADD2 || type == LINE_DIFF_DEL2))
 		type = LINE_DEFAULT;
 
-	return pager_common_read(view, data, type);
-}
+	if (type == LINE_DIFF_HEADER || type == LINE_DIFF_CHUNK) {
+		unsigned long lineno = view->lines;
 
-static bool
-diff_find_stat_entry(struct view *view, struct line *line, enum line_type type)
-{
-	struct line *marker = find_next_line_by_type(view, line, type);
+		return pager_common_read(view, data, type) &&
+		       diff_index_add(type == LINE_DIFF_HEADER ? &state->headers : &state->chunks,
+				      lineno);
+	}
 
-	return marker &&
-		line == find_prev_line_by_type(view, marker, LINE_DIFF_HEADER);
+	return pager_common_read(view, data, type);
 }
 
-static enum request
-diff_common_enter(struct view *view, enum request request, struct line *line)
-{
-	if (line->type == LINE_DIFF_STAT) {
-		int file_number = 0;
+/*
+ * Lazily loaded diffs: for commits changing many files only the list of
+ * files is loaded up front and the patch of each file is loaded when its
+ * header is shown.
+ */
 
-		while (view_has_line(view, line) && line->type == LINE_DIFF_STAT) {
-			file_number++;
-			line--;
-		}
+struct diff_file {
+	unsigned long lineno;	/* Line of the file's diff header. */
+	char *old_name;
+	char *new_name;
+};
 
-		for (line = view->line; view_has_line(view, line); line++) {
-			line = find_next_line_by_type(view, line, LINE_DIFF_HEADER);
-			if (!line)
-				break;
+struct diff_lazy {
+	struct view *view;
+	struct io io;
+	bool running;
+	bool reading_files;	/* Reading the file list, else a patch. */
+	char status;		/* Status of the file entry being read. */
+	char *old_name;		/* Source path of a rename or copy. */
+	struct diff_file *files;
+	size_t files_size;
+	size_t file;		/* File whose patch is being read. */
+	char **lines;
+	size_t size;
+};
 
-			if (diff_find_stat_entry(view, line, LINE_DIFF_INDEX)
-			    || diff_find_stat_entry(view, line, LINE_DIFF_SIMILARITY)) {
-				if (file_number == 1) {
-					break;
-				}
-				file_number--;
-			}
-		}
+static struct diff_lazy diff_lazy;
 
-		if (!line) {
-			report("Failed to find file diff");
-			return REQ_NONE;
-		}
+DEFINE_ALLOCATOR(realloc_diff_files, struct diff_file, 256)
+DEFINE_ALLOCATOR(realloc_diff_lazy_lines, char *, 256)
 
-		select_view_line(view, line - view->line);
-		report_clear();
-		return REQ_NONE;
+static void
+diff_lazy_stop(void)
+{
+	struct diff_lazy *job = &diff_lazy;
+	size_t i;
 
-	} else {
-		return pager_request(view, request, line);
+	if (job->running) {
+		io_kill(&job->io);
+		io_done(&job->io);
 	}
+	for (i = 0; i < job->files_size; i++) {
+		free(job->files[i].old_name);
+		free(job->files[i].new_name);
+	}
+	for (i = 0; i < job->size; i++)
+		free(job->lines[i]);
+	free(job->files);
+	free(job->lines);
+	free(job->old_name);
+	memset(job, 0, sizeof(*job));
 }
 
 static bool
-diff_common_draw_part(struct view *view, enum line_type *type, char **text, char c, enum line_type next_type)
+diff_lazy_wanted(struct view *view, struct diff_state *state, const char *data)
 {
-	char *sep = strchr(*text, c);
-
-	if (sep != NULL) {
-		*sep = 0;
-		draw_text(view, *type, *text);
-		*sep = c;
-		*text = sep;
-		*type = next_type;
-	}
+	int files;
 
-	return sep != NULL;
+	return opt_diff_lazy_files > 0 && !opt_wrap_lines && view->pipe &&
+	       state->reading_diff_stat && !state->combined_diff &&
+	       sscanf(data, " %d file", &files) == 1 && strstr(data, " changed") &&
+	       files >= opt_diff_lazy_files &&
+	       argv_contains(view->argv, "--patch-with-stat") &&
+	       argv_contains(view->argv, "--");
 }
 
+/* Derive the arguments for listing the files or loading the patch of a
+ * single file from the arguments of the diff view. */
 static bool
-diff_common_draw(struct view *view, struct line *line, unsigned int lineno)
+diff_lazy_argv(struct view *view, const char ***argv, struct diff_file *file)
 {
-	char *text = line->data;
-	enum line_type type = line->type;
-
-	if (draw_lineno(view, lineno))
-		return TRUE;
+	size_t i;
 
-	if (line->wrapped && draw_text(view, LINE_DELIMITER, "+"))
-		return TRUE;
+	for (i = 0; view->argv[i]; i++) {
+		const char *arg = view->argv[i];
 
-	if (type == LINE_DIFF_STAT) {
-		diff_common_draw_part(view, &type, &text, '|', LINE_DEFAULT);
-		if (diff_common_draw_part(view, &type, &text, 'B', LINE_DEFAULT)) {
-			/* Handle binary diffstat: Bin <deleted> -> <added> bytes */
-			diff_common_draw_part(view, &type, &text, ' ', LINE_DIFF_DEL);
-			diff_common_draw_part(view, &type, &text, '-', LINE_DEFAULT);
-			diff_common_draw_part(view, &type, &text, ' ', LINE_DIFF_ADD);
-			diff_common_draw_part(view, &type, &text, 'b', LINE_DEFAULT);
+		if (!strcmp(arg, "--patch-with-stat"))
+			arg = file ? "--patch" : "--name-status";
+		else if (!prefixcmp(arg, "--pretty="))
+			arg = "--format=";
 
-		} else {
-			diff_common_draw_part(view, &type, &text, '+', LINE_DIFF_ADD);
-			diff_common_draw_part(view, &type, &text, '-', LINE_DIFF_DEL);
-		}
+		if (!argv_append(argv, arg))
+			return FALSE;
+		/* File names must not be read as globs or pathspec magic. */
+		if (file && i == 0 && !argv_append(argv, "--literal-pathspecs"))
+			return FALSE;
+		if (!file && !strcmp(arg, "--name-status") && !argv_append(argv, "-z"))
+			return FALSE;
+		if (file && !strcmp(arg, "--"))
+			return argv_append(argv, file->old_name) &&
+			       (!strcmp(file->old_name, file->new_name) ||
+				argv_append(argv, file->new_name));
 	}
 
-	if (line->user_flags & DIFF_LINE_COMMIT_TITLE)
-		draw_commit_title(view, text, 4);
-	else
-		draw_text(view, type, text);
-	return TRUE;
+	return !file;
 }
 
-static bool
-diff_read(struct view *view, char *data)
+/* Find the file whose diff header is on the line. */
+static struct diff_file *
+diff_lazy_find_file(struct view *view, unsigned long lineno)
 {
-	struct diff_state *state = view->private;
+	struct diff_lazy *job = &diff_lazy;
+	size_t low = 0, high = job->files_size;
 
-	if (!data) {
-		/* Fall back to retry if no diff will be shown. */
-		if (view->lines == 0 && opt_file_argv) {
-			int pos = argv_size(view->argv)
-				- argv_size(opt_file_argv) - 1;
+	if (job->view != view)
+		return NULL;
 
-			if (pos > 0 && !strcmp(view->argv[pos], "--")) {
-				for (; view->argv[pos]; pos++) {
-					free((void *) view->argv[pos]);
-					view->argv[pos] = NULL;
-				}
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
 
-				if (view->pipe)
-					io_done(view->pipe);
-				if (io_run(&view->io, IO_RD, view->dir, opt_env, view->argv))
-					return FALSE;
-			}
-		}
-		return TRUE;
+		if (job->files[mid].lineno == lineno)
+			return &job->files[mid];
+		if (job->files[mid].lineno < lineno)
+			low = mid + 1;
+		else
+			high = mid;
 	}
 
-	return diff_common_read(view, data, state);
+	return NULL;
 }
 
-static bool
-diff_blame_line(const char *ref, const char *file, unsigned long lineno,
-		struct blame_header *header, struct blame_commit *commit)
+/* Renumber lines and files after lines were inserted or removed at @at. */
+static void
+diff_lazy_shift(struct view *view, unsigned long at, size_t inserted, size_t removed)
 {
-	char line_arg[SIZEOF_STR];
-	const char *blame_argv[] = {
-		"git", "blame", encoding_arg, "-p", line_arg, ref, "--", file, NULL
-	};
-	struct io io;
-	bool ok = FALSE;
-	char *buf;
+	struct diff_lazy *job = &diff_lazy;
+	struct diff_state *state = view->private;
+	unsigned long *positions[] = { &view->pos.lineno, &view->pos.offset };
+	size_t i;
 
-	if (!string_format(line_arg, "-L%ld,+1", lineno))
-		return FALSE;
+	for (i = at; i < view->lines; i++) {
+		view->line[i].lineno = i + 1;
+		view->line[i].dirty = 1;
+	}
 
-	if (!io_run(&io, IO_RD, opt_cdup, opt_env, blame_argv))
-		return FALSE;
+	for (i = 0; i < job->files_size; i++)
+		if (job->files[i].lineno >= at)
+			job->files[i].lineno = job->files[i].lineno + inserted - removed;
 
-	while ((buf = io_get(&io, '\n', TRUE))) {
-		if (header) {
-			if (!parse_blame_header(header, buf, 9999999))
-				break;
-			header = NULL;
+	for (i = 0; i < ARRAY_SIZE(positions); i++) {
+		unsigned long *pos = positions[i];
 
-		} else if (parse_blame_info(commit, buf)) {
-			ok = commit->filename != NULL;
-			break;
-		}
+		if (*pos >= at + removed)
+			*pos = *pos + inserted - removed;
+		else if (*pos >= at)
+			*pos = at - 1;
 	}
 
-	if (io_error(&io))
-		ok = FALSE;
+	if (view->pos.lineno >= view->pos.offset + view->height)
+		view->pos.offset = view->pos.lineno - view->height + 1;
 
-	io_done(&io);
-	return ok;
+	state->index_stale = TRUE;
 }
 
-struct chunk_header_position {
-	unsigned long position;
-	unsigned long lines;
-};
-
-struct chunk_header {
-	struct chunk_header_position old;
-	struct chunk_header_position new;
-};
-
 static bool
-parse_ulong(const char **pos_ptr, unsigned long *value, const char *skip)
+diff_lazy_add_file(struct view *view, const char *old_name, const char *new_name)
 {
-	const char *start = *pos_ptr;
-	char *end;
+	struct diff_lazy *job = &diff_lazy;
+	struct diff_state *state = view->private;
+	struct diff_file *file;
+	struct line *line;
 
-	if (!isdigit(*start))
-		return 0;
+	if (!realloc_diff_files(&job->files, job->files_size, 1))
+		return FALSE;
 
-	*value = strtoul(start, &end, 10);
-	if (end == start)
+	file = &job->files[job->files_size];
+	file->lineno = view->lines;
+	file->old_name = strdup(old_name);
+	file->new_name = strdup(new_name);
+	if (!file->old_name || !file->new_name) {
+		free(file->old_name);
+		free(file->new_name);
 		return FALSE;
+	}
+	job->files_size++;
 
-	start = end;
-	while (skip && *start && strchr(skip, *start))
-		start++;
-	*pos_ptr = start;
-	return TRUE;
+	line = add_line_format(view, LINE_DIFF_HEADER, "diff --git a/%s b/%s", old_name, new_name);
+	if (!line)
+		return FALSE;
+	line->user_flags |= DIFF_LINE_LAZY;
+	return diff_index_add(&state->headers, file->lineno);
 }
 
 static bool
-parse_chunk_header(struct chunk_header *header, const char *line)
+diff_lazy_load(struct view *view, struct diff_file *file)
 {
-	memset(header, 0, sizeof(*header));
+	struct diff_lazy *job = &diff_lazy;
+	const char **argv = NULL;
+	bool ok = diff_lazy_argv(view, &argv, file) &&
+		  io_run(&job->io, IO_RD, view->dir, opt_env, argv);
 
-	if (prefixcmp(line, "@@ -"))
-		return FALSE;
+	argv_free(argv);
+	free(argv);
 
-	line += STRING_SIZE("@@ -");
+	if (!ok) {
+		view->line[file->lineno].user_flags &= ~DIFF_LINE_LAZY;
+		report("Failed to load the changes to %s", file->new_name);
+		return FALSE;
+	}
 
-	return  parse_ulong(&line, &header->old.position, ",") &&
-		parse_ulong(&line, &header->old.lines, " +") &&
-		parse_ulong(&line, &header->new.position, ",") &&
-		parse_ulong(&line, &header->new.lines, NULL);
+	job->file = file - job->files;
+	job->running = TRUE;
+	return TRUE;
 }
 
-static unsigned int
-diff_get_lineno(struct view *view, struct line *line)
+/* Load the patch of the first file shown with its patch missing. */
+static bool
+diff_lazy_load_next(struct view *view)
 {
-	const struct line *header, *chunk;
-	unsigned int lineno;
-	struct chunk_header chunk_header;
+	unsigned long lineno;
 
-	/* Verify that we are after a diff header and one of its chunks */
-	header = find_prev_line_by_type(view, line, LINE_DIFF_HEADER);
-	chunk = find_prev_line_by_type(view, line, LINE_DIFF_CHUNK);
-	if (!header || !chunk || chunk < header)
-		return 0;
+	if (!view_is_displayed(view))
+		return FALSE;
 
-	/*
-	 * In a chunk header, the number after the '+' sign is the number of its
-	 * following line, in the new version of the file. We increment this
-	 * number for each non-deletion line, until the given line position.
-	 */
-	if (!parse_chunk_header(&chunk_header, chunk->data))
-		return 0;
+	for (lineno = view->pos.offset;
+	     lineno < view->pos.offset + view->height && lineno < view->lines;
+	     lineno++) {
+		struct line *line = &view->line[lineno];
+		struct diff_file *file;
 
-	lineno = chunk_header.new.position;
-	chunk++;
-	while (chunk++ < line)
-		if (chunk->type != LINE_DIFF_DEL)
-			lineno++;
+		if ((line->user_flags & (DIFF_LINE_LAZY | DIFF_LINE_FOLDED)) != DIFF_LINE_LAZY)
+			continue;
 
-	return lineno;
+		file = diff_lazy_find_file(view, lineno);
+		if (file && diff_lazy_load(view, file))
+			return TRUE;
+	}
+
+	return FALSE;
 }
 
+/* Insert the loaded patch below the file's diff header. */
 static bool
-parse_chunk_lineno(unsigned long *lineno, const char *chunk, int marker)
+diff_lazy_insert(struct view *view, struct diff_file *file)
 {
-	struct chunk_header chunk_header;
+	struct diff_lazy *job = &diff_lazy;
+	unsigned long at = file->lineno + 1;
+	size_t first = 0, size, i;
 
-	*lineno = 0;
+	/* Skip up to and including the diff header already shown. */
+	while (first < job->size && prefixcmp(job->lines[first], "diff --"))
+		first++;
+	if (first < job->size)
+		first++;
+	size = job->size - first;
 
-	if (!parse_chunk_header(&chunk_header, chunk))
+	if (!realloc_lines(&view->line, view->lines, size))
 		return FALSE;
 
-	*lineno = marker == '-' ? chunk_header.old.position : chunk_header.new.position;
+	memmove(view->line + at + size, view->line + at,
+		(view->lines - at) * sizeof(*view->line));
+
+	for (i = 0; i < size; i++) {
+		struct line *line = &view->line[at + i];
+		enum line_type type = get_line_type(job->lines[first + i]);
+
+		/* ADD2 and DEL2 are only valid in combined diff hunks */
+		if (type == LINE_DIFF_ADD2 || type == LINE_DIFF_DEL2)
+			type = LINE_DEFAULT;
+
+		memset(line, 0, sizeof(*line));
+		line->type = type;
+		line->data = job->lines[first + i];
+		job->lines[first + i] = NULL;
+	}
+
+	view->lines += size;
+	view->line[file->lineno].user_flags &= ~DIFF_LINE_LAZY;
+	diff_lazy_shift(view, at, size, 0);
 	return TRUE;
 }
 
-static enum request
-diff_trace_origin(struct view *view, struct line *line)
+/* Hide the patch of a file, which is loaded again when shown. */
+static void
+diff_lazy_fold(struct view *view, struct diff_file *file)
 {
-	struct line *diff = find_prev_line_by_type(view, line, LINE_DIFF_HEADER);
-	struct line *chunk = find_prev_line_by_type(view, line, LINE_DIFF_CHUNK);
-	const char *chunk_data;
-	int chunk_marker = line->type == LINE_DIFF_DEL ? '-' : '+';
-	unsigned long lineno = 0;
-	const char *file = NULL;
-	char ref[SIZEOF_REF];
-	struct blame_header header;
-	struct blame_commit commit;
+	struct diff_lazy *job = &diff_lazy;
+	unsigned long at = file->lineno + 1;
+	unsigned long end = view->lines;
+	size_t i;
 
-	if (!diff || !chunk || chunk == line) {
-		report("The line to trace must be inside a diff chunk");
-		return REQ_NONE;
-	}
+	if (file + 1 < job->files + job->files_size)
+		end = file[1].lineno;
 
-	for (; diff < line && !file; diff++) {
-		const char *data = diff->data;
+	for (i = at; i < end; i++)
+		free(view->line[i].data);
+	memmove(view->line + at, view->line + end,
+		(view->lines - end) * sizeof(*view->line));
 
-		if (!prefixcmp(data, "--- a/")) {
-			file = data + STRING_SIZE("--- a/");
-			break;
+	view->lines -= end - at;
+	view->line[file->lineno].user_flags |= DIFF_LINE_LAZY | DIFF_LINE_FOLDED;
+	diff_lazy_shift(view, at, 0, end - at);
+}
+
+static bool
+diff_lazy_read_files(struct view *view)
+{
+	struct diff_lazy *job = &diff_lazy;
+	size_t lines = view->lines;
+	bool can_read = TRUE;
+	char *name;
+
+	for (; (name = io_get(&job->io, 0, can_read)); can_read = FALSE) {
+		if (!job->status) {
+			job->status = *name;
+			continue;
+		}
+
+		/* Renames and copies list both paths. */
+		if ((job->status == 'R' || job->status == 'C') && !job->old_name) {
+			job->old_name = strdup(name);
+			if (!job->old_name)
+				return FALSE;
+			continue;
 		}
+
+		if (!diff_lazy_add_file(view, job->old_name ? job->old_name : name, name))
+			return FALSE;
+		free(job->old_name);
+		job->old_name = NULL;
+		job->status = 0;
 	}
 
-	if (diff == line || !file) {
-		report("Failed to read the file name");
-		return REQ_NONE;
+	if (lines != view->lines && view_is_displayed(view)) {
+		redraw_view(view);
+		update_view_title(view);
 	}
 
-	chunk_data = chunk->data;
+	if (!io_eof(&job->io) && !io_error(&job->io))
+		return TRUE;
 
-	if (!parse_chunk_lineno(&lineno, chunk_data, chunk_marker)) {
-		report("Failed to read the line number");
-		return REQ_NONE;
-	}
+	if (!io_done(&job->io))
+		report("Failed to read the list of changed files");
+	job->running = FALSE;
+	job->reading_files = FALSE;
+	return TRUE;
+}
 
-	if (lineno == 0) {
-		report("This is the origin of the line");
-		return REQ_NONE;
-	}
+static bool
+diff_lazy_read_patch(struct view *view)
+{
+	struct diff_lazy *job = &diff_lazy;
+	struct encoding *encoding = view->encoding ? view->encoding : default_encoding;
+	struct diff_file *file = &job->files[job->file];
+	bool can_read = TRUE, ok;
+	char *line;
+	size_t i;
 
-	for (chunk += 1; chunk < line; chunk++) {
-		if (chunk->type == LINE_DIFF_ADD) {
-			lineno += chunk_marker == '+';
-		} else if (chunk->type == LINE_DIFF_DEL) {
-			lineno += chunk_marker == '-';
-		} else {
-			lineno++;
-		}
+	for (; (line = io_get(&job->io, '\n', can_read)); can_read = FALSE) {
+		if (encoding)
+			line = encoding_convert(encoding, line);
+		if (!realloc_diff_lazy_lines(&job->lines, job->size, 1) ||
+		    !(job->lines[job->size] = strdup(line)))
+			return FALSE;
+		job->size++;
 	}
 
-	if (chunk_marker == '+')
-		string_copy(ref, view->vid);
-	else
-		string_format(ref, "%s^", view->vid);
+	if (!io_eof(&job->io) && !io_error(&job->io))
+		return TRUE;
 
-	if (!diff_blame_line(ref, file, lineno, &header, &commit)) {
-		report("Failed to read blame data");
-		return REQ_NONE;
-	}
+	ok = io_done(&job->io) && diff_lazy_insert(view, file);
+	job->running = FALSE;
+	for (i = 0; i < job->size; i++)
+		free(job->lines[i]);
+	job->size = 0;
 
-	string_ncopy(opt_file, commit.filename, strlen(commit.filename));
-	string_copy(opt_ref, header.id);
-	opt_goto_line = header.orig_lineno - 1;
+	if (!ok) {
+		view->line[file->lineno].user_flags &= ~DIFF_LINE_LAZY;
+		report("Failed to load the changes to %s", file->new_name);
+	}
 
-	return REQ_VIEW_BLAME;
+	if (view_is_displayed(view)) {
+		redraw_view(view);
+		update_view_title(view);
+	}
+	return TRUE;
 }
 
-static const char *
-diff_get_pathname(struct view *view, struct line *line)
+static bool
+diff_lazy_poll(void *data)
 {
-	const struct line *header;
-	const char *dst = NULL;
-	const char *prefixes[] = { " b/", "cc ", "combined " };
-	int i;
+	struct diff_lazy *job = &diff_lazy;
+	struct view *view = job->view;
 
-	header = find_prev_line_by_type(view, line, LINE_DIFF_HEADER);
-	if (!header)
-		return NULL;
-
-	for (i = 0; i < ARRAY_SIZE(prefixes) && !dst; i++)
-		dst = strstr(header->data, prefixes[i]);
+	if (!view)
+		return FALSE;
+	if (!job->running)
+		return diff_lazy_load_next(view);
+	if (!io_can_read(&job->io, FALSE))
+		return TRUE;
 
-	return dst ? dst + strlen(prefixes[--i]) : NULL;
+	if (!(job->reading_files ? diff_lazy_read_files(view) : diff_lazy_read_patch(view))) {
+		report("Failed to load the diff");
+		diff_lazy_stop();
+		return FALSE;
+	}
+	return TRUE;
 }
 
-static enum request
-diff_common_edit(struct view *view, enum request request, struct line *line)
+static bool
+diff_lazy_start(struct view *view)
 {
-	const char *file = diff_get_pathname(view, line);
-	char path[SIZEOF_STR];
-	bool has_path = file && string_format(path, "%s%s", opt_cdup, file);
+	struct diff_lazy *job = &diff_lazy;
+	const char **argv = NULL;
+	bool ok;
 
-	if (has_path && access(path, R_OK)) {
-		report("Failed to open file: %s", file);
-		return REQ_NONE;
-	}
+	diff_lazy_stop();
+	ok = add_line_text(view, "", LINE_DEFAULT) &&
+	     diff_lazy_argv(view, &argv, NULL) &&
+	     io_run(&job->io, IO_RD, view->dir, opt_env, argv);
 
-	open_editor(file, diff_get_lineno(view, line));
-	return REQ_NONE;
+	argv_free(argv);
+	free(argv);
+	if (!ok)
+		return FALSE;
+
+	job->view = view;
+	job->running = job->reading_files = TRUE;
+	return background_add(diff_lazy_poll, NULL);
 }
 
-static enum request
-diff_request(struct view *view, enum request request, struct line *line)
+/* Jump to a file from the diff stat or show and hide its patch. */
+static bool
+diff_lazy_enter(struct view *view, struct line *line)
 {
-	switch (request) {
-	case REQ_VIEW_BLAME:
-		return diff_trace_origin(view, line);
-
-	case REQ_DIFF_CONTEXT_UP:
-	case REQ_DIFF_CONTEXT_DOWN:
-		if (!update_diff_context(request))
-			return REQ_NONE;
-		reload_view(view);
-		return REQ_NONE;
+	struct diff_lazy *job = &diff_lazy;
+	struct diff_file *file;
 
+	if (job->view != view)
+		return FALSE;
 
-	case REQ_EDIT:
-		return diff_common_edit(view, request, line);
+	if (line->type == LINE_DIFF_STAT) {
+		size_t file_number = 0;
 
-	case REQ_ENTER:
-		return diff_common_enter(view, request, line);
+		while (view_has_line(view, line) && line->type == LINE_DIFF_STAT) {
+			file_number++;
+			line--;
+		}
 
-	case REQ_REFRESH:
-		if (string_rev_is_null(view->vid))
-			refresh_view(view);
-		else
-			reload_view(view);
-		return REQ_NONE;
+		if (file_number > job->files_size) {
+			report("Failed to find file diff");
+			return TRUE;
+		}
 
-	default:
-		return pager_request(view, request, line);
+		select_view_line(view, job->files[file_number - 1].lineno);
+		report_clear();
+		return TRUE;
 	}
-}
 
-static void
-diff_select(struct view *view, struct line *line)
-{
-	if (line->type == LINE_DIFF_STAT) {
-		string_format(view->ref, "Press '%s' to jump to file diff",
-			      get_view_key(view, REQ_ENTER));
-	} else {
-		const char *file = diff_get_pathname(view, line);
+	file = diff_lazy_find_file(view, line - view->line);
+	if (!file)
+		return FALSE;
 
-		if (file) {
-			string_format(view->ref, "Changes to '%s'", file);
-			string_format(opt_file, "%s", file);
-			ref_blob[0] = 0;
-		} else {
-			string_ncopy(view->ref, view->id, strlen(view->id));
-			pager_select(view, line);
-		}
+	if (line->user_flags & DIFF_LINE_LAZY) {
+		line->user_flags &= ~DIFF_LINE_FOLDED;
+		background_add(diff_lazy_poll, NULL);
+	} else {
+		diff_lazy_fold(view, file);
 	}
+
+	redraw_view(view);
+	report_clear();
+	return TRUE;
 }
 
-static struct view_ops diff_ops = {
-	"line",
-	{ "diff" },
-	VIEW_DIFF_LIKE | VIEW_ADD_DESCRIBE_REF | VIEW_ADD_PAGER_REFS | VIEW_FILE_FILTER,
-	sizeof(struct diff_state),
-	diff_open,
-	diff_read,
-	diff_common_draw,
-	diff_request,
-	pager_grep,
-	diff_select,
+/* Prefetch the diffs of the commits next to the one selected in the main
+ * view into the diff cache, in the direction the cursor last moved. The
+ * prefetching waits for the diff view to finish loading and the commits
+ * no longer next to the cursor are dropped when it moves. */
+
+struct diff_prefetch {
+	struct io io;
+	bool running;
+	char commit[SIZEOF_REV];	/* Commit whose diff is being read. */
+	char *key;
+	char **lines;
+	size_t size;
+	size_t bytes;			/* Counted like in the diff cache. */
+	char ids[DIFF_PREFETCH_MAX][SIZEOF_REV];
+	size_t ids_size;
+	unsigned long lineno;		/* Last selected main view line. */
+	int direction;
 };
 
-/*
- * Help backend
- */
+static struct diff_prefetch diff_prefetch = { .direction = 1 };
+
+static void
+diff_prefetch_cancel(void)
+{
+	struct diff_prefetch *job = &diff_prefetch;
+	size_t i;
 
+	if (job->running) {
+		io_kill(&job->io);
+		io_done(&job->io);
+		io_trace("diff prefetch cancelled %s\n", job->commit);
+	}
+	for (i = 0; i < job->size; i++)
+		free(job->lines[i]);
+	free(job->lines);
+	free(job->key);
+	job->running = FALSE;
+	job->commit[0] = 0;
+	job->key = NULL;
+	job->lines = NULL;
+	job->size = 0;
+	job->bytes = 0;
+}
+
+/* Diffs that would be loaded lazily are left for the diff view, which
+ * only reads the list of files. */
 static bool
-help_draw(struct view *view, struct line *line, unsigned int lineno)
+diff_prefetch_is_large(const char *line)
 {
-	if (line->type == LINE_HELP_KEYMAP) {
-		struct keymap *keymap = line->data;
+	int files;
 
-		draw_formatted(view, line->type, "[%c] %s bindings",
-			       keymap->hidden ? '+' : '-', keymap->name);
-		return TRUE;
-	} else {
-		return pager_draw(view, line, lineno);
-	}
+	return opt_diff_lazy_files > 0 && line[0] == ' ' && isdigit(line[1]) &&
+	       sscanf(line, " %d file", &files) == 1 && strstr(line, " changed") &&
+	       files >= opt_diff_lazy_files;
 }
 
+/* Format the arguments the diff view would use to show the commit. */
 static bool
-help_open_keymap_title(struct view *view, struct keymap *keymap)
+diff_prefetch_argv(struct view *diff, const char ***argv, const char *id)
 {
-	add_line(view, keymap, LINE_HELP_KEYMAP, 0, FALSE);
-	return keymap->hidden;
+	bool file_filter = !view_has_flags(diff, VIEW_FILE_FILTER) || opt_file_filter;
+	char commit[SIZEOF_REF];
+	bool ok;
+
+	string_ncopy(commit, ref_commit, strlen(ref_commit));
+	string_copy_rev(ref_commit, id);
+	ok = format_argv(diff, argv, diff_argv, !diff->prev, file_filter);
+	string_ncopy(ref_commit, commit, strlen(commit));
+	return ok;
 }
 
-static void
-help_open_keymap(struct view *view, struct keymap *keymap)
+static bool
+diff_prefetch_next(struct view *diff)
 {
-	const char *group = NULL;
-	char buf[SIZEOF_STR];
-	bool add_title = TRUE;
-	int i;
+	struct diff_prefetch *job = &diff_prefetch;
 
-	for (i = 0; i < ARRAY_SIZE(req_info); i++) {
-		const char *key = NULL;
+	while (job->ids_size > 0) {
+		const char **argv = NULL;
+		char *key = NULL;
+		bool ok;
 
-		if (req_info[i].request == REQ_NONE)
-			continue;
+		string_copy_rev(job->commit, job->ids[0]);
+		memmove(job->ids, job->ids + 1, --job->ids_size * sizeof(*job->ids));
 
-		if (!req_info[i].request) {
-			group = req_info[i].help;
-			continue;
-		}
+		ok = diff_prefetch_argv(diff, &argv, job->commit) &&
+		     (key = diff_cache_key(argv)) && !diff_cache_find(key) &&
+		     io_run(&job->io, IO_RD, NULL, opt_env, argv);
+		argv_free(argv);
+		free(argv);
 
-		key = get_keys(keymap, req_info[i].request, TRUE);
-		if (!key || !*key)
-			continue;
+		if (ok) {
+			job->key = key;
+			job->running = TRUE;
+			return TRUE;
+		}
+		free(key);
+	}
 
-		if (add_title && help_open_keymap_title(view, keymap))
-			return;
-		add_title = FALSE;
+	return FALSE;
+}
 
-		if (group) {
-			add_line_text(view, group, LINE_HELP_GROUP);
-			group = NULL;
-		}
+static bool
+diff_prefetch_poll(void *data)
+{
+	struct diff_prefetch *job = &diff_prefetch;
+	struct view *diff = VIEW(REQ_VIEW_DIFF);
+	struct encoding *encoding = diff->encoding ? diff->encoding : default_encoding;
+	size_t budget = (size_t) opt_diff_cache_size * 1024;
+	bool can_read = TRUE, ok;
+	char *line;
 
-		add_line_format(view, LINE_DEFAULT, "    %-25s %-20s %s", key,
-				enum_name(req_info[i]), req_info[i].help);
+	if (!job->running) {
+		if (!view_is_displayed(diff))
+			return FALSE;
+		if (diff->pipe)
+			return TRUE;
+		return diff_prefetch_next(diff);
 	}
 
-	group = "External commands:";
+	if (!io_can_read(&job->io, FALSE))
+		return TRUE;
 
-	for (i = 0; i < run_requests; i++) {
-		struct run_request *req = get_run_request(REQ_NONE + i + 1);
-		const char *key;
+	for (; (line = io_get(&job->io, '\n', can_read)); can_read = FALSE) {
+		if (encoding)
+			line = encoding_convert(encoding, line);
 
-		if (!req || req->keymap != keymap)
-			continue;
+		/* Stop reading diffs that would not be cached anyway. */
+		job->bytes += sizeof(*job->lines) + strlen(line) + 1;
+		if (job->bytes > budget || diff_prefetch_is_large(line)) {
+			diff_prefetch_cancel();
+			return TRUE;
+		}
 
-		key = get_key_name(req->key);
-		if (!*key)
-			key = "(no key defined)";
+		if (!realloc_diff_lazy_lines(&job->lines, job->size, 1) ||
+		    !(job->lines[job->size] = strdup(line))) {
+			diff_prefetch_cancel();
+			return FALSE;
+		}
+		job->size++;
+	}
 
-		if (add_title && help_open_keymap_title(view, keymap))
-			return;
-		add_title = FALSE;
+	if (!io_eof(&job->io) && !io_error(&job->io))
+		return TRUE;
 
-		if (group) {
-			add_line_text(view, group, LINE_HELP_GROUP);
-			group = NULL;
-		}
+	ok = !io_error(&job->io);
+	ok = io_done(&job->io) && ok && job->size;
+	job->running = FALSE;
+	io_trace("diff prefetch %s %s\n", ok ? "loaded" : "failed", job->commit);
+	if (ok) {
+		diff_cache_add(job->key, job->lines, job->size);
+		job->key = NULL;
+		job->lines = NULL;
+		job->size = 0;
+	}
+	diff_prefetch_cancel();
+	return TRUE;
+}
 
-		if (!argv_to_string(req->argv, buf, sizeof(buf), " "))
-			return;
+static void
+diff_done(struct view *view)
+{
+	diff_index_free(view->private);
+	if (diff_lazy.view == view)
+		diff_lazy_stop();
+}
 
-		add_line_format(view, LINE_DEFAULT, "    %-25s `%s`", key, buf);
+/* Move to the next or previous file or chunk. */
+static void
+diff_common_move(struct view *view, enum request request, struct line *line)
+{
+	bool next = request == REQ_DIFF_NEXT_FILE || request == REQ_DIFF_NEXT_CHUNK;
+	bool file = request == REQ_DIFF_NEXT_FILE || request == REQ_DIFF_PREV_FILE;
+	enum line_type type = file ? LINE_DIFF_HEADER : LINE_DIFF_CHUNK;
+	struct line *target = next ? find_next_line_by_type(view, line + 1, type)
+				   : find_prev_line_by_type(view, line - 1, type);
+	struct diff_index *index = diff_get_index(view, type);
+
+	if (!target || !index) {
+		report("No %s %s found", next ? "next" : "previous", file ? "file" : "chunk");
+		return;
 	}
+
+	select_view_line(view, target - view->line);
+	report("%s %zu of %zu", file ? "File" : "Chunk",
+	       diff_index_count(index, target - view->line), index->size);
 }
 
 static bool
-help_open(struct view *view, enum open_flags flags)
+diff_find_stat_entry(struct view *view, struct line *line, enum line_type type)
 {
-	struct keymap *keymap;
-
-	reset_view(view);
-	add_line_text(view, "Quick reference for tig keybindings:", LINE_DEFAULT);
-	add_line_text(view, "", LINE_DEFAULT);
-
-	for (keymap = keymaps; keymap; keymap = keymap->next)
-		help_open_keymap(view, keymap);
+	struct line *marker = find_next_line_by_type(view, line, type);
 
-	return TRUE;
+	return marker &&
+		line == find_prev_line_by_type(view, marker, LINE_DIFF_HEADER);
 }
 
 static enum request
-help_request(struct view *view, enum request request, struct line *line)
+diff_common_enter(struct view *view, enum request request, struct line *line)
 {
-	switch (request) {
-	case REQ_ENTER:
-		if (line->type == LINE_HELP_KEYMAP) {
-			struct keymap *keymap = line->data;
+	if (diff_lazy_enter(view, line)) {
+		return REQ_NONE;
 
-			keymap->hidden = !keymap->hidden;
-			refresh_view(view);
+	} else if (line->type == LINE_DIFF_STAT) {
+		int file_number = 0;
+
+		while (view_has_line(view, line) && line->type == LINE_DIFF_STAT) {
+			file_number++;
+			line--;
+		}
+
+		for (line = view->line; view_has_line(view, line); line++) {
+			line = find_next_line_by_type(view, line, LINE_DIFF_HEADER);
+			if (!line)
+				break;
+
+			if (diff_find_stat_entry(view, line, LINE_DIFF_INDEX)
+			    || diff_find_stat_entry(view, line, LINE_DIFF_SIMILARITY)) {
+				if (file_number == 1) {
+					break;
+				}
+				file_number--;
+			}
+		}
+
+		if (!line) {
+			report("Failed to find file diff");
+			return REQ_NONE;
 		}
 
+		select_view_line(view, line - view->line);
+		report_clear();
 		return REQ_NONE;
-	default:
+
+	} else {
 		return pager_request(view, request, line);
 	}
 }
 
-static void
-help_done(struct view *view)
+static bool
+diff_common_draw_part(struct view *view, enum line_type *type, char **text, char c, enum line_type next_type)
 {
-	int i;
+	char *sep = strchr(*text, c);
 
-	for (i = 0; i < view->lines; i++)
-		if (view->line[i].type == LINE_HELP_KEYMAP)
-			view->line[i].data = NULL;
+	if (sep != NULL) {
+		*sep = 0;
+		draw_text(view, *type, *text);
+		*sep = c;
+		*text = sep;
+		*type = next_type;
+	}
+
+	return sep != NULL;
 }
 
-static struct view_ops help_ops = {
-	"line",
-	{ "help" },
-	VIEW_NO_GIT_DIR,
-	0,
-	help_open,
-	NULL,
-	help_draw,
-	help_request,
-	pager_grep,
-	pager_select,
-	help_done,
-};
+static bool
+diff_common_draw(struct view *view, struct line *line, unsigned int lineno)
+{
+	char *text = line->data;
+	enum line_type type = line->type;
 
+	if (draw_lineno(view, lineno))
+		return TRUE;
 
-/*
- * Tree backend
- */
+	if (line->wrapped && draw_text(view, LINE_DELIMITER, "+"))
+		return TRUE;
 
-/* The top of the path stack. */
-static struct view_history tree_view_history = { sizeof(char *) };
+	if (type == LINE_DIFF_STAT) {
+		diff_common_draw_part(view, &type, &text, '|', LINE_DEFAULT);
+		if (diff_common_draw_part(view, &type, &text, 'B', LINE_DEFAULT)) {
+			/* Handle binary diffstat: Bin <deleted> -> <added> bytes */
+			diff_common_draw_part(view, &type, &text, ' ', LINE_DIFF_DEL);
+			diff_common_draw_part(view, &type, &text, '-', LINE_DEFAULT);
+			diff_common_draw_part(view, &type, &text, ' ', LINE_DIFF_ADD);
+			diff_common_draw_part(view, &type, &text, 'b', LINE_DEFAULT);
 
-static void
-pop_tree_stack_entry(struct position *position)
-{
-	char *path_position = NULL;
+		} else {
+			diff_common_draw_part(view, &type, &text, '+', LINE_DIFF_ADD);
+			diff_common_draw_part(view, &type, &text, '-', LINE_DIFF_DEL);
+		}
+	}
 
-	pop_view_history_state(&tree_view_history, position, &path_position);
-	path_position[0] = 0;
+	if (line->user_flags & DIFF_LINE_COMMIT_TITLE) {
+		draw_commit_title(view, text, 4);
+	} else if (draw_text(view, type, text)) {
+		return TRUE;
+	}
+
+	if (line->user_flags & DIFF_LINE_LAZY) {
+		if (!(line->user_flags & DIFF_LINE_FOLDED))
+			background_add(diff_lazy_poll, NULL);
+		draw_text(view, LINE_DELIMITER, " ...");
+	}
+	return TRUE;
 }
 
-static void
-push_tree_stack_entry(const char *name, struct position *position)
+static bool
+diff_read(struct view *view, char *data)
 {
-	size_t pathlen = strlen(opt_path);
-	char *path_position = opt_path + pathlen;
-	struct view_state *state = push_view_history_state(&tree_view_history, position, &path_position);
-
-	if (!state)
-		return;
+	struct diff_state *state = view->private;
 
-	if (!string_format_from(opt_path, &pathlen, "%s/", name)) {
-		pop_tree_stack_entry(NULL);
-		return;
-	}
+	if (!data) {
+		/* Fall back to retry if no diff will be shown. */
+		if (view->lines == 0 && opt_file_argv) {
+			int pos = argv_size(view->argv)
+				- argv_size(opt_file_argv) - 1;
 
-	clear_position(position);
-}
+			if (pos > 0 && !strcmp(view->argv[pos], "--")) {
+				for (; view->argv[pos]; pos++) {
+					free((void *) view->argv[pos]);
+					view->argv[pos] = NULL;
+				}
 
-/* Parse output from git-ls-tree(1):
- *
- * 100644 blob 95925677ca47beb0b8cce7c0e0011bcc3f61470f  213045	tig.c
- */
+				if (view->pipe)
+					io_done(view->pipe);
+				if (io_run(&view->io, IO_RD, view->dir, opt_env, view->argv))
+					return FALSE;
+			}
+		}
 
-#define SIZEOF_TREE_ATTR \
-	STRING_SIZE("100644 blob f931e1d229c3e185caad4449bf5b66ed72462657\t")
+		if (view->lines && !state->lazy && view->pipe &&
+		    io_eof(view->pipe) && !io_error(view->pipe))
+			diff_cache_save(view);
+		return TRUE;
+	}
 
-#define SIZEOF_TREE_MODE \
-	STRING_SIZE("100644 ")
+	/* The rest is loaded per file. */
+	if (state->lazy)
+		return TRUE;
 
-#define TREE_ID_OFFSET \
-	STRING_SIZE("100644 blob ")
+	if (diff_lazy_wanted(view, state, data)) {
+		state->lazy = TRUE;
+		io_kill(view->pipe);
+		return diff_common_read(view, data, state) && diff_lazy_start(view);
+	}
 
-#define tree_path_is_parent(path)	(!strcmp("..", (path)))
+	return diff_common_read(view, data, state);
+}
 
-struct tree_entry {
-	char id[SIZEOF_REV];
-	char commit[SIZEOF_REV];
-	mode_t mode;
-	struct time time;		/* Date from the author ident. */
-	const struct ident *author;	/* Author of the commit. */
-	unsigned long size;
-	char name[1];
+struct chunk_header_position {
+	unsigned long position;
+	unsigned long lines;
 };
 
-struct tree_state {
-	char commit[SIZEOF_REV];
-	const struct ident *author;
-	struct time author_time;
-	int size_width;
-	bool read_date;
+struct chunk_header {
+	struct chunk_header_position old;
+	struct chunk_header_position new;
 };
 
-static const char *
-tree_path(const struct line *line)
+static bool
+parse_ulong(const char **pos_ptr, unsigned long *value, const char *skip)
 {
-	return ((struct tree_entry *) line->data)->name;
+	const char *start = *pos_ptr;
+	char *end;
+
+	if (!isdigit(*start))
+		return 0;
+
+	*value = strtoul(start, &end, 10);
+	if (end == start)
+		return FALSE;
+
+	start = end;
+	while (skip && *start && strchr(skip, *start))
+		start++;
+	*pos_ptr = start;
+	return TRUE;
 }
 
-static int
-tree_compare_entry(const struct line *line1, const struct line *line2)
+static bool
+parse_chunk_header_position(const char **line, struct chunk_header_position *position)
 {
-	if (line1->type != line2->type)
-		return line1->type == LINE_TREE_DIR ? -1 : 1;
-	return strcmp(tree_path(line1), tree_path(line2));
-}
+	if (!parse_ulong(line, &position->position, ","))
+		return FALSE;
 
-static const enum sort_field tree_sort_fields[] = {
-	ORDERBY_NAME, ORDERBY_DATE, ORDERBY_AUTHOR
-};
-static struct sort_state tree_sort_state = SORT_STATE(tree_sort_fields);
+	/* The number of lines is left out when it is one. */
+	if (isdigit(**line))
+		return parse_ulong(line, &position->lines, " +");
 
-static int
-tree_compare(const void *l1, const void *l2)
-{
-	const struct line *line1 = (const struct line *) l1;
-	const struct line *line2 = (const struct line *) l2;
-	const struct tree_entry *entry1 = ((const struct line *) l1)->data;
-	const struct tree_entry *entry2 = ((const struct line *) l2)->data;
+	position->lines = 1;
+	while (**line == ' ' || **line == '+')
+		(*line)++;
+	return TRUE;
+}
 
-	if (line1->type == LINE_TREE_HEAD)
-		return -1;
-	if (line2->type == LINE_TREE_HEAD)
-		return 1;
+static bool
+parse_chunk_header(struct chunk_header *header, const char *line)
+{
+	memset(header, 0, sizeof(*header));
 
-	switch (get_sort_field(tree_sort_state)) {
-	case ORDERBY_DATE:
-		return sort_order(tree_sort_state, timecmp(&entry1->time, &entry2->time));
+	if (prefixcmp(line, "@@ -"))
+		return FALSE;
 
-	case ORDERBY_AUTHOR:
-		return sort_order(tree_sort_state, ident_compare(entry1->author, entry2->author));
+	line += STRING_SIZE("@@ -");
 
-	case ORDERBY_NAME:
-	default:
-		return sort_order(tree_sort_state, tree_compare_entry(line1, line2));
-	}
+	return  parse_chunk_header_position(&line, &header->old) &&
+		parse_chunk_header_position(&line, &header->new);
 }
 
-
-static struct line *
-tree_entry(struct view *view, enum line_type type, const char *path,
-	   const char *mode, const char *id, unsigned long size)
+static unsigned int
+diff_get_lineno(struct view *view, struct line *line)
 {
-	bool custom = type == LINE_TREE_HEAD || tree_path_is_parent(path);
-	struct tree_entry *entry;
-	struct line *line = add_line_alloc(view, &entry, type, strlen(path), custom);
+	const struct line *header, *chunk;
+	unsigned int lineno;
+	struct chunk_header chunk_header;
 
-	if (!line)
-		return NULL;
+	/* Verify that we are after a diff header and one of its chunks */
+	header = find_prev_line_by_type(view, line, LINE_DIFF_HEADER);
+	chunk = find_prev_line_by_type(view, line, LINE_DIFF_CHUNK);
+	if (!header || !chunk || chunk < header)
+		return 0;
 
-	strncpy(entry->name, path, strlen(path));
-	if (mode)
-		entry->mode = strtoul(mode, NULL, 8);
-	if (id)
-		string_copy_rev(entry->id, id);
-	entry->size = size;
+	/*
+	 * In a chunk header, the number after the '+' sign is the number of its
+	 * following line, in the new version of the file. We increment this
+	 * number for each non-deletion line, until the given line position.
+	 */
+	if (!parse_chunk_header(&chunk_header, chunk->data))
+		return 0;
 
-	return line;
+	lineno = chunk_header.new.position;
+	chunk++;
+	while (chunk++ < line)
+		if (chunk->type != LINE_DIFF_DEL)
+			lineno++;
+
+	return lineno;
 }
 
 static bool
-tree_read_date(struct view *view, char *text, struct tree_state *state)
+parse_chunk_lineno(unsigned long *lineno, const char *chunk, int marker)
 {
-	if (!text && state->read_date) {
-		state->read_date = FALSE;
-		return TRUE;
+	struct chunk_header chunk_header;
 
-	} else if (!text) {
-		/* Find next entry to process */
-		const char *log_file[] = {
-			"git", "log", encoding_arg, "--no-color", "--pretty=raw",
-				"--cc", "--raw", view->id, "--", "%(directory)", NULL
-		};
+	*lineno = 0;
 
-		if (!view->lines) {
-			tree_entry(view, LINE_TREE_HEAD, opt_path, NULL, NULL, 0);
-			tree_entry(view, LINE_TREE_DIR, "..", "040000", view->ref, 0);
-			report("Tree is empty");
-			return TRUE;
-		}
+	if (!parse_chunk_header(&chunk_header, chunk))
+		return FALSE;
 
-		if (!begin_update(view, opt_cdup, log_file, OPEN_EXTRA)) {
-			report("Failed to load tree data");
-			return TRUE;
-		}
+	*lineno = marker == '-' ? chunk_header.old.position : chunk_header.new.position;
+	return TRUE;
+}
 
-		state->read_date = TRUE;
-		return FALSE;
+/* Blame results for traced chunks. Tracing a line blames the whole
+ * chunk range it belongs to so that other lines in the same chunk can be
+ * traced without running git blame again. */
+struct diff_trace_line {
+	char id[SIZEOF_REV];		/* SHA1 ID of the origin commit. */
+	unsigned long orig_lineno;	/* Line number in the origin commit. */
+	const char *filename;		/* Name of file in the origin commit. */
+};
 
-	} else if (*text == 'c' && get_line_type(text) == LINE_COMMIT) {
-		string_copy_rev_from_commit_line(state->commit, text);
+struct diff_trace_chunk {
+	char ref[SIZEOF_REF];		/* Revision that was blamed. */
+	const char *file;		/* File that was blamed. */
+	unsigned long lineno;		/* First line of the blamed range. */
+	unsigned long lines;		/* Number of lines in the blamed range. */
+	struct diff_trace_line *line;	/* Blame result for each line. */
+};
 
-	} else if (*text == 'a' && get_line_type(text) == LINE_AUTHOR) {
-		parse_author_line(text + STRING_SIZE("author "),
-				  &state->author, &state->author_time);
+static char diff_trace_vid[SIZEOF_REF];
+static struct diff_trace_chunk *diff_trace_chunks;
+static size_t diff_trace_chunks_size;
 
-	} else if (*text == ':') {
-		char *pos;
-		size_t annotated = 1;
-		size_t i;
+DEFINE_ALLOCATOR(realloc_diff_trace_chunks, struct diff_trace_chunk, 8)
 
-		pos = strchr(text, '\t');
-		if (!pos)
-			return TRUE;
-		text = pos + 1;
-		if (*opt_path && !strncmp(text, opt_path, strlen(opt_path)))
-			text += strlen(opt_path);
-		pos = strchr(text, '/');
-		if (pos)
-			*pos = 0;
-
-		for (i = 1; i < view->lines; i++) {
-			struct line *line = &view->line[i];
-			struct tree_entry *entry = line->data;
-
-			annotated += !!entry->author;
-			if (entry->author || strcmp(entry->name, text))
-				continue;
-
-			string_copy_rev(entry->commit, state->commit);
-			entry->author = state->author;
-			entry->time = state->author_time;
-			line->dirty = 1;
-			break;
-		}
-
-		if (annotated == view->lines)
-			io_kill(view->pipe);
-	}
-	return TRUE;
-}
-
-static inline size_t
-parse_size(const char *text, int *max_digits)
+static void
+diff_trace_reset(const char *vid)
 {
-	size_t size = 0;
-	int digits = 0;
-
-	while (*text == ' ')
-		text++;
-
-	while (isdigit(*text)) {
-		size = (size * 10) + (*text++ - '0');
-		digits++;
-	}
-
-	if (digits > *max_digits)
-		*max_digits = digits;
+	size_t i;
 
-	return size;
+	for (i = 0; i < diff_trace_chunks_size; i++)
+		free(diff_trace_chunks[i].line);
+	free(diff_trace_chunks);
+	diff_trace_chunks = NULL;
+	diff_trace_chunks_size = 0;
+	string_ncopy(diff_trace_vid, vid, strlen(vid));
 }
 
 static bool
-tree_read(struct view *view, char *text)
+diff_blame_chunk(struct diff_trace_chunk *chunk)
 {
-	struct tree_state *state = view->private;
-	struct tree_entry *data;
-	struct line *entry, *line;
-	enum line_type type;
-	size_t textlen = text ? strlen(text) : 0;
-	const char *attr_offset = text + SIZEOF_TREE_ATTR;
-	char *path;
-	size_t size;
-
-	if (state->read_date || !text)
-		return tree_read_date(view, text, state);
+	char line_arg[SIZEOF_STR];
+	const char *blame_argv[] = {
+		"git", "blame", encoding_arg, "--incremental", line_arg, chunk->ref, "--", chunk->file, NULL
+	};
+	unsigned long last_lineno = chunk->lineno + chunk->lines - 1;
+	unsigned long found = 0;
+	struct blame_header header;
+	struct blame_commit commit;
+	bool in_header = TRUE;
+	struct io io;
+	char *buf;
 
-	if (textlen <= SIZEOF_TREE_ATTR)
-		return FALSE;
-	if (view->lines == 0 &&
-	    !tree_entry(view, LINE_TREE_HEAD, opt_path, NULL, NULL, 0))
+	if (!string_format(line_arg, "-L%ld,+%ld", chunk->lineno, chunk->lines))
 		return FALSE;
 
-	size = parse_size(attr_offset, &state->size_width);
-	path = strchr(attr_offset, '\t');
-	if (!path)
+	if (!io_run(&io, IO_RD, opt_cdup, opt_env, blame_argv))
 		return FALSE;
-	path++;
 
-	/* Strip the path part ... */
-	if (*opt_path) {
-		size_t pathlen = textlen - SIZEOF_TREE_ATTR;
-		size_t striplen = strlen(opt_path);
-
-		if (pathlen > striplen)
-			memmove(path, path + striplen,
-				pathlen - striplen + 1);
+	while ((buf = io_get(&io, '\n', TRUE))) {
+		if (in_header) {
+			if (!parse_blame_header(&header, buf, last_lineno) ||
+			    header.lineno < chunk->lineno)
+				break;
+			memset(&commit, 0, sizeof(commit));
+			in_header = FALSE;
 
-		/* Insert "link" to parent directory. */
-		if (view->lines == 1 &&
-		    !tree_entry(view, LINE_TREE_DIR, "..", "040000", view->ref, 0))
-			return FALSE;
-	}
+		} else if (parse_blame_info(&commit, buf)) {
+			size_t i;
 
-	type = text[SIZEOF_TREE_MODE] == 't' ? LINE_TREE_DIR : LINE_TREE_FILE;
-	entry = tree_entry(view, type, path, text, text + TREE_ID_OFFSET, size);
-	if (!entry)
-		return FALSE;
-	data = entry->data;
+			if (!commit.filename)
+				break;
 
-	/* Skip "Directory ..." and ".." line. */
-	for (line = &view->line[1 + !!*opt_path]; line < entry; line++) {
-		if (tree_compare_entry(line, entry) <= 0)
-			continue;
+			for (i = 0; i < header.group; i++) {
+				struct diff_trace_line *line = &chunk->line[header.lineno - chunk->lineno + i];
 
-		memmove(line + 1, line, (entry - line) * sizeof(*entry));
+				string_copy_rev(line->id, header.id);
+				line->orig_lineno = header.orig_lineno + i;
+				line->filename = commit.filename;
+			}
 
-		line->data = data;
-		line->type = type;
-		for (; line <= entry; line++)
-			line->dirty = line->cleareol = 1;
-		return TRUE;
+			found += header.group;
+			in_header = TRUE;
+		}
 	}
 
-	/* Move the current line to the first tree entry. */
-	if (!check_position(&view->prev_pos) && !check_position(&view->pos))
-		goto_view_line(view, 0, 1);
+	if (io_error(&io))
+		found = 0;
 
-	return TRUE;
+	io_done(&io);
+	return found == chunk->lines;
 }
 
-static bool
-tree_draw(struct view *view, struct line *line, unsigned int lineno)
+static const struct diff_trace_line *
+diff_trace_chunk_line(const char *vid, const char *ref, const char *file,
+		      const struct chunk_header_position *range, unsigned long lineno)
 {
-	struct tree_state *state = view->private;
-	struct tree_entry *entry = line->data;
+	struct diff_trace_chunk *chunk;
+	size_t i;
 
-	if (line->type == LINE_TREE_HEAD) {
-		if (draw_text(view, line->type, "Directory path /"))
-			return TRUE;
-	} else {
-		if (draw_mode(view, entry->mode))
-			return TRUE;
+	if (lineno < range->position || lineno >= range->position + range->lines)
+		return NULL;
 
-		if (draw_author(view, entry->author))
-			return TRUE;
+	/* Only keep blame results for the commit currently being traced. */
+	if (strcmp(diff_trace_vid, vid))
+		diff_trace_reset(vid);
 
-		if (draw_file_size(view, entry->size, state->size_width,
-				   line->type != LINE_TREE_FILE))
-			return TRUE;
+	file = get_path(file);
+	if (!file)
+		return NULL;
 
-		if (draw_date(view, &entry->time))
-			return TRUE;
+	for (i = 0; i < diff_trace_chunks_size; i++) {
+		chunk = &diff_trace_chunks[i];
 
-		if (draw_id(view, entry->commit))
-			return TRUE;
+		if (chunk->file == file && !strcmp(chunk->ref, ref) &&
+		    chunk->lineno == range->position && chunk->lines == range->lines)
+			return &chunk->line[lineno - chunk->lineno];
 	}
 
-	draw_text(view, line->type, entry->name);
-	return TRUE;
-}
-
-static void
-open_blob_editor(const char *id, const char *name, unsigned int lineno)
-{
-	const char *blob_argv[] = { "git", "cat-file", "blob", id, NULL };
-	char file[SIZEOF_STR];
-	int fd;
+	if (!realloc_diff_trace_chunks(&diff_trace_chunks, diff_trace_chunks_size, 1))
+		return NULL;
 
-	if (!name)
-		name = "unknown";
+	chunk = &diff_trace_chunks[diff_trace_chunks_size];
+	string_ncopy(chunk->ref, ref, strlen(ref));
+	chunk->file = file;
+	chunk->lineno = range->position;
+	chunk->lines = range->lines;
+	chunk->line = calloc(range->lines, sizeof(*chunk->line));
 
-	if (!string_format(file, "%s/tigblob.XXXXXX.%s", get_temp_dir(), name)) {
-		report("Temporary file name is too long");
-		return;
+	if (!chunk->line || !diff_blame_chunk(chunk)) {
+		free(chunk->line);
+		memset(chunk, 0, sizeof(*chunk));
+		return NULL;
 	}
 
-	fd = mkstemps(file, strlen(name) + 1);
-
-	if (fd == -1)
-		report("Failed to create temporary file");
-	else if (!io_run_append(blob_argv, fd))
-		report("Failed to save blob data to file");
-	else
-		open_editor(file, lineno);
-	if (fd != -1)
-		unlink(file);
+	diff_trace_chunks_size++;
+	return &chunk->line[lineno - chunk->lineno];
 }
 
 static enum request
-tree_request(struct view *view, enum request request, struct line *line)
+diff_trace_origin(struct view *view, struct line *line)
 {
-	enum open_flags flags;
-	struct tree_entry *entry = line->data;
-
-	switch (request) {
-	case REQ_VIEW_BLAME:
-		if (line->type != LINE_TREE_FILE) {
-			report("Blame only supported for files");
-			return REQ_NONE;
-		}
-
-		string_copy(opt_ref, view->vid);
-		return request;
+	struct line *diff = find_prev_line_by_type(view, line, LINE_DIFF_HEADER);
+	struct line *chunk = find_prev_line_by_type(view, line, LINE_DIFF_CHUNK);
+	struct chunk_header chunk_header;
+	struct chunk_header_position *range;
+	int chunk_marker = line->type == LINE_DIFF_DEL ? '-' : '+';
+	unsigned long lineno = 0;
+	const char *file = NULL;
+	char ref[SIZEOF_REF];
+	const struct diff_trace_line *origin;
 
-	case REQ_EDIT:
-		if (line->type != LINE_TREE_FILE) {
-			report("Edit only supported for files");
-		} else if (!is_head_commit(view->vid)) {
-			open_blob_editor(entry->id, entry->name, 0);
-		} else {
-			open_editor(opt_file, 0);
-		}
+	if (!diff || !chunk || chunk == line) {
+		report("The line to trace must be inside a diff chunk");
 		return REQ_NONE;
+	}
 
-	case REQ_TOGGLE_SORT_FIELD:
-	case REQ_TOGGLE_SORT_ORDER:
-		sort_view(view, request, &tree_sort_state, tree_compare);
-		return REQ_NONE;
+	for (; diff < line && !file; diff++) {
+		const char *data = diff->data;
 
-	case REQ_PARENT:
-	case REQ_BACK:
-		if (!*opt_path) {
-			/* quit view if at top of tree */
-			return REQ_VIEW_CLOSE;
+		if (!prefixcmp(data, "--- a/")) {
+			file = data + STRING_SIZE("--- a/");
+			break;
 		}
-		/* fake 'cd  ..' */
-		line = &view->line[1];
-		break;
+	}
 
-	case REQ_ENTER:
-		break;
+	if (diff == line || !file) {
+		report("Failed to read the file name");
+		return REQ_NONE;
+	}
 
-	default:
-		return request;
+	if (!parse_chunk_header(&chunk_header, chunk->data)) {
+		report("Failed to read the line number");
+		return REQ_NONE;
 	}
 
-	/* Cleanup the stack if the tree view is at a different tree. */
-	if (!*opt_path)
-		reset_view_history(&tree_view_history);
+	range = chunk_marker == '-' ? &chunk_header.old : &chunk_header.new;
+	lineno = range->position;
 
-	switch (line->type) {
-	case LINE_TREE_DIR:
-		/* Depending on whether it is a subdirectory or parent link
-		 * mangle the path buffer. */
-		if (line == &view->line[1] && *opt_path) {
-			pop_tree_stack_entry(&view->pos);
+	if (lineno == 0) {
+		report("This is the origin of the line");
+		return REQ_NONE;
+	}
 
+	for (chunk += 1; chunk < line; chunk++) {
+		if (chunk->type == LINE_DIFF_ADD) {
+			lineno += chunk_marker == '+';
+		} else if (chunk->type == LINE_DIFF_DEL) {
+			lineno += chunk_marker == '-';
 		} else {
-			const char *basename = tree_path(line);
-
-			push_tree_stack_entry(basename, &view->pos);
+			lineno++;
 		}
+	}
 
-		/* Trees and subtrees share the same ID, so they are not not
-		 * unique like blobs. */
-		flags = OPEN_RELOAD;
-		request = REQ_VIEW_TREE;
-		break;
-
-	case LINE_TREE_FILE:
-		flags = view_is_displayed(view) ? OPEN_SPLIT : OPEN_DEFAULT;
-		request = REQ_VIEW_BLOB;
-		break;
+	if (chunk_marker == '+')
+		string_copy(ref, view->vid);
+	else
+		string_format(ref, "%s^", view->vid);
 
-	default:
+	origin = diff_trace_chunk_line(view->vid, ref, file, range, lineno);
+	if (!origin) {
+		report("Failed to read blame data");
 		return REQ_NONE;
 	}
 
-	open_view(view, request, flags);
+	string_ncopy(opt_file, origin->filename, strlen(origin->filename));
+	string_copy(opt_ref, origin->id);
+	opt_goto_line = origin->orig_lineno - 1;
 
-	return REQ_NONE;
+	return REQ_VIEW_BLAME;
 }
 
-static bool
-tree_grep(struct view *view, struct line *line)
+static const char *
+diff_get_pathname(struct view *view, struct line *line)
 {
-	struct tree_entry *entry = line->data;
-	const char *text[] = {
-		entry->name,
-		mkauthor(entry->author, opt_author_width, opt_author),
-		mkdate(&entry->time, opt_date),
-		NULL
+	const struct line *header;
+	const char *dst = NULL;
+	const char *prefixes[] = { " b/", "cc ", "combined " };
+	int i;
+
+	header = find_prev_line_by_type(view, line, LINE_DIFF_HEADER);
+	if (!header)
+		return NULL;
+
+	for (i = 0; i < ARRAY_SIZE(prefixes) && !dst; i++)
+		dst = strstr(header->data, prefixes[i]);
+
+	return dst ? dst + strlen(prefixes[--i]) : NULL;
+}
+
+static enum request
+diff_common_edit(struct view *view, enum request request, struct line *line)
+{
+	const char *file = diff_get_pathname(view, line);
+	char path[SIZEOF_STR];
+	bool has_path = file && string_format(path, "%s%s", opt_cdup, file);
+
+	if (has_path && access(path, R_OK)) {
+		report("Failed to open file: %s", file);
+		return REQ_NONE;
+	}
+
+	open_editor(file, diff_get_lineno(view, line));
+	return REQ_NONE;
+}
+
+static enum request
+diff_request(struct view *view, enum request request, struct line *line)
+{
+	switch (request) {
+	case REQ_VIEW_BLAME:
+		return diff_trace_origin(view, line);
+
+	case REQ_DIFF_CONTEXT_UP:
+	case REQ_DIFF_CONTEXT_DOWN:
+		if (!update_diff_context(request))
+			return REQ_NONE;
+		reload_view(view);
+		return REQ_NONE;
+
+
+	case REQ_EDIT:
+		return diff_common_edit(view, request, line);
+
+	case REQ_ENTER:
+		return diff_common_enter(view, request, line);
+
+	case REQ_DIFF_NEXT_FILE:
+	case REQ_DIFF_PREV_FILE:
+	case REQ_DIFF_NEXT_CHUNK:
+	case REQ_DIFF_PREV_CHUNK:
+		diff_common_move(view, request, line);
+		return REQ_NONE;
+
+	case REQ_REFRESH:
+		if (string_rev_is_null(view->vid))
+			refresh_view(view);
+		else
+			reload_view(view);
+		return REQ_NONE;
+
+	default:
+		return pager_request(view, request, line);
+	}
+}
+
+static void
+diff_select(struct view *view, struct line *line)
+{
+	if (line->type == LINE_DIFF_STAT) {
+		string_format(view->ref, "Press '%s' to jump to file diff",
+			      get_view_key(view, REQ_ENTER));
+	} else {
+		const char *file = diff_get_pathname(view, line);
+
+		if (file) {
+			string_format(view->ref, "Changes to '%s'", file);
+			string_format(opt_file, "%s", file);
+			ref_blob[0] = 0;
+		} else {
+			string_ncopy(view->ref, view->id, strlen(view->id));
+			pager_select(view, line);
+		}
+	}
+}
+
+static struct view_ops diff_ops = {
+	"line",
+	{ "diff" },
+	VIEW_DIFF_LIKE | VIEW_ADD_DESCRIBE_REF | VIEW_ADD_PAGER_REFS | VIEW_FILE_FILTER,
+	sizeof(struct diff_state),
+	diff_open,
+	diff_read,
+	diff_common_draw,
+	diff_request,
+	pager_grep,
+	diff_select,
+	diff_done,
+};
+
+/*
+ * Help backend
+ */
+
+static bool
+help_draw(struct view *view, struct line *line, unsigned int lineno)
+{
+	if (line->type == LINE_HELP_KEYMAP) {
+		struct keymap *keymap = line->data;
+
+		draw_formatted(view, line->type, "[%c] %s bindings",
+			       keymap->hidden ? '+' : '-', keymap->name);
+		return TRUE;
+	} else {
+		return pager_draw(view, line, lineno);
+	}
+}
+
+static bool
+help_open_keymap_title(struct view *view, struct keymap *keymap)
+{
+	add_line(view, keymap, LINE_HELP_KEYMAP, 0, FALSE);
+	return keymap->hidden;
+}
+
+static void
+help_open_keymap(struct view *view, struct keymap *keymap)
+{
+	const char *group = NULL;
+	char buf[SIZEOF_STR];
+	bool add_title = TRUE;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(req_info); i++) {
+		const char *key = NULL;
+
+		if (req_info[i].request == REQ_NONE)
+			continue;
+
+		if (!req_info[i].request) {
+			group = req_info[i].help;
+			continue;
+		}
+
+		key = get_keys(keymap, req_info[i].request, TRUE);
+		if (!key || !*key)
+			continue;
+
+		if (add_title && help_open_keymap_title(view, keymap))
+			return;
+		add_title = FALSE;
+
+		if (group) {
+			add_line_text(view, group, LINE_HELP_GROUP);
+			group = NULL;
+		}
+
+		add_line_format(view, LINE_DEFAULT, "    %-25s %-20s %s", key,
+				enum_name(req_info[i]), req_info[i].help);
+	}
+
+	group = "External commands:";
+
+	for (i = 0; i < run_requests; i++) {
+		struct run_request *req = get_run_request(REQ_NONE + i + 1);
+		const char *key;
+
+		if (!req || req->keymap != keymap)
+			continue;
+
+		key = get_key_name(req->key);
+		if (!*key)
+			key = "(no key defined)";
+
+		if (add_title && help_open_keymap_title(view, keymap))
+			return;
+		add_title = FALSE;
+
+		if (group) {
+			add_line_text(view, group, LINE_HELP_GROUP);
+			group = NULL;
+		}
+
+		if (!argv_to_string(req->argv, buf, sizeof(buf), " "))
+			return;
+
+		add_line_format(view, LINE_DEFAULT, "    %-25s `%s`", key, buf);
+	}
+}
+
+static bool
+help_open(struct view *view, enum open_flags flags)
+{
+	struct keymap *keymap;
+
+	reset_view(view);
+	add_line_text(view, "Quick reference for tig keybindings:", LINE_DEFAULT);
+	add_line_text(view, "", LINE_DEFAULT);
+
+	for (keymap = keymaps; keymap; keymap = keymap->next)
+		help_open_keymap(view, keymap);
+
+	return TRUE;
+}
+
+static enum request
+help_request(struct view *view, enum request request, struct line *line)
+{
+	switch (request) {
+	case REQ_ENTER:
+		if (line->type == LINE_HELP_KEYMAP) {
+			struct keymap *keymap = line->data;
+
+			keymap->hidden = !keymap->hidden;
+			refresh_view(view);
+		}
+
+		return REQ_NONE;
+	default:
+		return pager_request(view, request, line);
+	}
+}
+
+static void
+help_done(struct view *view)
+{
+	int i;
+
+	for (i = 0; i < view->lines; i++)
+		if (view->line[i].type == LINE_HELP_KEYMAP)
+			view->line[i].data = NULL;
+}
+
+static struct view_ops help_ops = {
+	"line",
+	{ "help" },
+	VIEW_NO_GIT_DIR,
+	0,
+	help_open,
+	NULL,
+	help_draw,
+	help_request,
+	pager_grep,
+	pager_select,
+	help_done,
+};
+
+
+/*
+ * Tree backend
+ */
+
+/* The top of the path stack. */
+static struct view_history tree_view_history = { sizeof(char *) };
+
+static void
+pop_tree_stack_entry(struct position *position)
+{
+	char *path_position = NULL;
+
+	pop_view_history_state(&tree_view_history, position, &path_position);
+	path_position[0] = 0;
+}
+
+static void
+push_tree_stack_entry(const char *name, struct position *position)
+{
+	size_t pathlen = strlen(opt_path);
+	char *path_position = opt_path + pathlen;
+	struct view_state *state = push_view_history_state(&tree_view_history, position, &path_position);
+
+	if (!state)
+		return;
+
+	if (!string_format_from(opt_path, &pathlen, "%s/", name)) {
+		pop_tree_stack_entry(NULL);
+		return;
+	}
+
+	clear_position(position);
+}
+
+/* Parse output from git-ls-tree(1):
+ *
+ * 100644 blob 95925677ca47beb0b8cce7c0e0011bcc3f61470f  213045	tig.c
+ */
+
+#define SIZEOF_TREE_ATTR \
+	STRING_SIZE("100644 blob f931e1d229c3e185caad4449bf5b66ed72462657\t")
+
+#define SIZEOF_TREE_MODE \
+	STRING_SIZE("100644 ")
+
+#define TREE_ID_OFFSET \
+	STRING_SIZE("100644 blob ")
+
+#define tree_path_is_parent(path)	(!strcmp("..", (path)))
+
+struct tree_entry {
+	char id[SIZEOF_REV];
+	char commit[SIZEOF_REV];
+	mode_t mode;
+	struct time time;		/* Date from the author ident. */
+	const struct ident *author;	/* Author of the commit. */
+	unsigned long size;
+	char name[1];
+};
+
+#define TREE_DATE_SHARDS	8	/* Max number of concurrent history walks. */
+#define TREE_DATE_SHARD_SIZE	8	/* Min number of entries per walk. */
+#define TREE_DATE_POLL_LINES	64	/* Lines read between polling other walks. */
+
+struct tree_date_shard {
+	struct io io;
+	bool running;
+	size_t pending;		/* Entries left to annotate by this walk. */
+	char commit[SIZEOF_REV];
+	const struct ident *author;
+	struct time author_time;
+};
+
+struct tree_state {
+	int size_width;
+	bool read_date;
+	size_t *index;		/* Hash of entry names to line number + 1. */
+	size_t index_size;	/* Number of hash slots; a power of two. */
+	size_t entries;		/* Number of entries that can be annotated. */
+	size_t annotated;	/* Number of entries annotated so far. */
+	bool lastmod;		/* Use and update the last-modified index. */
+	struct tree_date_shard shard[TREE_DATE_SHARDS];
+	size_t shards;
+	size_t current;		/* Shard being read through view->pipe. */
+	size_t polled;		/* Lines read since other shards were polled. */
+};
+
+static const char *
+tree_path(const struct line *line)
+{
+	return ((struct tree_entry *) line->data)->name;
+}
+
+static int
+tree_compare_entry(const struct line *line1, const struct line *line2)
+{
+	if (line1->type != line2->type)
+		return line1->type == LINE_TREE_DIR ? -1 : 1;
+	return strcmp(tree_path(line1), tree_path(line2));
+}
+
+static int
+tree_compare_name(const void *l1, const void *l2)
+{
+	return tree_compare_entry(l1, l2);
+}
+
+/* Entries are appended as git-ls-tree(1) streams them in and sorted once
+ * all have been read. Names are unique within a tree so the order is
+ * total and stability of the sort does not matter. */
+static void
+tree_sort_entries(struct view *view)
+{
+	/* Skip "Directory ..." and ".." line. */
+	size_t first = 1 + !!*opt_path;
+	size_t i;
+
+	if (view->lines <= first)
+		return;
+
+	qsort(view->line + first, view->lines - first, sizeof(*view->line), tree_compare_name);
+
+	for (i = first; i < view->lines; i++) {
+		struct line *line = &view->line[i];
+
+		line->lineno = i + 1 - view->custom_lines;
+		line->dirty = line->cleareol = 1;
+	}
+}
+
+static const enum sort_field tree_sort_fields[] = {
+	ORDERBY_NAME, ORDERBY_DATE, ORDERBY_AUTHOR
+};
+static struct sort_state tree_sort_state = SORT_STATE(tree_sort_fields);
+
+static int
+tree_compare(const void *l1, const void *l2)
+{
+	const struct line *line1 = (const struct line *) l1;
+	const struct line *line2 = (const struct line *) l2;
+	const struct tree_entry *entry1 = ((const struct line *) l1)->data;
+	const struct tree_entry *entry2 = ((const struct line *) l2)->data;
+
+	if (line1->type == LINE_TREE_HEAD)
+		return -1;
+	if (line2->type == LINE_TREE_HEAD)
+		return 1;
+
+	switch (get_sort_field(tree_sort_state)) {
+	case ORDERBY_DATE:
+		return sort_order(tree_sort_state, timecmp(&entry1->time, &entry2->time));
+
+	case ORDERBY_AUTHOR:
+		return sort_order(tree_sort_state, ident_compare(entry1->author, entry2->author));
+
+	case ORDERBY_NAME:
+	default:
+		return sort_order(tree_sort_state, tree_compare_entry(line1, line2));
+	}
+}
+
+
+static struct line *
+tree_entry(struct view *view, enum line_type type, const char *path,
+	   const char *mode, const char *id, unsigned long size)
+{
+	bool custom = type == LINE_TREE_HEAD || tree_path_is_parent(path);
+	struct tree_entry *entry;
+	struct line *line = add_line_alloc(view, &entry, type, strlen(path), custom);
+
+	if (!line)
+		return NULL;
+
+	strncpy(entry->name, path, strlen(path));
+	if (mode)
+		entry->mode = strtoul(mode, NULL, 8);
+	if (id)
+		string_copy_rev(entry->id, id);
+	entry->size = size;
+
+	return line;
+}
+
+static void
+tree_index_free(struct tree_state *state)
+{
+	free(state->index);
+	state->index = NULL;
+	state->index_size = 0;
+}
+
+/* Index the entries by name so each changed path reported by git-log(1)
+ * can be mapped to its line in constant time. */
+static bool
+tree_index_entries(struct view *view, struct tree_state *state)
+{
+	size_t size = 16;
+	size_t i;
+
+	tree_index_free(state);
+	state->entries = state->annotated = 0;
+
+	while (size < view->lines * 2)
+		size *= 2;
+
+	state->index = calloc(size, sizeof(*state->index));
+	if (!state->index)
+		return FALSE;
+	state->index_size = size;
+
+	for (i = 0; i < view->lines; i++) {
+		struct line *line = &view->line[i];
+		struct tree_entry *entry = line->data;
+		size_t slot;
+
+		if (line->type == LINE_TREE_HEAD || tree_path_is_parent(entry->name))
+			continue;
+
+		slot = string_hash(entry->name) & (size - 1);
+		while (state->index[slot])
+			slot = (slot + 1) & (size - 1);
+		state->index[slot] = i + 1;
+
+		state->entries++;
+		state->annotated += !!entry->author;
+	}
+
+	return TRUE;
+}
+
+static struct line *
+tree_index_lookup(struct view *view, struct tree_state *state, const char *name)
+{
+	size_t slot = string_hash(name) & (state->index_size - 1);
+
+	for (; state->index[slot]; slot = (slot + 1) & (state->index_size - 1)) {
+		struct line *line = &view->line[state->index[slot] - 1];
+
+		if (!strcmp(tree_path(line), name))
+			return line;
+	}
+
+	return NULL;
+}
+
+/* Cache of fully annotated tree listings keyed by commit and directory
+ * so moving back and forth in the tree does not need to rerun git. The
+ * least recently used listings are evicted when the cache grows beyond
+ * TREE_CACHE_BYTES. */
+#define TREE_CACHE_BYTES	(8 * 1024 * 1024)
+
+struct tree_cache {
+	char commit[SIZEOF_REV];	/* Commit the tree belongs to. */
+	char *path;			/* Directory path of the listing. */
+	struct line *line;		/* Cached lines owning their entries. */
+	size_t lines;
+	int size_width;
+	size_t bytes;			/* Memory used by this listing. */
+};
+
+/* Ordered from least to most recently used. */
+static struct tree_cache *tree_cache;
+static size_t tree_cache_size;
+static size_t tree_cache_bytes;
+
+DEFINE_ALLOCATOR(realloc_tree_cache, struct tree_cache, 16)
+
+/* Look up a branch in the loose refs and then in packed-refs of the
+ * common git directory, which is shared by linked worktrees. */
+static bool
+tree_cache_read_ref(const char *ref, char id[SIZEOF_REV])
+{
+	char dir[SIZEOF_STR], buf[SIZEOF_STR];
+	struct io io;
+	char *line;
+	bool found = FALSE;
+
+	if (!io_open(&io, "%s/commondir", opt_git_dir) || !io_read_buf(&io, buf, sizeof(buf)))
+		string_copy(dir, opt_git_dir);
+	else if (*buf == '/')
+		string_copy(dir, buf);
+	else if (!string_format(dir, "%s/%s", opt_git_dir, buf))
+		return FALSE;
+
+	if (io_open(&io, "%s/%s", dir, ref))
+		return io_read_buf(&io, id, SIZEOF_REV);
+
+	if (!io_open(&io, "%s/packed-refs", dir))
+		return FALSE;
+	while (!found && (line = io_get(&io, '\n', TRUE))) {
+		if (strlen(line) > SIZEOF_REV && line[SIZEOF_REV - 1] == ' ' &&
+		    !strcmp(line + SIZEOF_REV, ref)) {
+			string_ncopy_do(id, SIZEOF_REV, line, SIZEOF_REV - 1);
+			found = TRUE;
+		}
+	}
+	io_done(&io);
+	return found;
+}
+
+/* HEAD can be moved from outside without the refs being reloaded, so
+ * it is read from the git directory each time. */
+static const char *
+tree_cache_head(void)
+{
+	static char head[SIZEOF_REV];
+	char buf[SIZEOF_STR];
+	struct io io;
+
+	if (!io_open(&io, "%s/HEAD", opt_git_dir) || !io_read_buf(&io, buf, sizeof(buf)))
+		return NULL;
+	head[0] = 0;
+	if (!prefixcmp(buf, "ref: ")) {
+		if (!tree_cache_read_ref(buf + STRING_SIZE("ref: "), head))
+			return NULL;
+	} else {
+		string_copy_rev(head, buf);
+	}
+	return strlen(head) == SIZEOF_REV - 1 && iscommit(head) ? head : NULL;
+}
+
+static const char *
+tree_cache_commit(struct view *view, const char *id)
+{
+	/* The first view lists the revision given on the command line. */
+	if (!view->prev && opt_rev_argv)
+		return NULL;
+	if (!strcmp(id, "HEAD"))
+		return tree_cache_head();
+	return iscommit((char *) id) ? id : NULL;
+}
+
+static void
+tree_cache_remove(size_t pos)
+{
+	struct tree_cache *cache = &tree_cache[pos];
+	size_t i;
+
+	for (i = 0; i < cache->lines; i++)
+		free(cache->line[i].data);
+	free(cache->line);
+	free(cache->path);
+	tree_cache_bytes -= cache->bytes;
+
+	memmove(cache, cache + 1, (tree_cache_size - pos - 1) * sizeof(*cache));
+	tree_cache_size--;
+}
+
+static struct tree_cache *
+tree_cache_find(const char *commit, const char *path)
+{
+	size_t i;
+
+	for (i = 0; commit && i < tree_cache_size; i++) {
+		struct tree_cache cache = tree_cache[i];
+
+		if (strcmp(cache.commit, commit) || strcmp(cache.path, path))
+			continue;
+
+		/* Mark as the most recently used listing. */
+		memmove(&tree_cache[i], &tree_cache[i + 1], (tree_cache_size - i - 1) * sizeof(cache));
+		tree_cache[tree_cache_size - 1] = cache;
+		return &tree_cache[tree_cache_size - 1];
+	}
+
+	return NULL;
+}
+
+static size_t
+tree_entry_size(const struct tree_entry *entry)
+{
+	return sizeof(*entry) + strlen(entry->name);
+}
+
+static void
+tree_cache_save(struct view *view, struct tree_state *state)
+{
+	const char *commit = tree_cache_commit(view, view->vid);
+	struct tree_cache *cache;
+	size_t i;
+
+	if (!commit)
+		return;
+
+	if (tree_cache_find(commit, opt_path))
+		tree_cache_remove(tree_cache_size - 1);
+
+	if (!realloc_tree_cache(&tree_cache, tree_cache_size, 1))
+		return;
+
+	cache = &tree_cache[tree_cache_size];
+	memset(cache, 0, sizeof(*cache));
+	string_copy_rev(cache->commit, commit);
+	cache->path = strdup(opt_path);
+	cache->line = calloc(view->lines, sizeof(*cache->line));
+	cache->size_width = state->size_width;
+	cache->bytes = view->lines * sizeof(*cache->line);
+	if (!cache->path || !cache->line) {
+		free(cache->path);
+		free(cache->line);
+		return;
+	}
+
+	for (i = 0; i < view->lines; i++) {
+		size_t size = tree_entry_size(view->line[i].data);
+		void *data = malloc(size);
+
+		if (!data)
+			break;
+		memcpy(data, view->line[i].data, size);
+		cache->line[i].type = view->line[i].type;
+		cache->line[i].data = data;
+		cache->bytes += size;
+		cache->lines++;
+	}
+
+	tree_cache_size++;
+	tree_cache_bytes += cache->bytes;
+	if (cache->lines < view->lines)
+		tree_cache_remove(tree_cache_size - 1);
+
+	while (tree_cache_bytes > TREE_CACHE_BYTES && tree_cache_size > 1)
+		tree_cache_remove(0);
+}
+
+static bool
+tree_cache_load(struct view *view, struct tree_state *state)
+{
+	struct tree_cache *cache = tree_cache_find(tree_cache_commit(view, view->id), opt_path);
+	size_t i;
+
+	if (!cache)
+		return FALSE;
+
+	reset_view(view);
+	string_ncopy(view->vid, view->id, strlen(view->id));
+	string_copy_rev(view->ref, view->id);
+	state->size_width = cache->size_width;
+
+	for (i = 0; i < cache->lines; i++) {
+		struct tree_entry *entry = cache->line[i].data;
+		enum line_type type = cache->line[i].type;
+		bool custom = type == LINE_TREE_HEAD || tree_path_is_parent(entry->name);
+
+		if (!add_line(view, entry, type, tree_entry_size(entry), custom)) {
+			reset_view(view);
+			return FALSE;
+		}
+	}
+
+	/* Move the current line to the first tree entry. */
+	if (!check_position(&view->prev_pos))
+		goto_view_line(view, 0, 1);
+
+	return TRUE;
+}
+
+static bool
+tree_lastmod_set_path(char *path, const struct lastmod *lastmod)
+{
+	char *sep;
+
+	/* Changing a file also modifies all its parent directories. */
+	do {
+		if (!lastmod_set(path, lastmod))
+			return FALSE;
+		sep = strrchr(path, '/');
+		if (sep)
+			*sep = 0;
+	} while (sep);
+
+	return TRUE;
+}
+
+/* Move the last-modified index forward to a new HEAD in the background by
+ * replaying the changes made since the commit it was saved for. If that
+ * commit is not an ancestor the index is started over. */
+struct tree_lastmod_sync {
+	struct io io;
+	bool running;
+	bool reading_log;		/* Else reading the merge base. */
+	char head[SIZEOF_REV];
+	char merge_base[SIZEOF_REV];
+	const struct ident *author;
+	struct time time;
+	struct lastmod lastmod;
+};
+
+static struct tree_lastmod_sync tree_lastmod_sync;
+
+/* Pending updates are written once no more have been added for a while,
+ * instead of after every directory walk, or when tig exits. */
+#define TREE_LASTMOD_SAVE_DELAY	5	/* Seconds. */
+
+static time_t tree_lastmod_updated;
+
+static void
+tree_lastmod_flush(void)
+{
+	/* The sync writes all pending updates when it is done. */
+	if (tree_lastmod_updated && !tree_lastmod_sync.running)
+		lastmod_save();
+	tree_lastmod_updated = 0;
+}
+
+static bool
+tree_lastmod_save_poll(void *data)
+{
+	if (!tree_lastmod_updated)
+		return FALSE;
+	if (time(NULL) - tree_lastmod_updated < TREE_LASTMOD_SAVE_DELAY)
+		return TRUE;
+	tree_lastmod_flush();
+	return FALSE;
+}
+
+static bool
+tree_lastmod_sync_log(struct tree_lastmod_sync *job)
+{
+	char range[SIZEOF_STR];
+	const char *log_argv[] = {
+		"git", "log", encoding_arg, "--no-color", "--pretty=raw", "--cc", "--raw",
+			"--no-renames", "--reverse", range, "--", NULL
+	};
+
+	return string_format(range, "%s..%s", job->merge_base, job->head) &&
+	       io_run(&job->io, IO_RD, opt_cdup, opt_env, log_argv);
+}
+
+static bool
+tree_lastmod_sync_read(struct tree_lastmod_sync *job, char *text)
+{
+	if (!job->reading_log) {
+		string_copy_rev(job->merge_base, text);
+
+	} else if (*text == 'c' && get_line_type(text) == LINE_COMMIT) {
+		string_copy_rev_from_commit_line(job->lastmod.id, text);
+
+	} else if (*text == 'a' && get_line_type(text) == LINE_AUTHOR) {
+		parse_author_line(text + STRING_SIZE("author "), &job->author, &job->time);
+
+	} else if (*text == ':' && job->author) {
+		char *path = strchr(text, '\t');
+
+		job->lastmod.author_name = job->author->name;
+		job->lastmod.author_email = job->author->email;
+		job->lastmod.time = job->time.sec;
+		job->lastmod.tz = job->time.tz;
+		return !path || tree_lastmod_set_path(path + 1, &job->lastmod);
+	}
+
+	return TRUE;
+}
+
+static bool
+tree_lastmod_sync_poll(void *data)
+{
+	struct tree_lastmod_sync *job = &tree_lastmod_sync;
+	bool can_read = TRUE, ok = TRUE;
+	char *text;
+
+	if (!job->running)
+		return FALSE;
+	if (!io_can_read(&job->io, FALSE))
+		return TRUE;
+
+	/* With --reverse newer changes overwrite older ones. */
+	for (; ok && (text = io_get(&job->io, '\n', can_read)); can_read = FALSE)
+		ok = tree_lastmod_sync_read(job, text);
+
+	if (ok && !io_eof(&job->io) && !io_error(&job->io))
+		return TRUE;
+
+	ok = ok && !io_error(&job->io);
+	if (!ok)
+		io_kill(&job->io);
+	io_done(&job->io);
+
+	if (ok && !job->reading_log) {
+		job->reading_log = TRUE;
+		if (!strcmp(job->merge_base, lastmod_commit()) && tree_lastmod_sync_log(job))
+			return TRUE;
+		ok = FALSE;
+	}
+
+	job->running = FALSE;
+	if (!ok) {
+		lastmod_reset(job->head);
+		return FALSE;
+	}
+
+	lastmod_set_commit(job->head);
+	lastmod_save();
+	tree_lastmod_updated = 0;
+	return FALSE;
+}
+
+static void
+tree_lastmod_sync_start(const char *head)
+{
+	struct tree_lastmod_sync *job = &tree_lastmod_sync;
+	const char *base = lastmod_commit();
+	const char *merge_base_argv[] = {
+		"git", "merge-base", base, head, NULL
+	};
+
+	/* A sync to an older HEAD is left to finish first. */
+	if (job->running)
+		return;
+
+	memset(job, 0, sizeof(*job));
+	string_copy_rev(job->head, head);
+	if (!*base || !io_run(&job->io, IO_RD, opt_cdup, opt_env, merge_base_argv)) {
+		lastmod_reset(head);
+		return;
+	}
+
+	/* Try again with the next tree if no job can be added. */
+	if (!background_add(tree_lastmod_sync_poll, NULL)) {
+		io_kill(&job->io);
+		io_done(&job->io);
+		return;
+	}
+	job->running = TRUE;
+}
+
+static bool
+tree_lastmod_path(char *buf, size_t bufsize, const struct tree_entry *entry)
+{
+	return string_format_size(buf, bufsize, "%s%s", opt_path, entry->name);
+}
+
+/* Annotate entries from the last-modified index when the tree view shows
+ * HEAD. Returns TRUE if all entries could be annotated. */
+static bool
+tree_lastmod_annotate(struct view *view, struct tree_state *state)
+{
+	const char *commit = tree_cache_commit(view, view->vid);
+	size_t i;
+
+	state->lastmod = opt_tree_date_index && commit && get_ref_head() &&
+			 !strcmp(commit, get_ref_head()->id) &&
+			 lastmod_load(opt_git_dir);
+
+	/* Until the index has caught up the tree is annotated by walking. */
+	if (state->lastmod && strcmp(lastmod_commit(), commit)) {
+		tree_lastmod_sync_start(commit);
+		state->lastmod = !strcmp(lastmod_commit(), commit);
+	}
+	if (!state->lastmod)
+		return FALSE;
+
+	for (i = 0; i < view->lines; i++) {
+		struct line *line = &view->line[i];
+		struct tree_entry *entry = line->data;
+		char path[SIZEOF_STR];
+		struct lastmod lastmod;
+
+		if (line->type == LINE_TREE_HEAD || tree_path_is_parent(entry->name) ||
+		    entry->author || !tree_lastmod_path(path, sizeof(path), entry) ||
+		    !lastmod_get(path, &lastmod))
+			continue;
+
+		string_copy_rev(entry->commit, lastmod.id);
+		entry->author = get_author(lastmod.author_name, lastmod.author_email);
+		entry->time.sec = lastmod.time;
+		entry->time.tz = lastmod.tz;
+		line->dirty = 1;
+		state->annotated++;
+	}
+
+	return state->annotated == state->entries;
+}
+
+static void
+tree_lastmod_save(struct view *view)
+{
+	size_t i;
+
+	for (i = 0; i < view->lines; i++) {
+		struct line *line = &view->line[i];
+		struct tree_entry *entry = line->data;
+		struct lastmod lastmod = {};
+		char path[SIZEOF_STR];
+
+		if (line->type == LINE_TREE_HEAD || tree_path_is_parent(entry->name) ||
+		    !entry->author || !tree_lastmod_path(path, sizeof(path), entry))
+			continue;
+
+		string_copy_rev(lastmod.id, entry->commit);
+		lastmod.author_name = entry->author->name;
+		lastmod.author_email = entry->author->email;
+		lastmod.time = entry->time.sec;
+		lastmod.tz = entry->time.tz;
+		if (!lastmod_set(path, &lastmod))
+			return;
+	}
+
+	tree_lastmod_updated = time(NULL);
+	background_add(tree_lastmod_save_poll, NULL);
+}
+
+static void
+tree_date_read(struct view *view, struct tree_state *state,
+	       struct tree_date_shard *shard, char *text)
+{
+	if (*text == 'c' && get_line_type(text) == LINE_COMMIT) {
+		string_copy_rev_from_commit_line(shard->commit, text);
+
+	} else if (*text == 'a' && get_line_type(text) == LINE_AUTHOR) {
+		parse_author_line(text + STRING_SIZE("author "),
+				  &shard->author, &shard->author_time);
+
+	} else if (*text == ':') {
+		struct tree_date_shard *owner;
+		struct line *line;
+		struct tree_entry *entry;
+		char *pos;
+
+		pos = strchr(text, '\t');
+		if (!pos)
+			return;
+		text = pos + 1;
+		if (*opt_path && !strncmp(text, opt_path, strlen(opt_path)))
+			text += strlen(opt_path);
+		pos = strchr(text, '/');
+		if (pos)
+			*pos = 0;
+
+		line = tree_index_lookup(view, state, text);
+		entry = line ? line->data : NULL;
+		if (!entry || entry->author)
+			return;
+
+		string_copy_rev(entry->commit, shard->commit);
+		entry->author = shard->author;
+		entry->time = shard->author_time;
+		line->dirty = 1;
+		state->annotated++;
+
+		/* Stop the walk as soon as its group is fully annotated. */
+		owner = &state->shard[line->user_flags];
+		if (owner->pending && !--owner->pending)
+			io_kill(&owner->io);
+	}
+}
+
+/* Read what is available from the walks not connected to view->pipe. */
+static void
+tree_date_poll(struct view *view, struct tree_state *state)
+{
+	struct encoding *encoding = view->encoding ? view->encoding : default_encoding;
+	size_t i;
+
+	state->polled = 0;
+
+	for (i = 0; i < state->shards; i++) {
+		struct tree_date_shard *shard = &state->shard[i];
+		bool can_read = TRUE;
+		char *text;
+
+		if (!shard->running || i == state->current ||
+		    !io_can_read(&shard->io, FALSE))
+			continue;
+
+		for (; (text = io_get(&shard->io, '\n', can_read)); can_read = FALSE) {
+			if (encoding)
+				text = encoding_convert(encoding, text);
+			tree_date_read(view, state, shard, text);
+		}
+	}
+}
+
+/* Drain the other walks also while the current walk is quiet, so they
+ * do not stall on full pipes. */
+static bool
+tree_date_poll_job(void *data)
+{
+	struct view *view = data;
+	struct tree_state *state = view->private;
+
+	if (!state || !state->read_date || !view->pipe)
+		return FALSE;
+
+	tree_date_poll(view, state);
+	if (view_is_displayed(view))
+		redraw_view_dirty(view);
+	return TRUE;
+}
+
+static void
+tree_date_stop(struct tree_state *state)
+{
+	size_t i;
+
+	for (i = 0; i < state->shards; i++) {
+		struct tree_date_shard *shard = &state->shard[i];
+
+		if (!shard->running || i == state->current)
+			continue;
+		io_kill(&shard->io);
+		io_done(&shard->io);
+		shard->running = FALSE;
+	}
+}
+
+static size_t
+tree_date_shards(size_t pending)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t shards = (pending + TREE_DATE_SHARD_SIZE - 1) / TREE_DATE_SHARD_SIZE;
+
+	if (cpus > 0 && shards > cpus)
+		shards = cpus;
+	if (shards > TREE_DATE_SHARDS)
+		shards = TREE_DATE_SHARDS;
+	return shards ? shards : 1;
+}
+
+/* Split the entries which are not yet annotated into groups and start a
+ * history walk limited to the paths of each group. The walks run
+ * concurrently, with the first one connected to view->pipe. */
+static bool
+tree_date_start(struct view *view, struct tree_state *state)
+{
+	const char *log_argv[] = {
+		"git", "--literal-pathspecs", "log", encoding_arg, "--no-color",
+			"--pretty=raw", "--cc", "--raw", view->id, "--"
+	};
+	size_t shards = tree_date_shards(state->entries - state->annotated);
+	const char **argv[TREE_DATE_SHARDS] = {};
+	size_t argc[TREE_DATE_SHARDS] = {};
+	char **paths = calloc(state->entries + 1, sizeof(*paths));
+	char path[SIZEOF_STR];
+	size_t i, next = 0, npaths = 0;
+	bool ok = paths != NULL;
+
+	for (i = 0; ok && i < shards; i++) {
+		argv[i] = calloc(ARRAY_SIZE(log_argv) + state->entries + 2, sizeof(*argv[i]));
+		ok = argv[i] != NULL;
+		if (ok) {
+			memcpy(argv[i], log_argv, sizeof(log_argv));
+			argc[i] = ARRAY_SIZE(log_argv);
+		}
+	}
+
+	/* The walks run from the top of the working tree, which works
+	 * also when the tree's directory is not checked out. */
+	for (i = 0; ok && i < view->lines; i++) {
+		struct line *line = &view->line[i];
+		struct tree_entry *entry = line->data;
+		size_t shard;
+
+		if (line->type == LINE_TREE_HEAD || tree_path_is_parent(entry->name) ||
+		    entry->author)
+			continue;
+
+		shard = next++ % shards;
+		line->user_flags = shard;
+		state->shard[shard].pending++;
+		if (shards == 1)
+			continue;
+		if (!string_format(path, "%s%s", opt_path, entry->name) ||
+		    !(paths[npaths] = strdup(path))) {
+			ok = FALSE;
+			break;
+		}
+		argv[shard][argc[shard]++] = paths[npaths++];
+	}
+
+	if (ok && shards == 1)
+		argv[0][argc[0]++] = *opt_path ? opt_path : ".";
+
+	state->shards = state->current = state->polled = 0;
+	for (i = 0; ok && i < shards; i++) {
+		struct tree_date_shard *shard = &state->shard[i];
+
+		ok = io_run(&shard->io, IO_RD, opt_cdup, opt_env, argv[i]);
+		shard->running = ok;
+		state->shards += ok;
+	}
+
+	for (i = 0; i < shards; i++)
+		free(argv[i]);
+	for (i = 0; i < npaths; i++)
+		free(paths[i]);
+	free(paths);
+
+	if (!ok) {
+		tree_date_stop(state);
+		return FALSE;
+	}
+
+	if (state->shards > 1)
+		background_add(tree_date_poll_job, view);
+
+	io_done(view->pipe);
+	view->pipe = &state->shard[0].io;
+	return TRUE;
+}
+
+static bool
+tree_read_date(struct view *view, char *text, struct tree_state *state)
+{
+	if (!text && state->read_date) {
+		/* When the loading was not stopped by the user continue
+		 * reading from the next walk still running. */
+		bool stopped = !io_eof(view->pipe) && state->annotated < state->entries;
+		size_t i;
+
+		state->shard[state->current].running = FALSE;
+		for (i = 0; !stopped && i < state->shards; i++) {
+			if (!state->shard[i].running)
+				continue;
+			io_done(view->pipe);
+			view->pipe = &state->shard[i].io;
+			state->current = i;
+			tree_date_poll(view, state);
+			return FALSE;
+		}
+
+		tree_date_stop(state);
+		if (!stopped || state->annotated == state->entries) {
+			tree_cache_save(view, state);
+			if (state->lastmod)
+				tree_lastmod_save(view);
+		}
+		state->read_date = FALSE;
+		tree_index_free(state);
+		return TRUE;
+
+	} else if (!text) {
+		if (!view->lines) {
+			tree_entry(view, LINE_TREE_HEAD, opt_path, NULL, NULL, 0);
+			tree_entry(view, LINE_TREE_DIR, "..", "040000", view->ref, 0);
+			report("Tree is empty");
+			return TRUE;
+		}
+
+		if (tree_index_entries(view, state) &&
+		    tree_lastmod_annotate(view, state)) {
+			tree_cache_save(view, state);
+			tree_index_free(state);
+			return TRUE;
+		}
+
+		if (!state->index || !tree_date_start(view, state)) {
+			tree_index_free(state);
+			report("Failed to load tree data");
+			return TRUE;
+		}
+
+		state->read_date = TRUE;
+		return FALSE;
+	}
+
+	tree_date_read(view, state, &state->shard[state->current], text);
+	if (++state->polled >= TREE_DATE_POLL_LINES)
+		tree_date_poll(view, state);
+	return TRUE;
+}
+
+static inline size_t
+parse_size(const char *text, int *max_digits)
+{
+	size_t size = 0;
+	int digits = 0;
+
+	while (*text == ' ')
+		text++;
+
+	while (isdigit(*text)) {
+		size = (size * 10) + (*text++ - '0');
+		digits++;
+	}
+
+	if (digits > *max_digits)
+		*max_digits = digits;
+
+	return size;
+}
+
+static bool
+tree_read(struct view *view, char *text)
+{
+	struct tree_state *state = view->private;
+	enum line_type type;
+	size_t textlen = text ? strlen(text) : 0;
+	const char *attr_offset = text + SIZEOF_TREE_ATTR;
+	char *path;
+	size_t size;
+
+	if (!text && !state->read_date)
+		tree_sort_entries(view);
+
+	if (state->read_date || !text)
+		return tree_read_date(view, text, state);
+
+	if (textlen <= SIZEOF_TREE_ATTR)
+		return FALSE;
+	if (view->lines == 0 &&
+	    !tree_entry(view, LINE_TREE_HEAD, opt_path, NULL, NULL, 0))
+		return FALSE;
+
+	size = parse_size(attr_offset, &state->size_width);
+	path = strchr(attr_offset, '\t');
+	if (!path)
+		return FALSE;
+	path++;
+
+	/* Strip the path part ... */
+	if (*opt_path) {
+		size_t pathlen = textlen - SIZEOF_TREE_ATTR;
+		size_t striplen = strlen(opt_path);
+
+		if (pathlen > striplen)
+			memmove(path, path + striplen,
+				pathlen - striplen + 1);
+
+		/* Insert "link" to parent directory. */
+		if (view->lines == 1 &&
+		    !tree_entry(view, LINE_TREE_DIR, "..", "040000", view->ref, 0))
+			return FALSE;
+	}
+
+	type = text[SIZEOF_TREE_MODE] == 't' ? LINE_TREE_DIR : LINE_TREE_FILE;
+	if (!tree_entry(view, type, path, text, text + TREE_ID_OFFSET, size))
+		return FALSE;
+
+	/* Move the current line to the first tree entry. */
+	if (!check_position(&view->prev_pos) && !check_position(&view->pos))
+		goto_view_line(view, 0, 1);
+
+	return TRUE;
+}
+
+static bool
+tree_draw(struct view *view, struct line *line, unsigned int lineno)
+{
+	struct tree_state *state = view->private;
+	struct tree_entry *entry = line->data;
+
+	if (line->type == LINE_TREE_HEAD) {
+		if (draw_text(view, line->type, "Directory path /"))
+			return TRUE;
+	} else {
+		if (draw_mode(view, entry->mode))
+			return TRUE;
+
+		if (draw_author(view, entry->author))
+			return TRUE;
+
+		if (draw_file_size(view, entry->size, state->size_width,
+				   line->type != LINE_TREE_FILE))
+			return TRUE;
+
+		if (draw_date(view, &entry->time))
+			return TRUE;
+
+		if (draw_id(view, entry->commit))
+			return TRUE;
+	}
+
+	draw_text(view, line->type, entry->name);
+	return TRUE;
+}
+
+static void
+open_blob_editor(const char *id, const char *name, unsigned int lineno)
+{
+	const char *blob_argv[] = { "git", "cat-file", "blob", id, NULL };
+	char file[SIZEOF_STR];
+	int fd;
+
+	if (!name)
+		name = "unknown";
+
+	if (!string_format(file, "%s/tigblob.XXXXXX.%s", get_temp_dir(), name)) {
+		report("Temporary file name is too long");
+		return;
+	}
+
+	fd = mkstemps(file, strlen(name) + 1);
+
+	if (fd == -1)
+		report("Failed to create temporary file");
+	else if (!io_run_append(blob_argv, fd))
+		report("Failed to save blob data to file");
+	else
+		open_editor(file, lineno);
+	if (fd != -1)
+		unlink(file);
+}
+
+static enum request
+tree_request(struct view *view, enum request request, struct line *line)
+{
+	struct tree_state *state = view->private;
+	enum open_flags flags;
+	struct tree_entry *entry = line->data;
+
+	switch (request) {
+	case REQ_VIEW_BLAME:
+		if (line->type != LINE_TREE_FILE) {
+			report("Blame only supported for files");
+			return REQ_NONE;
+		}
+
+		string_copy(opt_ref, view->vid);
+		return request;
+
+	case REQ_EDIT:
+		if (line->type != LINE_TREE_FILE) {
+			report("Edit only supported for files");
+		} else if (!is_head_commit(view->vid)) {
+			open_blob_editor(entry->id, entry->name, 0);
+		} else {
+			open_editor(opt_file, 0);
+		}
+		return REQ_NONE;
+
+	case REQ_TOGGLE_SORT_FIELD:
+	case REQ_TOGGLE_SORT_ORDER:
+		sort_view(view, request, &tree_sort_state, tree_compare);
+		/* Sorting moves the lines the date annotation refers to. */
+		if (state->index && !tree_index_entries(view, state))
+			end_update(view, TRUE);
+		return REQ_NONE;
+
+	case REQ_PARENT:
+	case REQ_BACK:
+		if (!*opt_path) {
+			/* quit view if at top of tree */
+			return REQ_VIEW_CLOSE;
+		}
+		/* fake 'cd  ..' */
+		line = &view->line[1];
+		break;
+
+	case REQ_ENTER:
+		break;
+
+	default:
+		return request;
+	}
+
+	/* Cleanup the stack if the tree view is at a different tree. */
+	if (!*opt_path)
+		reset_view_history(&tree_view_history);
+
+	switch (line->type) {
+	case LINE_TREE_DIR:
+		/* Depending on whether it is a subdirectory or parent link
+		 * mangle the path buffer. */
+		if (line == &view->line[1] && *opt_path) {
+			pop_tree_stack_entry(&view->pos);
+
+		} else {
+			const char *basename = tree_path(line);
+
+			push_tree_stack_entry(basename, &view->pos);
+		}
+
+		/* Trees and subtrees share the same ID, so they are not not
+		 * unique like blobs. */
+		flags = OPEN_RELOAD;
+		request = REQ_VIEW_TREE;
+		break;
+
+	case LINE_TREE_FILE:
+		flags = view_is_displayed(view) ? OPEN_SPLIT : OPEN_DEFAULT;
+		request = REQ_VIEW_BLOB;
+		break;
+
+	default:
+		return REQ_NONE;
+	}
+
+	open_view(view, request, flags);
+
+	return REQ_NONE;
+}
+
+static bool
+tree_grep(struct view *view, struct line *line)
+{
+	struct tree_entry *entry = line->data;
+	const char *text[] = {
+		entry->name,
+		mkauthor(entry->author, opt_author_width, opt_author),
+		mkdate(&entry->time, opt_date),
+		NULL
+	};
+
+	return grep_text(view, text);
+}
+
+static void
+tree_select(struct view *view, struct line *line)
+{
+	struct tree_entry *entry = line->data;
+
+	if (line->type == LINE_TREE_HEAD) {
+		string_format(view->ref, "Files in /%s", opt_path);
+		return;
+	}
+
+	if (line->type == LINE_TREE_DIR && tree_path_is_parent(entry->name)) {
+		string_copy(view->ref, "Open parent directory");
+		ref_blob[0] = 0;
+		return;
+	}
+
+	if (line->type == LINE_TREE_FILE) {
+		string_copy_rev(ref_blob, entry->id);
+		string_format(opt_file, "%s%s", opt_path, tree_path(line));
+	}
+
+	string_copy_rev(view->ref, entry->id);
+}
+
+static bool
+tree_open(struct view *view, enum open_flags flags)
+{
+	static const char *tree_argv[] = {
+		"git", "ls-tree", "-l", "%(commit)", "%(directory)", NULL
+	};
+
+	if (string_rev_is_null(ref_commit)) {
+		report("No tree exists for this commit");
+		return FALSE;
+	}
+
+	if (view->lines == 0 && opt_prefix[0]) {
+		char *pos = opt_prefix;
+
+		while (pos && *pos) {
+			char *end = strchr(pos, '/');
+
+			if (end)
+				*end = 0;
+			push_tree_stack_entry(pos, &view->pos);
+			pos = end;
+			if (end) {
+				*end = '/';
+				pos++;
+			}
+		}
+
+	} else if (strcmp(view->vid, view->id)) {
+		opt_path[0] = 0;
+	}
+
+	if ((flags & OPEN_RELOAD || strcmp(view->vid, view->id)) &&
+	    tree_cache_load(view, view->private))
+		return TRUE;
+
+	return begin_update(view, opt_cdup, tree_argv, flags);
+}
+
+static struct view_ops tree_ops = {
+	"file",
+	{ "tree" },
+	VIEW_SEND_CHILD_ENTER,
+	sizeof(struct tree_state),
+	tree_open,
+	tree_read,
+	tree_draw,
+	tree_request,
+	tree_grep,
+	tree_select,
+};
+
+static bool
+blob_open(struct view *view, enum open_flags flags)
+{
+	static const char *blob_argv[] = {
+		"git", "cat-file", "blob", "%(blob)", NULL
+	};
+
+	if (!ref_blob[0] && opt_file[0]) {
+		const char *commit = ref_commit[0] ? ref_commit : "HEAD";
+		char blob_spec[SIZEOF_STR];
+		const char *rev_parse_argv[] = {
+			"git", "rev-parse", blob_spec, NULL
+		};
+
+		if (!string_format(blob_spec, "%s:%s", commit, opt_file) ||
+		    !io_run_buf(rev_parse_argv, ref_blob, sizeof(ref_blob))) {
+			report("Failed to resolve blob from file name");
+			return FALSE;
+		}
+	}
+
+	if (!ref_blob[0]) {
+		report("No file chosen, press %s to open tree view",
+			get_view_key(view, REQ_VIEW_TREE));
+		return FALSE;
+	}
+
+	view->encoding = get_path_encoding(opt_file, default_encoding);
+
+	return begin_update(view, NULL, blob_argv, flags);
+}
+
+static bool
+blob_read(struct view *view, char *line)
+{
+	if (!line)
+		return TRUE;
+	return add_line_text(view, line, LINE_DEFAULT) != NULL;
+}
+
+static enum request
+blob_request(struct view *view, enum request request, struct line *line)
+{
+	switch (request) {
+	case REQ_VIEW_BLAME:
+		if (view->parent)
+			string_copy(opt_ref, view->parent->vid);
+		return request;
+
+	case REQ_EDIT:
+		open_blob_editor(view->vid, NULL, (line - view->line) + 1);
+		return REQ_NONE;
+	default:
+		return pager_request(view, request, line);
+	}
+}
+
+static struct view_ops blob_ops = {
+	"line",
+	{ "blob" },
+	VIEW_NO_FLAGS,
+	0,
+	blob_open,
+	blob_read,
+	pager_draw,
+	blob_request,
+	pager_grep,
+	pager_select,
+};
+
+/*
+ * Finder backend
+ *
+ * Lists all files of a commit from a single recursive ls-tree. File names
+ * are stored in an arena and share their directory prefix, which is
+ * interned. Typing a query keeps the files whose path contains its
+ * characters in order. The matches for each query prefix are kept along
+ * with the offset of the last matched character, so each keystroke only
+ * has to look for one more character in the files matched so far.
+ */
+
+#define FINDER_ARENA_SIZE	(1024 * 1024)
+
+struct finder_arena {
+	struct finder_arena *next;
+	size_t used;
+	char data[1];
+};
+
+struct finder_dir {
+	struct finder_dir *next;	/* Next directory in the hash chain. */
+	size_t len;
+	char path[1];			/* Directory path with trailing slash. */
+};
+
+struct finder_file {
+	const struct finder_dir *dir;
+	char name[1];
+};
+
+struct finder_match {
+	unsigned int file;		/* Position in finder_files. */
+	unsigned int end;		/* Offset after the last matched character. */
+};
+
+static struct finder_arena *finder_arena;
+static struct finder_dir **finder_dirs;
+static size_t finder_dirs_size;
+static size_t finder_dirs_slots;
+static const struct finder_dir *finder_last_dir;
+static struct finder_file **finder_files;
+static size_t finder_files_size;
+
+/* Matches for each prefix of the query; level 0 is unused. */
+static char finder_query[SIZEOF_STR];
+static size_t finder_levels;
+static struct finder_match *finder_matches[SIZEOF_STR];
+static size_t finder_matches_size[SIZEOF_STR];
+
+DEFINE_ALLOCATOR(realloc_finder_files, struct finder_file *, 4096)
+DEFINE_ALLOCATOR(realloc_finder_matches, struct finder_match, 4096)
+
+static void *
+finder_alloc(size_t size)
+{
+	struct finder_arena *arena = finder_arena;
+	void *data;
+
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	if (!arena || arena->used + size > FINDER_ARENA_SIZE) {
+		size_t arena_size = MAX(size, FINDER_ARENA_SIZE);
+
+		arena = malloc(sizeof(*arena) + arena_size);
+		if (!arena)
+			return NULL;
+		arena->next = finder_arena;
+		arena->used = 0;
+		finder_arena = arena;
+	}
+
+	data = arena->data + arena->used;
+	arena->used += size;
+	return data;
+}
+
+static void
+finder_clear_query(void)
+{
+	size_t i;
+
+	for (i = 1; i <= finder_levels; i++) {
+		free(finder_matches[i]);
+		finder_matches[i] = NULL;
+		finder_matches_size[i] = 0;
+	}
+	finder_levels = 0;
+	finder_query[0] = 0;
+}
+
+static void
+finder_done(struct view *view)
+{
+	size_t i;
+
+	/* Lines point into the arena. */
+	for (i = 0; i < view->lines; i++)
+		view->line[i].data = NULL;
+
+	while (finder_arena) {
+		struct finder_arena *next = finder_arena->next;
+
+		free(finder_arena);
+		finder_arena = next;
+	}
+
+	free(finder_dirs);
+	finder_dirs = NULL;
+	finder_dirs_size = finder_dirs_slots = 0;
+	finder_last_dir = NULL;
+
+	free(finder_files);
+	finder_files = NULL;
+	finder_files_size = 0;
+
+	finder_clear_query();
+}
+
+static bool
+finder_grow_dirs(void)
+{
+	size_t slots = finder_dirs_slots ? finder_dirs_slots * 2 : 1024;
+	struct finder_dir **dirs = calloc(slots, sizeof(*dirs));
+	size_t i;
+
+	if (!dirs)
+		return FALSE;
+
+	for (i = 0; i < finder_dirs_slots; i++) {
+		struct finder_dir *dir = finder_dirs[i];
+
+		while (dir) {
+			struct finder_dir *next = dir->next;
+			size_t slot = string_hash(dir->path) & (slots - 1);
+
+			dir->next = dirs[slot];
+			dirs[slot] = dir;
+			dir = next;
+		}
+	}
+
+	free(finder_dirs);
+	finder_dirs = dirs;
+	finder_dirs_slots = slots;
+	return TRUE;
+}
+
+/* Intern the first len characters of path, including the trailing slash. */
+static const struct finder_dir *
+finder_get_dir(const char *path, size_t len)
+{
+	struct finder_dir *dir;
+	char buf[SIZEOF_STR];
+	size_t slot;
+
+	/* Files of a directory are mostly listed together. */
+	if (finder_last_dir && finder_last_dir->len == len &&
+	    !strncmp(finder_last_dir->path, path, len))
+		return finder_last_dir;
+
+	if (len >= sizeof(buf))
+		return NULL;
+	memcpy(buf, path, len);
+	buf[len] = 0;
+
+	if (finder_dirs_size >= finder_dirs_slots && !finder_grow_dirs())
+		return NULL;
+
+	slot = string_hash(buf) & (finder_dirs_slots - 1);
+	for (dir = finder_dirs[slot]; dir; dir = dir->next)
+		if (dir->len == len && !strcmp(dir->path, buf))
+			return finder_last_dir = dir;
+
+	dir = finder_alloc(sizeof(*dir) + len);
+	if (!dir)
+		return NULL;
+	strcpy(dir->path, buf);
+	dir->len = len;
+	dir->next = finder_dirs[slot];
+	finder_dirs[slot] = dir;
+	finder_dirs_size++;
+
+	return finder_last_dir = dir;
+}
+
+static inline const char *
+finder_find_char(const char *str, char c)
+{
+	char set[] = { tolower(c), toupper(c), 0 };
+
+	/* Both use vectorised implementations in most C libraries. */
+	return set[0] == set[1] ? strchr(str, c) : strpbrk(str, set);
+}
+
+/* Case-insensitively search for c after offset, updating offset past
+ * the match. */
+static bool
+finder_match_char(const struct finder_file *file, unsigned int *offset, char c)
+{
+	size_t dirlen = file->dir ? file->dir->len : 0;
+	const char *pos;
+
+	if (*offset < dirlen) {
+		pos = finder_find_char(file->dir->path + *offset, c);
+		if (pos) {
+			*offset = pos - file->dir->path + 1;
+			return TRUE;
+		}
+		*offset = dirlen;
+	}
+
+	pos = finder_find_char(file->name + *offset - dirlen, c);
+	if (!pos)
+		return FALSE;
+	*offset = dirlen + (pos - file->name) + 1;
+	return TRUE;
+}
+
+static bool
+finder_add_match(size_t level, unsigned int file, unsigned int end)
+{
+	size_t size = finder_matches_size[level];
+	struct finder_match *match;
+
+	if (!realloc_finder_matches(&finder_matches[level], size, 1))
+		return FALSE;
+	match = &finder_matches[level][finder_matches_size[level]++];
+	match->file = file;
+	match->end = end;
+	return TRUE;
+}
+
+/* Match a file against all query levels. */
+static bool
+finder_match_file(unsigned int pos, bool *matched)
+{
+	const struct finder_file *file = finder_files[pos];
+	unsigned int end = 0;
+	size_t level;
+
+	*matched = TRUE;
+	for (level = 1; level <= finder_levels; level++) {
+		if (!finder_match_char(file, &end, finder_query[level - 1])) {
+			*matched = FALSE;
+			break;
+		}
+		if (!finder_add_match(level, pos, end))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static bool
+finder_add_level(char c)
+{
+	size_t level = finder_levels + 1;
+	size_t i;
+
+	if (level >= ARRAY_SIZE(finder_matches))
+		return FALSE;
+
+	finder_query[level - 1] = c;
+	finder_query[level] = 0;
+	finder_matches_size[level] = 0;
+
+	if (level == 1) {
+		for (i = 0; i < finder_files_size; i++) {
+			unsigned int end = 0;
+
+			if (finder_match_char(finder_files[i], &end, c) &&
+			    !finder_add_match(level, i, end))
+				return FALSE;
+		}
+
+	} else {
+		for (i = 0; i < finder_matches_size[level - 1]; i++) {
+			struct finder_match *match = &finder_matches[level - 1][i];
+			unsigned int end = match->end;
+
+			if (finder_match_char(finder_files[match->file], &end, c) &&
+			    !finder_add_match(level, match->file, end))
+				return FALSE;
+		}
+	}
+
+	finder_levels = level;
+	return TRUE;
+}
+
+static void
+finder_drop_level(void)
+{
+	if (!finder_levels)
+		return;
+	free(finder_matches[finder_levels]);
+	finder_matches[finder_levels] = NULL;
+	finder_matches_size[finder_levels] = 0;
+	finder_query[--finder_levels] = 0;
+}
+
+/* Replace the view lines with the files matching the query. */
+static bool
+finder_show(struct view *view)
+{
+	size_t lines = finder_levels ? finder_matches_size[finder_levels] : finder_files_size;
+	size_t i;
+
+	view->lines = 0;
+	if (lines && !realloc_lines(&view->line, 0, lines))
+		return FALSE;
+
+	for (i = 0; i < lines; i++) {
+		struct line *line = &view->line[i];
+		size_t file = finder_levels ? finder_matches[finder_levels][i].file : i;
+
+		memset(line, 0, sizeof(*line));
+		line->type = LINE_DEFAULT;
+		line->lineno = i + 1;
+		line->dirty = 1;
+		line->data = finder_files[file];
+	}
+
+	view->lines = lines;
+	clear_position(&view->pos);
+	return TRUE;
+}
+
+static bool
+finder_update(struct view *view)
+{
+	if (!finder_show(view)) {
+		report("Allocation failure");
+		return FALSE;
+	}
+
+	if (view_is_displayed(view)) {
+		redraw_view(view);
+		update_view_title(view);
+	}
+	return TRUE;
+}
+
+static enum input_status
+finder_prompt_handler(void *data, char *buf, int c)
+{
+	struct view *view = data;
+	size_t len = strlen(buf);
+
+	if (c == KEY_BACKSPACE) {
+		while (finder_levels > len)
+			finder_drop_level();
+
+	} else if (c > 0 && c < 256 && isprint(c)) {
+		/* Levels beyond the current input are left from editing. */
+		while (finder_levels > len)
+			finder_drop_level();
+		if (!finder_add_level(c)) {
+			report("Allocation failure");
+			return INPUT_SKIP;
+		}
+
+	} else {
+		return INPUT_SKIP;
+	}
+
+	return finder_update(view) ? INPUT_OK : INPUT_CANCEL;
+}
+
+static void
+finder_prompt(struct view *view)
+{
+	/* The prompt starts out empty, so does the query. */
+	while (finder_levels)
+		finder_drop_level();
+
+	if (finder_update(view))
+		prompt_input("Find file: ", finder_prompt_handler, view);
+}
+
+static bool
+finder_open(struct view *view, enum open_flags flags)
+{
+	static const char *finder_argv[] = {
+		"git", "ls-tree", "-r", "--name-only", "%(commit)", NULL
+	};
+
+	if (string_rev_is_null(ref_commit)) {
+		report("No tree exists for this commit");
+		return FALSE;
+	}
+
+	return begin_update(view, opt_cdup, finder_argv, flags);
+}
+
+static bool
+finder_read(struct view *view, char *line)
+{
+	struct finder_file *file;
+	const char *name;
+	bool matched;
+
+	if (!line)
+		return TRUE;
+
+	name = strrchr(line, '/');
+	name = name ? name + 1 : line;
+
+	file = finder_alloc(sizeof(*file) + strlen(name));
+	if (!file || !realloc_finder_files(&finder_files, finder_files_size, 1))
+		return FALSE;
+
+	strcpy(file->name, name);
+	file->dir = NULL;
+	if (name > line) {
+		file->dir = finder_get_dir(line, name - line);
+		if (!file->dir)
+			return FALSE;
+	}
+
+	finder_files[finder_files_size++] = file;
+
+	if (!finder_match_file(finder_files_size - 1, &matched))
+		return FALSE;
+	return !matched || add_line(view, file, LINE_DEFAULT, 0, FALSE);
+}
+
+static const char *
+finder_path(const struct finder_file *file)
+{
+	static char path[SIZEOF_STR];
+
+	if (!string_format(path, "%s%s", file->dir ? file->dir->path : "", file->name))
+		return file->name;
+	return path;
+}
+
+static bool
+finder_draw(struct view *view, struct line *line, unsigned int lineno)
+{
+	const struct finder_file *file = line->data;
+
+	if (draw_lineno(view, lineno))
+		return TRUE;
+
+	if (file->dir && draw_text(view, LINE_TREE_DIR, file->dir->path))
+		return TRUE;
+
+	draw_text(view, LINE_TREE_FILE, file->name);
+	return TRUE;
+}
+
+static bool
+finder_grep(struct view *view, struct line *line)
+{
+	const char *text[] = { finder_path(line->data), NULL };
+
+	return grep_text(view, text);
+}
+
+static enum request
+finder_request(struct view *view, enum request request, struct line *line)
+{
+	switch (request) {
+	case REQ_SEARCH:
+		finder_prompt(view);
+		return REQ_NONE;
+
+	case REQ_VIEW_BLAME:
+		string_copy(opt_ref, view->vid);
+		return request;
+
+	case REQ_ENTER:
+		ref_blob[0] = 0;
+		open_view(view, REQ_VIEW_BLOB, view_is_displayed(view) ? OPEN_SPLIT : OPEN_DEFAULT);
+		return REQ_NONE;
+
+	default:
+		return request;
+	}
+}
+
+static void
+finder_select(struct view *view, struct line *line)
+{
+	const char *path = finder_path(line->data);
+
+	string_ncopy(opt_file, path, strlen(path));
+	string_ncopy(view->ref, path, strlen(path));
+	ref_blob[0] = 0;
+}
+
+static struct view_ops finder_ops = {
+	"file",
+	{ "finder" },
+	VIEW_SEND_CHILD_ENTER,
+	0,
+	finder_open,
+	finder_read,
+	finder_draw,
+	finder_request,
+	finder_grep,
+	finder_select,
+	finder_done,
+};
+
+/*
+ * Blame backend
+ *
+ * Loading the blame view is a two phase job:
+ *
+ *  1. File content is read either using opt_file from the
+ *     filesystem or using git-cat-file.
+ *  2. Then blame information is incrementally added by
+ *     reading output from git-blame.
+ */
+
+struct blame_history_state {
+	char id[SIZEOF_REV];		/* SHA1 ID. */
+	const char *filename;		/* Name of file. */
+};
+
+static struct view_history blame_view_history = { sizeof(struct blame_history_state) };
+
+struct blame {
+	struct blame_commit *commit;
+	unsigned long lineno;
+	char text[1];
+};
+
+struct blame_state {
+	struct blame_commit *commit;
+	int blamed;
+	bool done_reading;
+	bool auto_filename_display;
+	/* The history state for the current view is cached in the view
+	 * state so it always matches what was used to load the current blame
+	 * view. */
+	struct blame_history_state history_state;
+};
+
+static bool
+blame_detect_filename_display(struct view *view)
+{
+	bool show_filenames = FALSE;
+	const char *filename = NULL;
+	int i;
+
+	if (opt_blame_argv) {
+		for (i = 0; opt_blame_argv[i]; i++) {
+			if (prefixcmp(opt_blame_argv[i], "-C"))
+				continue;
+
+			show_filenames = TRUE;
+		}
+	}
+
+	for (i = 0; i < view->lines; i++) {
+		struct blame *blame = view->line[i].data;
+
+		if (blame->commit && blame->commit->id[0]) {
+			if (!filename)
+				filename = blame->commit->filename;
+			else if (strcmp(filename, blame->commit->filename))
+				show_filenames = TRUE;
+		}
+	}
+
+	return show_filenames;
+}
+
+static bool
+blame_open(struct view *view, enum open_flags flags)
+{
+	struct blame_state *state = view->private;
+	const char *file_argv[] = { opt_cdup, opt_file , NULL };
+	char path[SIZEOF_STR];
+	size_t i;
+
+	if (!opt_file[0]) {
+		report("No file chosen, press %s to open tree view",
+			get_view_key(view, REQ_VIEW_TREE));
+		return FALSE;
+	}
+
+	if (!view->prev && *opt_prefix && !(flags & (OPEN_RELOAD | OPEN_REFRESH))) {
+		string_copy(path, opt_file);
+		if (!string_format(opt_file, "%s%s", opt_prefix, path)) {
+			report("Failed to setup the blame view");
+			return FALSE;
+		}
+	}
+
+	if (*opt_ref || !begin_update(view, opt_cdup, file_argv, flags)) {
+		const char *blame_cat_file_argv[] = {
+			"git", "cat-file", "blob", "%(ref):%(file)", NULL
+		};
+
+		if (!begin_update(view, opt_cdup, blame_cat_file_argv, flags))
+			return FALSE;
+	}
+
+	/* First pass: remove multiple references to the same commit. */
+	for (i = 0; i < view->lines; i++) {
+		struct blame *blame = view->line[i].data;
+
+		if (blame->commit && blame->commit->id[0])
+			blame->commit->id[0] = 0;
+		else
+			blame->commit = NULL;
+	}
+
+	/* Second pass: free existing references. */
+	for (i = 0; i < view->lines; i++) {
+		struct blame *blame = view->line[i].data;
+
+		if (blame->commit)
+			free(blame->commit);
+	}
+
+	if (!(flags & OPEN_RELOAD))
+		reset_view_history(&blame_view_history);
+	string_copy_rev(state->history_state.id, opt_ref);
+	state->history_state.filename = get_path(opt_file);
+	if (!state->history_state.filename)
+		return FALSE;
+	string_format(view->vid, "%s", opt_file);
+	string_format(view->ref, "%s ...", opt_file);
+
+	return TRUE;
+}
+
+static struct blame_commit *
+get_blame_commit(struct view *view, const char *id)
+{
+	size_t i;
+
+	for (i = 0; i < view->lines; i++) {
+		struct blame *blame = view->line[i].data;
+
+		if (!blame->commit)
+			continue;
+
+		if (!strncmp(blame->commit->id, id, SIZEOF_REV - 1))
+			return blame->commit;
+	}
+
+	{
+		struct blame_commit *commit = calloc(1, sizeof(*commit));
+
+		if (commit)
+			string_ncopy(commit->id, id, SIZEOF_REV);
+		return commit;
+	}
+}
+
+static struct blame_commit *
+read_blame_commit(struct view *view, const char *text, struct blame_state *state)
+{
+	struct blame_header header;
+	struct blame_commit *commit;
+	struct blame *blame;
+
+	if (!parse_blame_header(&header, text, view->lines))
+		return NULL;
+
+	commit = get_blame_commit(view, text);
+	if (!commit)
+		return NULL;
+
+	state->blamed += header.group;
+	while (header.group--) {
+		struct line *line = &view->line[header.lineno + header.group - 1];
+
+		blame = line->data;
+		blame->commit = commit;
+		blame->lineno = header.orig_lineno + header.group - 1;
+		line->dirty = 1;
+	}
+
+	return commit;
+}
+
+static bool
+blame_read_file(struct view *view, const char *text, struct blame_state *state)
+{
+	if (!text) {
+		const char *blame_argv[] = {
+			"git", "blame", encoding_arg, "%(blameargs)", "--incremental",
+				*opt_ref ? opt_ref : "--incremental", "--", opt_file, NULL
+		};
+
+		if (view->lines == 0 && !view->prev)
+			die("No blame exist for %s", view->vid);
+
+		if (view->lines == 0 || !begin_update(view, opt_cdup, blame_argv, OPEN_EXTRA)) {
+			report("Failed to load blame data");
+			return TRUE;
+		}
+
+		if (opt_goto_line > 0) {
+			select_view_line(view, opt_goto_line);
+			opt_goto_line = 0;
+		}
+
+		state->done_reading = TRUE;
+		return FALSE;
+
+	} else {
+		size_t textlen = strlen(text);
+		struct blame *blame;
+
+		if (!add_line_alloc(view, &blame, LINE_ID, textlen, FALSE))
+			return FALSE;
+
+		blame->commit = NULL;
+		strncpy(blame->text, text, textlen);
+		blame->text[textlen] = 0;
+		return TRUE;
+	}
+}
+
+static bool
+blame_read(struct view *view, char *line)
+{
+	struct blame_state *state = view->private;
+
+	if (!state->done_reading)
+		return blame_read_file(view, line, state);
+
+	if (!line) {
+		state->auto_filename_display = blame_detect_filename_display(view);
+		string_format(view->ref, "%s", view->vid);
+		if (view_is_displayed(view)) {
+			update_view_title(view);
+			redraw_view_from(view, 0);
+		}
+		return TRUE;
+	}
+
+	if (!state->commit) {
+		state->commit = read_blame_commit(view, line, state);
+		string_format(view->ref, "%s %2zd%%", view->vid,
+			      view->lines ? state->blamed * 100 / view->lines : 0);
+
+	} else if (parse_blame_info(state->commit, line)) {
+		if (!state->commit->filename)
+			return FALSE;
+		state->commit = NULL;
+	}
+
+	return TRUE;
+}
+
+static bool
+blame_draw(struct view *view, struct line *line, unsigned int lineno)
+{
+	struct blame_state *state = view->private;
+	struct blame *blame = line->data;
+	struct time *time = NULL;
+	const char *id = NULL, *filename = NULL;
+	const struct ident *author = NULL;
+	enum line_type id_type = LINE_ID;
+	static const enum line_type blame_colors[] = {
+		LINE_PALETTE_0,
+		LINE_PALETTE_1,
+		LINE_PALETTE_2,
+		LINE_PALETTE_3,
+		LINE_PALETTE_4,
+		LINE_PALETTE_5,
+		LINE_PALETTE_6,
+	};
+
+#define BLAME_COLOR(i) \
+	(blame_colors[(i) % ARRAY_SIZE(blame_colors)])
+
+	if (blame->commit && blame->commit->filename) {
+		id = blame->commit->id;
+		author = blame->commit->author;
+		filename = blame->commit->filename;
+		time = &blame->commit->time;
+		id_type = BLAME_COLOR((long) blame->commit);
+	}
+
+	if (draw_date(view, time))
+		return TRUE;
+
+	if (draw_author(view, author))
+		return TRUE;
+
+	if (draw_filename(view, filename, state->auto_filename_display))
+		return TRUE;
+
+	if (draw_id_custom(view, id_type, id, opt_id_cols))
+		return TRUE;
+
+	if (draw_lineno(view, lineno))
+		return TRUE;
+
+	draw_text(view, LINE_DEFAULT, blame->text);
+	return TRUE;
+}
+
+static bool
+check_blame_commit(struct blame *blame, bool check_null_id)
+{
+	if (!blame->commit)
+		report("Commit data not loaded yet");
+	else if (check_null_id && string_rev_is_null(blame->commit->id))
+		report("No commit exist for the selected line");
+	else
+		return TRUE;
+	return FALSE;
+}
+
+static void
+setup_blame_parent_line(struct view *view, struct blame *blame)
+{
+	char from[SIZEOF_REF + SIZEOF_STR];
+	char to[SIZEOF_REF + SIZEOF_STR];
+	const char *diff_tree_argv[] = {
+		"git", "diff", encoding_arg, "--no-textconv", "--no-extdiff",
+			"--no-color", "-U0", from, to, "--", NULL
+	};
+	struct io io;
+	int parent_lineno = -1;
+	int blamed_lineno = -1;
+	char *line;
+
+	if (!string_format(from, "%s:%s", opt_ref, opt_file) ||
+	    !string_format(to, "%s:%s", blame->commit->id, blame->commit->filename) ||
+	    !io_run(&io, IO_RD, NULL, opt_env, diff_tree_argv))
+		return;
+
+	while ((line = io_get(&io, '\n', TRUE))) {
+		if (*line == '@') {
+			char *pos = strchr(line, '+');
+
+			parent_lineno = atoi(line + 4);
+			if (pos)
+				blamed_lineno = atoi(pos + 1);
+
+		} else if (*line == '+' && parent_lineno != -1) {
+			if (blame->lineno == blamed_lineno - 1 &&
+			    !strcmp(blame->text, line + 1)) {
+				view->pos.lineno = parent_lineno ? parent_lineno - 1 : 0;
+				break;
+			}
+			blamed_lineno++;
+		}
+	}
+
+	io_done(&io);
+}
+
+static void
+blame_go_forward(struct view *view, struct blame *blame, bool parent)
+{
+	struct blame_state *state = view->private;
+	struct blame_history_state *history_state = &state->history_state;
+	struct blame_commit *commit = blame->commit;
+	const char *id = parent ? commit->parent_id : commit->id;
+	const char *filename = parent ? commit->parent_filename : commit->filename;
+
+	if (!*id && parent) {
+		report("The selected commit has no parents");
+		return;
+	}
+
+	if (!strcmp(history_state->id, id) && !strcmp(history_state->filename, filename)) {
+		report("The selected commit is already displayed");
+		return;
+	}
+
+	if (!push_view_history_state(&blame_view_history, &view->pos, history_state)) {
+		report("Failed to save current view state");
+		return;
+	}
+
+	string_ncopy(opt_ref, id, sizeof(commit->id));
+	string_ncopy(opt_file, filename, strlen(filename));
+	if (parent)
+		setup_blame_parent_line(view, blame);
+	opt_goto_line = blame->lineno;
+	reload_view(view);
+}
+
+static void
+blame_go_back(struct view *view)
+{
+	struct blame_history_state history_state;
+
+	if (!pop_view_history_state(&blame_view_history, &view->pos, &history_state)) {
+		report("Already at start of history");
+		return;
+	}
+
+	string_copy(opt_ref, history_state.id);
+	string_ncopy(opt_file, history_state.filename, strlen(history_state.filename));
+	opt_goto_line = view->pos.lineno;
+	reload_view(view);
+}
+
+static enum request
+blame_request(struct view *view, enum request request, struct line *line)
+{
+	enum open_flags flags = view_is_displayed(view) ? OPEN_SPLIT : OPEN_DEFAULT;
+	struct blame *blame = line->data;
+
+	switch (request) {
+	case REQ_VIEW_BLAME:
+	case REQ_PARENT:
+		if (!check_blame_commit(blame, TRUE))
+			break;
+		blame_go_forward(view, blame, request == REQ_PARENT);
+		break;
+
+	case REQ_BACK:
+		blame_go_back(view);
+		break;
+
+	case REQ_ENTER:
+		if (!check_blame_commit(blame, FALSE))
+			break;
+
+		if (view_is_displayed(VIEW(REQ_VIEW_DIFF)) &&
+		    !strcmp(blame->commit->id, VIEW(REQ_VIEW_DIFF)->ref))
+			break;
+
+		if (string_rev_is_null(blame->commit->id)) {
+			struct view *diff = VIEW(REQ_VIEW_DIFF);
+			const char *diff_parent_argv[] = {
+				GIT_DIFF_BLAME(encoding_arg,
+					opt_diff_context_arg,
+					opt_ignore_space_arg, view->vid)
+			};
+			const char *diff_no_parent_argv[] = {
+				GIT_DIFF_BLAME_NO_PARENT(encoding_arg,
+					opt_diff_context_arg,
+					opt_ignore_space_arg, view->vid)
+			};
+			const char **diff_index_argv = *blame->commit->parent_id
+				? diff_parent_argv : diff_no_parent_argv;
+
+			open_argv(view, diff, diff_index_argv, NULL, flags);
+			if (diff->pipe)
+				string_copy_rev(diff->ref, NULL_ID);
+		} else {
+			open_view(view, REQ_VIEW_DIFF, flags);
+		}
+		break;
+
+	default:
+		return request;
+	}
+
+	return REQ_NONE;
+}
+
+static bool
+blame_grep(struct view *view, struct line *line)
+{
+	struct blame *blame = line->data;
+	struct blame_commit *commit = blame->commit;
+	const char *text[] = {
+		blame->text,
+		commit ? commit->title : "",
+		commit ? commit->id : "",
+		commit ? mkauthor(commit->author, opt_author_width, opt_author) : "",
+		commit ? mkdate(&commit->time, opt_date) : "",
+		NULL
+	};
+
+	return grep_text(view, text);
+}
+
+static void
+blame_select(struct view *view, struct line *line)
+{
+	struct blame *blame = line->data;
+	struct blame_commit *commit = blame->commit;
+
+	if (!commit)
+		return;
+
+	if (string_rev_is_null(commit->id))
+		string_ncopy(ref_commit, "HEAD", 4);
+	else
+		string_copy_rev(ref_commit, commit->id);
+}
+
+static struct view_ops blame_ops = {
+	"line",
+	{ "blame" },
+	VIEW_ALWAYS_LINENO | VIEW_SEND_CHILD_ENTER,
+	sizeof(struct blame_state),
+	blame_open,
+	blame_read,
+	blame_draw,
+	blame_request,
+	blame_grep,
+	blame_select,
+};
+
+/*
+ * Branch backend
+ */
+
+struct branch {
+	const struct ident *author;	/* Author of the last commit. */
+	struct time time;		/* Date of the last activity. */
+	char title[128];		/* First line of the commit message. */
+	const struct ref *ref;		/* Name and commit ID information. */
+	const struct ref *upstream;	/* Upstream branch, if any. */
+};
+
+static const struct ref branch_all;
+#define BRANCH_ALL_NAME	"All branches"
+#define branch_is_all(branch) ((branch)->ref == &branch_all)
+
+static const enum sort_field branch_sort_fields[] = {
+	ORDERBY_NAME, ORDERBY_DATE, ORDERBY_AUTHOR
+};
+static struct sort_state branch_sort_state = SORT_STATE(branch_sort_fields);
+
+struct branch_state {
+	char id[SIZEOF_REV];
+	size_t max_ref_length;
+	size_t *index;		/* Hash of commit IDs to line number + 1. */
+	size_t *names;		/* Hash of ref names to line number + 1. */
+	size_t index_size;	/* Number of hash slots; a power of two. */
+	bool read_missing;	/* Loading commits not listed by for-each-ref. */
+};
+
+#define BRANCH_FORMAT "commit %H%nauthor %an <%ae> %ad%ntitle %s"
+
+static void
+branch_index_free(struct branch_state *state)
+{
+	free(state->index);
+	free(state->names);
+	state->index = NULL;
+	state->names = NULL;
+	state->index_size = 0;
+}
+
+/* Index lines by the commit ID and the name of their branch. Branches
+ * pointing to the same commit get separate slots in the same probe
+ * sequence. */
+static bool
+branch_index_lines(struct view *view, struct branch_state *state)
+{
+	size_t size = 16;
+	size_t i;
+
+	branch_index_free(state);
+
+	while (size < view->lines * 2)
+		size *= 2;
+
+	state->index = calloc(size, sizeof(*state->index));
+	state->names = calloc(size, sizeof(*state->names));
+	if (!state->index || !state->names) {
+		branch_index_free(state);
+		return FALSE;
+	}
+	state->index_size = size;
+
+	for (i = 0; i < view->lines; i++) {
+		struct branch *branch = view->line[i].data;
+		size_t slot;
+
+		if (branch_is_all(branch))
+			continue;
+
+		slot = string_hash(branch->ref->id) & (size - 1);
+		while (state->index[slot])
+			slot = (slot + 1) & (size - 1);
+		state->index[slot] = i + 1;
+
+		slot = string_hash(branch->ref->name) & (size - 1);
+		while (state->names[slot])
+			slot = (slot + 1) & (size - 1);
+		state->names[slot] = i + 1;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Ahead/behind counts of branches compared to their upstream, or to HEAD
+ * when they have none. They are computed one at a time by a background
+ * job, starting with the branches on screen, and cached by the pair of
+ * commit IDs.
+ */
+
+struct branch_count {
+	char tip[SIZEOF_REV];
+	char base[SIZEOF_REV];
+	int ahead;			/* Negative if counting failed. */
+	int behind;
+};
+
+static struct branch_count *branch_counts;
+static size_t branch_counts_size;
+static int branch_count_width;
+
+DEFINE_ALLOCATOR(realloc_branch_counts, struct branch_count, 256)
+
+static struct {
+	struct io io;
+	bool running;
+	char tip[SIZEOF_REV];
+	char base[SIZEOF_REV];
+	size_t next;			/* Next line to check after the visible ones. */
+} branch_count_job;
+
+static const char *
+branch_count_base(const struct branch *branch)
+{
+	const struct ref *head = get_ref_head();
+
+	if (branch_is_all(branch))
+		return NULL;
+	if (branch->upstream)
+		return branch->upstream->id;
+	return head ? head->id : NULL;
+}
+
+static int
+branch_count_compare(const struct branch_count *count, const char *tip, const char *base)
+{
+	int cmp = strcmp(count->tip, tip);
+
+	return cmp ? cmp : strcmp(count->base, base);
+}
+
+/* Returns the position of the count or where to insert it. */
+static size_t
+branch_count_find(const char *tip, const char *base, bool *found)
+{
+	size_t from = 0, to = branch_counts_size;
+
+	*found = FALSE;
+
+	while (from < to) {
+		size_t pos = (from + to) / 2;
+		int cmp = branch_count_compare(&branch_counts[pos], tip, base);
+
+		if (!cmp) {
+			*found = TRUE;
+			return pos;
+		}
+		if (cmp > 0)
+			to = pos;
+		else
+			from = pos + 1;
+	}
+
+	return from;
+}
+
+static const struct branch_count *
+branch_count_get(const struct branch *branch)
+{
+	const char *base = branch_count_base(branch);
+	bool found;
+	size_t pos;
+
+	if (!base)
+		return NULL;
+	pos = branch_count_find(branch->ref->id, base, &found);
+	return found ? &branch_counts[pos] : NULL;
+}
+
+static const char *
+branch_count_text(const struct branch_count *count)
+{
+	static char text[32];
+
+	if (!count || count->ahead < 0 || (!count->ahead && !count->behind))
+		return NULL;
+	if (!count->behind)
+		string_format(text, "+%d", count->ahead);
+	else if (!count->ahead)
+		string_format(text, "-%d", count->behind);
+	else
+		string_format(text, "+%d -%d", count->ahead, count->behind);
+	return text;
+}
+
+static void
+branch_count_add(const char *tip, const char *base, int ahead, int behind)
+{
+	struct branch_count *count;
+	const char *text;
+	bool found;
+	size_t pos = branch_count_find(tip, base, &found);
+
+	if (!found) {
+		if (!realloc_branch_counts(&branch_counts, branch_counts_size, 1))
+			return;
+		memmove(branch_counts + pos + 1, branch_counts + pos,
+			(branch_counts_size - pos) * sizeof(*branch_counts));
+		branch_counts_size++;
+	}
+
+	count = &branch_counts[pos];
+	string_copy_rev(count->tip, tip);
+	string_copy_rev(count->base, base);
+	count->ahead = ahead;
+	count->behind = behind;
+
+	text = branch_count_text(count);
+	if (text && strlen(text) > branch_count_width)
+		branch_count_width = strlen(text);
+}
+
+static bool
+branch_count_read(void)
+{
+	char *line = io_get(&branch_count_job.io, '\n', TRUE);
+	char *behind = line ? strchr(line, '\t') : NULL;
+	bool ok = behind && isdigit(*line) && isdigit(behind[1]);
+
+	if (!io_done(&branch_count_job.io))
+		ok = FALSE;
+	branch_count_job.running = FALSE;
+
+	branch_count_add(branch_count_job.tip, branch_count_job.base,
+			 ok ? atoi(line) : -1, ok ? atoi(behind + 1) : -1);
+	return ok;
+}
+
+/* Start counting the first branch without a count, if any. */
+static bool
+branch_count_start(struct view *view, size_t from, size_t to)
+{
+	char range[SIZEOF_STR];
+	const char *count_argv[] = {
+		"git", "rev-list", "--left-right", "--count", range, NULL
+	};
+	size_t i;
+
+	for (i = from; i < to && i < view->lines; i++) {
+		struct branch *branch = view->line[i].data;
+		const char *base = branch_count_base(branch);
+
+		if (!base || branch_count_get(branch))
+			continue;
+
+		if (!strcmp(branch->ref->id, base)) {
+			branch_count_add(branch->ref->id, base, 0, 0);
+			continue;
+		}
+
+		if (!string_format(range, "%s...%s", branch->ref->id, base) ||
+		    !io_run(&branch_count_job.io, IO_RD, NULL, opt_env, count_argv)) {
+			branch_count_add(branch->ref->id, base, -1, -1);
+			continue;
+		}
+
+		string_copy_rev(branch_count_job.tip, branch->ref->id);
+		string_copy_rev(branch_count_job.base, base);
+		branch_count_job.running = TRUE;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Run one rev-list at a time while the branch view is shown and done
+ * loading, the visible branches first. */
+static bool
+branch_count_poll(void *data)
+{
+	struct view *view = data;
+	size_t visible = view->pos.offset + view->height;
+
+	if (branch_count_job.running) {
+		if (!io_can_read(&branch_count_job.io, FALSE))
+			return TRUE;
+		branch_count_read();
+		if (view_is_displayed(view)) {
+			redraw_view(view);
+			update_view_title(view);
+		}
+	}
+
+	if (!view_is_displayed(view))
+		return FALSE;
+	if (view->pipe)
+		return TRUE;
+
+	if (branch_count_start(view, view->pos.offset, visible))
+		return TRUE;
+
+	while (branch_count_job.next < view->lines) {
+		if (branch_count_start(view, branch_count_job.next, branch_count_job.next + 1))
+			return TRUE;
+		branch_count_job.next++;
+	}
+
+	return FALSE;
+}
+
+static int
+branch_compare(const void *l1, const void *l2)
+{
+	const struct branch *branch1 = ((const struct line *) l1)->data;
+	const struct branch *branch2 = ((const struct line *) l2)->data;
+
+	if (branch_is_all(branch1))
+		return -1;
+	else if (branch_is_all(branch2))
+		return 1;
+
+	switch (get_sort_field(branch_sort_state)) {
+	case ORDERBY_DATE:
+		return sort_order(branch_sort_state, timecmp(&branch1->time, &branch2->time));
+
+	case ORDERBY_AUTHOR:
+		return sort_order(branch_sort_state, ident_compare(branch1->author, branch2->author));
+
+	case ORDERBY_NAME:
+	default:
+		return sort_order(branch_sort_state, strcmp(branch1->ref->name, branch2->ref->name));
+	}
+}
+
+static bool
+branch_draw(struct view *view, struct line *line, unsigned int lineno)
+{
+	struct branch_state *state = view->private;
+	struct branch *branch = line->data;
+	enum line_type type = branch_is_all(branch) ? LINE_DEFAULT : get_line_type_from_ref(branch->ref);
+	const char *branch_name = branch_is_all(branch) ? BRANCH_ALL_NAME : branch->ref->name;
+
+	if (draw_lineno(view, lineno))
+		return TRUE;
+
+	if (draw_date(view, &branch->time))
+		return TRUE;
+
+	if (draw_author(view, branch->author))
+		return TRUE;
+
+	if (draw_field(view, type, branch_name, state->max_ref_length, ALIGN_LEFT, FALSE))
+		return TRUE;
+
+	if (branch_count_width &&
+	    draw_field(view, LINE_DEFAULT, branch_count_text(branch_count_get(branch)),
+		       branch_count_width, ALIGN_RIGHT, FALSE))
+		return TRUE;
+
+	if (draw_id(view, branch->ref->id))
+		return TRUE;
+
+	draw_text(view, LINE_DEFAULT, branch->title);
+	return TRUE;
+}
+
+static enum request
+branch_request(struct view *view, enum request request, struct line *line)
+{
+	struct branch_state *state = view->private;
+	struct branch *branch = line->data;
+
+	switch (request) {
+	case REQ_REFRESH:
+		load_refs(TRUE);
+		refresh_view(view);
+		return REQ_NONE;
+
+	case REQ_TOGGLE_SORT_FIELD:
+	case REQ_TOGGLE_SORT_ORDER:
+		sort_view(view, request, &branch_sort_state, branch_compare);
+		/* Sorting moves the lines the index refers to. */
+		if (state->index && !branch_index_lines(view, state))
+			end_update(view, TRUE);
+		return REQ_NONE;
+
+	case REQ_ENTER:
+	{
+		const struct ref *ref = branch->ref;
+		const char *all_branches_argv[] = {
+			GIT_MAIN_LOG(encoding_arg, "", branch_is_all(branch) ? "--all" : ref->name, "")
+		};
+		struct view *main_view = VIEW(REQ_VIEW_MAIN);
+
+		open_argv(view, main_view, all_branches_argv, NULL, OPEN_SPLIT);
+		return REQ_NONE;
+	}
+	case REQ_JUMP_COMMIT:
+	{
+		int lineno;
+
+		for (lineno = 0; lineno < view->lines; lineno++) {
+			struct branch *branch = view->line[lineno].data;
+
+			if (!strncasecmp(branch->ref->id, opt_search, strlen(opt_search))) {
+				select_view_line(view, lineno);
+				report_clear();
+				return REQ_NONE;
+			}
+		}
+	}
+	default:
+		return request;
+	}
+}
+
+/* Load commits of refs for-each-ref does not list, such as a detached
+ * HEAD, with a log that does not walk the history. The commit IDs are
+ * given on stdin since there can be too many for the command line. */
+static bool
+branch_read_missing(struct view *view, struct branch_state *state)
+{
+	const char *log_argv[] = {
+		"git", "log", encoding_arg, "--no-color", "--date=raw",
+			"--pretty=format:" BRANCH_FORMAT, "--no-walk", "--stdin", NULL
+	};
+	const char **argv = NULL;
+	FILE *ids = tmpfile();
+	bool missing = FALSE;
+	bool ok;
+	size_t i;
+
+	state->read_missing = TRUE;
+
+	ok = ids && argv_copy(&argv, log_argv);
+	for (i = 0; ok && i < view->lines; i++) {
+		struct branch *branch = view->line[i].data;
+
+		if (branch_is_all(branch) || branch->author)
+			continue;
+		ok = fprintf(ids, "%s\n", branch->ref->id) > 0;
+		missing = TRUE;
+	}
+
+	ok = ok && missing && !fflush(ids) && !fseek(ids, 0, SEEK_SET);
+	if (ok) {
+		io_done(view->pipe);
+		ok = io_run(&view->io, IO_RD_FD, NULL, opt_env, argv, fileno(ids));
+	}
+
+	if (ids)
+		fclose(ids);
+	argv_free(argv);
+	free(argv);
+	return ok;
+}
+
+static const struct ref *
+branch_find_ref(struct view *view, struct branch_state *state, const char *refname)
+{
+	bool remote = !prefixcmp(refname, "refs/remotes/");
+	size_t slot;
+
+	if (remote)
+		refname += STRING_SIZE("refs/remotes/");
+	else if (!prefixcmp(refname, "refs/heads/"))
+		refname += STRING_SIZE("refs/heads/");
+	else
+		return NULL;
+
+	slot = string_hash(refname) & (state->index_size - 1);
+	for (; state->names[slot]; slot = (slot + 1) & (state->index_size - 1)) {
+		struct branch *branch = view->line[state->names[slot] - 1].data;
+
+		if (branch->ref->remote == remote && !strcmp(branch->ref->name, refname))
+			return branch->ref;
+	}
+
+	return NULL;
+}
+
+/* Parse "<refname> <upstream>" for the branch of the current commit. */
+static void
+branch_read_upstream(struct view *view, struct branch_state *state, char *line)
+{
+	char *upstream = strchr(line, ' ');
+	const struct ref *ref;
+	size_t slot;
+
+	if (!upstream || !upstream[1] || prefixcmp(line, "refs/heads/"))
+		return;
+	*upstream++ = 0;
+
+	ref = branch_find_ref(view, state, upstream);
+	if (!ref)
+		return;
+
+	slot = string_hash(state->id) & (state->index_size - 1);
+	for (; state->index[slot]; slot = (slot + 1) & (state->index_size - 1)) {
+		struct branch *branch = view->line[state->index[slot] - 1].data;
+
+		if (!strcmp(branch->ref->id, state->id) && !branch->ref->remote &&
+		    !strcmp(branch->ref->name, line + STRING_SIZE("refs/heads/")))
+			branch->upstream = ref;
+	}
+}
+
+static bool
+branch_read(struct view *view, char *line)
+{
+	struct branch_state *state = view->private;
+	const char *title = NULL;
+	const struct ident *author = NULL;
+	struct time time = {};
+	size_t slot;
+
+	if (!line) {
+		if (!state->read_missing && state->index &&
+		    branch_read_missing(view, state))
+			return FALSE;
+		branch_index_free(state);
+
+		/* Count the commits ahead and behind once all is loaded. */
+		branch_count_job.next = 0;
+		background_add(branch_count_poll, view);
+		return TRUE;
+	}
+
+	if (!state->index)
+		return TRUE;
+
+	if (!prefixcmp(line, "upstream ")) {
+		branch_read_upstream(view, state, line + STRING_SIZE("upstream "));
+		return TRUE;
+	}
+
+	switch (get_line_type(line)) {
+	case LINE_COMMIT:
+		string_copy_rev_from_commit_line(state->id, line);
+		return TRUE;
+
+	case LINE_AUTHOR:
+		parse_author_line(line + STRING_SIZE("author "), &author, &time);
+		break;
+
+	default:
+		title = line + STRING_SIZE("title ");
+	}
+
+	slot = string_hash(state->id) & (state->index_size - 1);
+	for (; state->index[slot]; slot = (slot + 1) & (state->index_size - 1)) {
+		struct line *branch_line = &view->line[state->index[slot] - 1];
+		struct branch *branch = branch_line->data;
+
+		if (strcmp(branch->ref->id, state->id))
+			continue;
+
+		if (author) {
+			branch->author = author;
+			branch->time = time;
+		}
+
+		if (title)
+			string_expand(branch->title, sizeof(branch->title), title, 1);
+
+		branch_line->dirty = TRUE;
+	}
+
+	return TRUE;
+}
+
+static bool
+branch_open_visitor(void *data, const struct ref *ref)
+{
+	struct view *view = data;
+	struct branch_state *state = view->private;
+	struct branch *branch;
+	bool is_all = ref == &branch_all;
+	size_t ref_length;
+
+	if (ref->tag || ref->ltag)
+		return TRUE;
+
+	if (!add_line_alloc(view, &branch, LINE_DEFAULT, 0, is_all))
+		return FALSE;
+
+	ref_length = is_all ? STRING_SIZE(BRANCH_ALL_NAME) : strlen(ref->name);
+	if (ref_length > state->max_ref_length)
+		state->max_ref_length = ref_length;
+
+	branch->ref = ref;
+	return TRUE;
+}
+
+static bool
+branch_open(struct view *view, enum open_flags flags)
+{
+	/* Only the commits the refs point to are read instead of walking
+	 * the history to find them. Annotated tags are peeled to match the
+	 * commit IDs of the refs. */
+	const char *branch_refs[] = {
+		"git", "for-each-ref",
+			"--format=%(if)%(*objectname)%(then)"
+				"commit %(*objectname)%0aauthor %(*authorname) %(*authoremail) %(*authordate:raw)%0atitle %(*subject)"
+			"%(else)"
+				"commit %(objectname)%0aauthor %(authorname) %(authoremail) %(authordate:raw)%0atitle %(subject)"
+			"%(end)%0aupstream %(refname) %(upstream)",
+			NULL
+	};
+
+	/* Prepare the arguments directly since the format uses the same
+	 * %(...) syntax as the replacement variables. */
+	view->dir = NULL;
+	if (!argv_copy(&view->argv, branch_refs) ||
+	    !begin_update(view, NULL, NULL, OPEN_PREPARED)) {
+		report("Failed to load branch data");
+		return FALSE;
+	}
+
+	branch_open_visitor(view, &branch_all);
+	foreach_ref(branch_open_visitor, view);
+
+	if (!branch_index_lines(view, view->private)) {
+		end_update(view, TRUE);
+		report("Failed to load branch data");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static bool
+branch_grep(struct view *view, struct line *line)
+{
+	struct branch *branch = line->data;
+	const char *text[] = {
+		branch->ref->name,
+		mkauthor(branch->author, opt_author_width, opt_author),
+		NULL
 	};
 
-	return grep_text(view, text);
+	return grep_text(view, text);
+}
+
+static void
+branch_select(struct view *view, struct line *line)
+{
+	struct branch *branch = line->data;
+
+	if (branch_is_all(branch)) {
+		string_copy(view->ref, BRANCH_ALL_NAME);
+		return;
+	}
+	string_copy_rev(view->ref, branch->ref->id);
+	string_copy_rev(ref_commit, branch->ref->id);
+	string_copy_rev(ref_head, branch->ref->id);
+	string_copy_rev(ref_branch, branch->ref->name);
+}
+
+static struct view_ops branch_ops = {
+	"branch",
+	{ "branch" },
+	VIEW_NO_FLAGS,
+	sizeof(struct branch_state),
+	branch_open,
+	branch_read,
+	branch_draw,
+	branch_request,
+	branch_grep,
+	branch_select,
+};
+
+/*
+ * Status backend
+ */
+
+struct status {
+	char status;
+	struct {
+		mode_t mode;
+		char rev[SIZEOF_REV];
+		const char *name;	/* Interned by status_get_name(). */
+	} old;
+	struct {
+		mode_t mode;
+		char rev[SIZEOF_REV];
+		const char *name;
+	} new;
+	int added, deleted;	/* Line counts, or -1 while not known. */
+};
+
+static char status_onbranch[SIZEOF_STR];
+static struct status stage_status = { 0, { 0, "", "" }, { 0, "", "" }, -1, -1 };
+static enum line_type stage_line_type;
+
+/* The files of each section are stored apart from the view lines, which
+ * point into them. Large sections are grouped into directories that are
+ * listed collapsed, so only the lines of expanded directories exist. */
+
+#define STATUS_GROUP_FILES	1000	/* Group sections with more files. */
+#define STATUS_NAMES_ARENA_SIZE	(256 * 1024)
+
+struct status_section {
+	struct status *files;
+	size_t size;
+	bool grouped;
+	const char **expanded;		/* Interned names of expanded directories. */
+	size_t expanded_size;
+};
+
+struct status_dir {
+	const char *name;		/* Interned path with trailing slash. */
+	size_t from, to;		/* The files in the directory. */
+	unsigned int depth;
+	char status;			/* Shared status of the files or '*'. */
+};
+
+struct status_name {
+	struct status_name *next;	/* Next name in the hash chain. */
+	char name[1];
+};
+
+static struct status_section status_sections[3];
+static struct status_dir **status_dirs;
+static size_t status_dirs_size;
+
+#define STATUS_DIR_LINE		1
+#define status_line_is_dir(line)	((line)->data && ((line)->user_flags & STATUS_DIR_LINE))
+#define status_line_file(line)		(status_line_is_dir(line) ? NULL : (struct status *) (line)->data)
+
+DEFINE_ALLOCATOR(realloc_status_files, struct status, 4096)
+DEFINE_ALLOCATOR(realloc_status_dirs, struct status_dir *, 256)
+DEFINE_ALLOCATOR(realloc_status_expanded, const char *, 16)
+
+/* File names are never freed, since the stage view keeps a copy of the
+ * selected file. The staged and unstaged entries of a file share them. */
+static const char *
+status_get_name(const char *name)
+{
+	static struct status_name **names;
+	static size_t names_size, names_slots;
+	static char *arena;
+	static size_t arena_left;
+	size_t len = strlen(name);
+	size_t slot, size;
+	struct status_name *entry;
+
+	if (!*name)
+		return "";
+
+	if (names_size >= names_slots) {
+		size_t slots = names_slots ? names_slots * 2 : 4096;
+		struct status_name **table = calloc(slots, sizeof(*table));
+		size_t i;
+
+		if (!table)
+			return NULL;
+
+		for (i = 0; i < names_slots; i++) {
+			while (names[i]) {
+				struct status_name *next = names[i]->next;
+
+				slot = string_hash(names[i]->name) & (slots - 1);
+				names[i]->next = table[slot];
+				table[slot] = names[i];
+				names[i] = next;
+			}
+		}
+
+		free(names);
+		names = table;
+		names_slots = slots;
+	}
+
+	slot = string_hash(name) & (names_slots - 1);
+	for (entry = names[slot]; entry; entry = entry->next)
+		if (!strcmp(entry->name, name))
+			return entry->name;
+
+	size = (sizeof(*entry) + len + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	if (size > arena_left) {
+		size_t arena_size = MAX(size, STATUS_NAMES_ARENA_SIZE);
+
+		arena = malloc(arena_size);
+		if (!arena)
+			return NULL;
+		arena_left = arena_size;
+	}
+
+	entry = (struct status_name *) arena;
+	arena += size;
+	arena_left -= size;
+
+	memcpy(entry->name, name, len + 1);
+	entry->next = names[slot];
+	names[slot] = entry;
+	names_size++;
+	return entry->name;
+}
+
+static struct status_section *
+status_get_section(enum line_type type)
+{
+	switch (type) {
+	case LINE_STAT_STAGED:		return &status_sections[0];
+	case LINE_STAT_UNSTAGED:	return &status_sections[1];
+	case LINE_STAT_UNTRACKED:	return &status_sections[2];
+	default:			return NULL;
+	}
+}
+
+static struct status *
+status_section_add(struct status_section *section)
+{
+	struct status *file;
+
+	if (!realloc_status_files(&section->files, section->size, 1))
+		return NULL;
+
+	file = &section->files[section->size++];
+	memset(file, 0, sizeof(*file));
+	file->old.name = file->new.name = "";
+	file->added = file->deleted = -1;
+	return file;
+}
+
+static void
+status_section_free(struct status_section *section)
+{
+	free(section->files);
+	section->files = NULL;
+	section->size = 0;
+}
+
+static int
+status_compare(const void *a, const void *b)
+{
+	const struct status *file1 = a;
+	const struct status *file2 = b;
+
+	return strcmp(file1->new.name, file2->new.name);
+}
+
+/* Replace the files of a section with newly loaded ones. */
+static void
+status_section_set(struct status_section *section, struct status_section *loaded)
+{
+	status_section_free(section);
+	section->files = loaded->files;
+	section->size = loaded->size;
+	section->grouped = section->size > STATUS_GROUP_FILES;
+	loaded->files = NULL;
+	loaded->size = 0;
+
+	/* Sorted so files can be looked up and directories are
+	 * contiguous ranges. */
+	qsort(section->files, section->size, sizeof(*section->files), status_compare);
+}
+
+static struct status *
+status_section_find(struct status_section *section, const char *name)
+{
+	size_t from = 0, to = section->size;
+
+	while (from < to) {
+		size_t pos = from + (to - from) / 2;
+		int cmp = strcmp(name, section->files[pos].new.name);
+
+		if (!cmp)
+			return &section->files[pos];
+		if (cmp < 0)
+			to = pos;
+		else
+			from = pos + 1;
+	}
+
+	return NULL;
+}
+
+/* This should work even for the "On branch" line. */
+static inline bool
+status_has_none(struct view *view, struct line *line)
+{
+	return view_has_line(view, line) && !line[1].data;
+}
+
+/* Get fields from the diff line:
+ * :100644 100644 06a5d6ae9eca55be2e0e585a152e6b1336f2b20e 0000000000000000000000000000000000000000 M
+ */
+static inline bool
+status_get_diff(struct status *file, const char *buf, size_t bufsize)
+{
+	const char *old_mode = buf +  1;
+	const char *new_mode = buf +  8;
+	const char *old_rev  = buf + 15;
+	const char *new_rev  = buf + 56;
+	const char *status   = buf + 97;
+
+	if (bufsize < 98 ||
+	    old_mode[-1] != ':' ||
+	    new_mode[-1] != ' ' ||
+	    old_rev[-1]  != ' ' ||
+	    new_rev[-1]  != ' ' ||
+	    status[-1]   != ' ')
+		return FALSE;
+
+	file->status = *status;
+
+	string_copy_rev(file->old.rev, old_rev);
+	string_copy_rev(file->new.rev, new_rev);
+
+	file->old.mode = strtoul(old_mode, NULL, 8);
+	file->new.mode = strtoul(new_mode, NULL, 8);
+
+	file->old.name = file->new.name = "";
+
+	return TRUE;
+}
+
+/* Parse the output of an already started command into a section. */
+static bool
+status_read_section(struct status_section *section, struct io *io, char status)
+{
+	bool has_unmerged = FALSE;
+	size_t unmerged = 0;
+	char *buf;
+
+	while ((buf = io_get(io, 0, TRUE))) {
+		struct status *file;
+
+		if (has_unmerged) {
+			file = &section->files[unmerged];
+		} else if (!(file = status_section_add(section))) {
+			return FALSE;
+		}
+
+		/* Parse diff info part. */
+		if (status) {
+			file->status = status;
+			if (status == 'A')
+				string_copy(file->old.rev, NULL_ID);
+
+		} else if (!file->status || has_unmerged) {
+			if (!status_get_diff(file, buf, strlen(buf)))
+				return FALSE;
+
+			buf = io_get(io, 0, TRUE);
+			if (!buf)
+				break;
+
+			/* Collapse all modified entries that follow an
+			 * associated unmerged entry. */
+			if (has_unmerged) {
+				file->status = 'U';
+				has_unmerged = FALSE;
+			} else if (file->status == 'U') {
+				unmerged = file - section->files;
+				has_unmerged = TRUE;
+			}
+		}
+
+		/* Grab the old name for rename/copy. */
+		if (!*file->old.name &&
+		    (file->status == 'R' || file->status == 'C')) {
+			if (!(file->old.name = status_get_name(buf)))
+				return FALSE;
+
+			buf = io_get(io, 0, TRUE);
+			if (!buf)
+				break;
+		}
+
+		/* git-ls-files just delivers a NUL separated list of
+		 * file names similar to the second half of the
+		 * git-diff-* output. */
+		if (!(file->new.name = status_get_name(buf)))
+			return FALSE;
+		if (!*file->old.name)
+			file->old.name = file->new.name;
+	}
+
+	return !io_error(io);
+}
+
+static const char *status_diff_index_argv[] = { GIT_DIFF_STAGED_FILES("-z") };
+static const char *status_diff_files_argv[] = { GIT_DIFF_UNSTAGED_FILES("-z") };
+
+static const char *status_list_other_argv[] = {
+	"git", "ls-files", "-z", "--others", "--exclude-standard", opt_prefix, NULL, NULL,
+};
+
+static const char *status_list_no_head_argv[] = {
+	"git", "ls-files", "-z", "--cached", "--exclude-standard", NULL
+};
+
+static const char *update_index_argv[] = {
+	"git", "update-index", "-q", "--unmerged", "--refresh", NULL
+};
+
+static const char *status_porcelain_argv[] = {
+	"git", "status", "--porcelain=v2", "-z", NULL, NULL
+};
+
+static struct status *
+status_porcelain_add(struct status_section *section, char status, const char *path)
+{
+	struct status *file = status_section_add(section);
+
+	if (!file || !(file->new.name = status_get_name(path))) {
+		if (file)
+			section->size--;
+		return NULL;
+	}
+
+	file->status = status;
+	file->old.name = file->new.name;
+	return file;
+}
+
+/* Split the space separated fields in front of the path, which is
+ * returned. */
+static char *
+status_porcelain_fields(char *buf, char *fields[], int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		char *sep = strchr(buf, ' ');
+
+		if (!sep)
+			return NULL;
+		*sep = 0;
+		fields[i] = buf;
+		buf = sep + 1;
+	}
+
+	return buf;
+}
+
+/* Parse git-status(1) porcelain v2 records into the same files as the
+ * git-diff-index(1), git-diff-files(1) and git-ls-files(1) output:
+ *
+ * 1 XY sub mH mI mW hH hI path
+ * 2 XY sub mH mI mW hH hI Xscore path NUL orig_path
+ * u XY sub m1 m2 m3 mW h1 h2 h3 path
+ * ? path
+ */
+static bool
+status_porcelain_record(struct io *io, char *buf, struct status_section sections[3])
+{
+	char *fields[9];
+	struct status *staged = NULL, *file;
+	bool renamed = *buf == '2';
+	char *path;
+
+	switch (*buf) {
+	case '1':
+	case '2':
+		path = status_porcelain_fields(buf + 2, fields, renamed ? 8 : 7);
+		if (!path || strlen(fields[0]) != 2)
+			return FALSE;
+
+		if (fields[0][0] != '.') {
+			staged = status_porcelain_add(&sections[0], fields[0][0], path);
+			if (!staged)
+				return FALSE;
+			staged->old.mode = strtoul(fields[2], NULL, 8);
+			staged->new.mode = strtoul(fields[3], NULL, 8);
+			string_copy_rev(staged->old.rev, fields[5]);
+			string_copy_rev(staged->new.rev, fields[6]);
+		}
+
+		if (fields[0][1] != '.') {
+			file = status_porcelain_add(&sections[1], fields[0][1], path);
+			if (!file)
+				return FALSE;
+			file->old.mode = strtoul(fields[3], NULL, 8);
+			file->new.mode = strtoul(fields[4], NULL, 8);
+			string_copy_rev(file->old.rev, fields[6]);
+			string_copy_rev(file->new.rev, NULL_ID);
+		}
+
+		/* Reading the original path invalidates the fields. */
+		if (renamed) {
+			path = io_get(io, 0, TRUE);
+			if (!path)
+				return FALSE;
+			if (staged && !(staged->old.name = status_get_name(path)))
+				return FALSE;
+		}
+		return TRUE;
+
+	case 'u':
+		path = status_porcelain_fields(buf + 2, fields, 9);
+		file = path ? status_porcelain_add(&sections[1], 'U', path) : NULL;
+		if (!file)
+			return FALSE;
+		file->new.mode = strtoul(fields[5], NULL, 8);
+		string_copy_rev(file->old.rev, NULL_ID);
+		string_copy_rev(file->new.rev, NULL_ID);
+		return TRUE;
+
+	case '?':
+		/* Only list untracked files below the current directory
+		 * like git-ls-files(1) does. */
+		path = buf + 2;
+		if (strncmp(path, opt_prefix, strlen(opt_prefix)))
+			return TRUE;
+		return status_porcelain_add(&sections[2], '?', path) != NULL;
+
+	default:
+		return TRUE;
+	}
+}
+
+/* Load all sections from a single git-status(1), which refreshes the
+ * index itself and can use the untracked cache and fsmonitor. */
+static bool
+status_run_porcelain(void)
+{
+	struct status_section sections[3] = {};
+	struct io io;
+	char *buf;
+	bool ok;
+	int i;
+
+	status_porcelain_argv[ARRAY_SIZE(status_porcelain_argv) - 2] =
+		opt_untracked_dirs_content ? "--untracked-files=all" : "--untracked-files=normal";
+
+	if (!io_run(&io, IO_RD, opt_cdup, opt_env, status_porcelain_argv))
+		return FALSE;
+
+	ok = TRUE;
+	while (ok && (buf = io_get(&io, 0, TRUE)))
+		ok = status_porcelain_record(&io, buf, sections);
+
+	if (io_error(&io))
+		ok = FALSE;
+	if (!ok)
+		io_kill(&io);
+	if (!io_done(&io))
+		ok = FALSE;
+
+	for (i = 0; i < ARRAY_SIZE(sections); i++) {
+		if (ok)
+			status_section_set(&status_sections[i], &sections[i]);
+		else
+			status_section_free(&sections[i]);
+	}
+
+	return ok;
 }
 
+/* Restore the previous line number to stay in the context or select a
+ * line with something that can be updated. */
 static void
-tree_select(struct view *view, struct line *line)
+status_restore(struct view *view)
 {
-	struct tree_entry *entry = line->data;
+	if (!check_position(&view->prev_pos))
+		return;
 
-	if (line->type == LINE_TREE_HEAD) {
-		string_format(view->ref, "Files in /%s", opt_path);
+	if (view->prev_pos.lineno >= view->lines)
+		view->prev_pos.lineno = view->lines - 1;
+	while (view->prev_pos.lineno < view->lines && !view->line[view->prev_pos.lineno].data)
+		view->prev_pos.lineno++;
+	while (view->prev_pos.lineno > 0 && !view->line[view->prev_pos.lineno].data)
+		view->prev_pos.lineno--;
+
+	/* If the above fails, always skip the "On branch" line. */
+	if (view->prev_pos.lineno < view->lines)
+		view->pos.lineno = view->prev_pos.lineno;
+	else
+		view->pos.lineno = 1;
+
+	if (view->prev_pos.offset > view->pos.lineno)
+		view->pos.offset = view->pos.lineno;
+	else if (view->prev_pos.offset < view->lines)
+		view->pos.offset = view->prev_pos.offset;
+
+	clear_position(&view->prev_pos);
+}
+
+static void
+status_update_onbranch(void)
+{
+	static const char *paths[][2] = {
+		{ "rebase-apply/rebasing",	"Rebasing" },
+		{ "rebase-apply/applying",	"Applying mailbox" },
+		{ "rebase-apply/",		"Rebasing mailbox" },
+		{ "rebase-merge/interactive",	"Interactive rebase" },
+		{ "rebase-merge/",		"Rebase merge" },
+		{ "MERGE_HEAD",			"Merging" },
+		{ "BISECT_LOG",			"Bisecting" },
+		{ "HEAD",			"On branch" },
+	};
+	char buf[SIZEOF_STR];
+	struct stat stat;
+	int i;
+
+	if (is_initial_commit()) {
+		string_copy(status_onbranch, "Initial commit");
 		return;
 	}
 
-	if (line->type == LINE_TREE_DIR && tree_path_is_parent(entry->name)) {
-		string_copy(view->ref, "Open parent directory");
-		ref_blob[0] = 0;
+	for (i = 0; i < ARRAY_SIZE(paths); i++) {
+		char *head = opt_head;
+
+		if (!string_format(buf, "%s/%s", opt_git_dir, paths[i][0]) ||
+		    lstat(buf, &stat) < 0)
+			continue;
+
+		if (!*opt_head) {
+			struct io io;
+
+			if (io_open(&io, "%s/rebase-merge/head-name", opt_git_dir) &&
+			    io_read_buf(&io, buf, sizeof(buf))) {
+				head = buf;
+				if (!prefixcmp(head, "refs/heads/"))
+					head += STRING_SIZE("refs/heads/");
+			}
+		}
+
+		if (!string_format(status_onbranch, "%s %s", paths[i][1], head))
+			string_copy(status_onbranch, opt_head);
 		return;
 	}
 
-	if (line->type == LINE_TREE_FILE) {
-		string_copy_rev(ref_blob, entry->id);
-		string_format(opt_file, "%s%s", opt_path, tree_path(line));
+	string_copy(status_onbranch, "Not currently on any branch");
+}
+
+/*
+ * The index is only refreshed when it or the working tree may have
+ * changed since the last refresh, which is known when the working tree
+ * is watched. The fingerprint changes on every write of the index since
+ * it is replaced by renaming a new file into place.
+ */
+
+struct index_fingerprint {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+};
+
+static struct index_fingerprint index_fingerprint;
+static bool index_worktree_changed = TRUE;
+
+static struct {
+	struct io io;
+	bool running;
+	struct index_fingerprint before;
+} index_refresh_job;
+
+static bool status_reload(struct view *view, enum watch_event events);
+
+static void
+index_get_fingerprint(struct index_fingerprint *fingerprint)
+{
+	char path[SIZEOF_STR];
+	struct stat st;
+
+	memset(fingerprint, 0, sizeof(*fingerprint));
+	if (string_format(path, "%s/index", opt_git_dir) && !stat(path, &st)) {
+		fingerprint->dev = st.st_dev;
+		fingerprint->ino = st.st_ino;
+		fingerprint->size = st.st_size;
+		fingerprint->mtime = st.st_mtime;
 	}
+}
 
-	string_copy_rev(view->ref, entry->id);
+static bool
+index_refresh_needed(void)
+{
+	struct index_fingerprint fingerprint;
+
+	/* Queued changes are handled by a later refresh of the views. */
+	if (index_worktree_changed || !watch_is_active())
+		return TRUE;
+
+	index_get_fingerprint(&fingerprint);
+	return memcmp(&fingerprint, &index_fingerprint, sizeof(fingerprint));
+}
+
+static void
+index_refresh_done(void)
+{
+	io_done(&index_refresh_job.io);
+	index_refresh_job.running = FALSE;
+	index_get_fingerprint(&index_fingerprint);
 }
 
+/* Reload the unstaged files when the refresh changed the index. */
 static bool
-tree_open(struct view *view, enum open_flags flags)
+index_refresh_poll(void *data)
 {
-	static const char *tree_argv[] = {
-		"git", "ls-tree", "-l", "%(commit)", "%(directory)", NULL
-	};
+	struct view *view = VIEW(REQ_VIEW_STATUS);
 
-	if (string_rev_is_null(ref_commit)) {
-		report("No tree exists for this commit");
+	if (!index_refresh_job.running)
 		return FALSE;
+	if (!io_can_read(&index_refresh_job.io, FALSE))
+		return TRUE;
+
+	index_refresh_done();
+
+	if (memcmp(&index_fingerprint, &index_refresh_job.before, sizeof(index_fingerprint)) &&
+	    view_is_displayed(view) && !view->pipe) {
+		status_reload(view, WATCH_WORKTREE);
+		redraw_view(view);
+		update_view_title(view);
 	}
 
-	if (view->lines == 0 && opt_prefix[0]) {
-		char *pos = opt_prefix;
+	return FALSE;
+}
 
-		while (pos && *pos) {
-			char *end = strchr(pos, '/');
+/* Start refreshing the index in the background if needed. */
+static void
+index_refresh(void)
+{
+	if (index_refresh_job.running || !index_refresh_needed())
+		return;
 
-			if (end)
-				*end = 0;
-			push_tree_stack_entry(pos, &view->pos);
-			pos = end;
-			if (end) {
-				*end = '/';
-				pos++;
-			}
-		}
+	/* Changes during the refresh require another one. */
+	index_worktree_changed = FALSE;
+	index_get_fingerprint(&index_refresh_job.before);
 
-	} else if (strcmp(view->vid, view->id)) {
-		opt_path[0] = 0;
+	if (!io_run(&index_refresh_job.io, IO_RD, NULL, NULL, update_index_argv)) {
+		index_worktree_changed = TRUE;
+		return;
 	}
 
-	return begin_update(view, opt_cdup, tree_argv, flags);
+	if (!background_add(index_refresh_poll, NULL)) {
+		io_kill(&index_refresh_job.io);
+		io_done(&index_refresh_job.io);
+		index_worktree_changed = TRUE;
+		return;
+	}
+	index_refresh_job.running = TRUE;
 }
 
-static struct view_ops tree_ops = {
-	"file",
-	{ "tree" },
-	VIEW_SEND_CHILD_ENTER,
-	sizeof(struct tree_state),
-	tree_open,
-	tree_read,
-	tree_draw,
-	tree_request,
-	tree_grep,
-	tree_select,
-};
-
+/* First parse staged info using git-diff-index(1), then parse unstaged
+ * info using git-diff-files(1), and finally untracked files using
+ * git-ls-files(1). The commands run concurrently, while the index is
+ * refreshed in the background. Sections not in the reload mask are
+ * kept as they are. */
 static bool
-blob_open(struct view *view, enum open_flags flags)
+status_run_commands(unsigned int reload)
 {
-	static const char *blob_argv[] = {
-		"git", "cat-file", "blob", "%(blob)", NULL
+	const char **staged_argv = is_initial_commit() ?
+		status_list_no_head_argv : status_diff_index_argv;
+	char staged_status = staged_argv == status_list_no_head_argv ? 'A' : 0;
+	struct {
+		const char **argv;
+		char status;
+		bool started;
+		struct io io;
+		struct status_section loaded;
+	} sections[] = {
+		{ staged_argv,			staged_status },
+		{ status_diff_files_argv,	0 },
+		{ status_list_other_argv,	'?' },
 	};
+	bool ok = TRUE;
+	int i;
 
-	if (!ref_blob[0] && opt_file[0]) {
-		const char *commit = ref_commit[0] ? ref_commit : "HEAD";
-		char blob_spec[SIZEOF_STR];
-		const char *rev_parse_argv[] = {
-			"git", "rev-parse", blob_spec, NULL
-		};
+	status_list_other_argv[ARRAY_SIZE(status_list_other_argv) - 2] =
+		opt_untracked_dirs_content ? NULL : "--directory";
 
-		if (!string_format(blob_spec, "%s:%s", commit, opt_file) ||
-		    !io_run_buf(rev_parse_argv, ref_blob, sizeof(ref_blob))) {
-			report("Failed to resolve blob from file name");
-			return FALSE;
-		}
+	if (reload & (1 << 1))
+		index_refresh();
+
+	for (i = 0; i < ARRAY_SIZE(sections); i++) {
+		if (reload & (1 << i))
+			sections[i].started = io_run(&sections[i].io, IO_RD, opt_cdup,
+						     opt_env, sections[i].argv);
 	}
 
-	if (!ref_blob[0]) {
-		report("No file chosen, press %s to open tree view",
-			get_view_key(view, REQ_VIEW_TREE));
-		return FALSE;
+	/* Read the output in section order; the other commands keep
+	 * running until their pipe is full. */
+	for (i = 0; i < ARRAY_SIZE(sections); i++) {
+		if (!(reload & (1 << i)))
+			continue;
+		if (ok && (!sections[i].started ||
+			   !status_read_section(&sections[i].loaded, &sections[i].io,
+						sections[i].status)))
+			ok = FALSE;
+		if (sections[i].started) {
+			if (!ok)
+				io_kill(&sections[i].io);
+			io_done(&sections[i].io);
+		}
 	}
 
-	view->encoding = get_path_encoding(opt_file, default_encoding);
+	for (i = 0; i < ARRAY_SIZE(sections); i++) {
+		if (ok && (reload & (1 << i)))
+			status_section_set(&status_sections[i], &sections[i].loaded);
+		else
+			status_section_free(&sections[i].loaded);
+	}
 
-	return begin_update(view, NULL, blob_argv, flags);
+	return ok;
 }
 
-static bool
-blob_read(struct view *view, char *line)
+/* Line counts of the staged and unstaged files are loaded in the
+ * background once the files are listed, and drawn as they arrive. */
+static const char *status_numstat_argv[][8] = {
+	{ "git", "diff", "--cached", "--numstat", "-z", NULL },
+	{ "git", "diff", "--numstat", "-z", NULL },
+};
+
+static struct status_numstat {
+	struct io io;
+	bool running;
+	struct timeval start;
+	size_t files;
+	int added, deleted;	/* Counts of a record split over reads. */
+	int paths;		/* Paths left to read for the record. */
+} status_numstat[2];
+
+static int status_added_width;
+static int status_deleted_width;
+
+static void
+status_numstat_stop(int i)
 {
-	if (!line)
-		return TRUE;
-	return add_line_text(view, line, LINE_DEFAULT) != NULL;
+	if (status_numstat[i].running) {
+		io_kill(&status_numstat[i].io);
+		io_done(&status_numstat[i].io);
+	}
+	status_numstat[i].running = FALSE;
 }
 
-static enum request
-blob_request(struct view *view, enum request request, struct line *line)
+static void
+status_numstat_set(struct status_section *section, struct status_numstat *job, const char *name)
 {
-	switch (request) {
-	case REQ_VIEW_BLAME:
-		if (view->parent)
-			string_copy(opt_ref, view->parent->vid);
-		return request;
+	struct status *file = status_section_find(section, name);
+	char buf[32];
 
-	case REQ_EDIT:
-		open_blob_editor(view->vid, NULL, (line - view->line) + 1);
-		return REQ_NONE;
-	default:
-		return pager_request(view, request, line);
-	}
-}
+	job->files++;
+	if (!file || job->added < 0)
+		return;
 
-static struct view_ops blob_ops = {
-	"line",
-	{ "blob" },
-	VIEW_NO_FLAGS,
-	0,
-	blob_open,
-	blob_read,
-	pager_draw,
-	blob_request,
-	pager_grep,
-	pager_select,
-};
+	file->added = job->added;
+	file->deleted = job->deleted;
+	if (string_format(buf, "+%d", file->added))
+		status_added_width = MAX(status_added_width, strlen(buf));
+	if (string_format(buf, "-%d", file->deleted))
+		status_deleted_width = MAX(status_deleted_width, strlen(buf));
+}
 
-/*
- * Blame backend
- *
- * Loading the blame view is a two phase job:
- *
- *  1. File content is read either using opt_file from the
- *     filesystem or using git-cat-file.
- *  2. Then blame information is incrementally added by
- *     reading output from git-blame.
- */
+/* Records are "added TAB deleted TAB path", where the path of renames is
+ * empty and followed by the old and new path. Binary files have "-" as
+ * their counts. */
+static void
+status_numstat_read(struct status_section *section, struct status_numstat *job, char *buf)
+{
+	char *deleted, *path;
 
-struct blame_history_state {
-	char id[SIZEOF_REV];		/* SHA1 ID. */
-	const char *filename;		/* Name of file. */
-};
+	if (job->paths) {
+		if (--job->paths == 0)
+			status_numstat_set(section, job, buf);
+		return;
+	}
 
-static struct view_history blame_view_history = { sizeof(struct blame_history_state) };
+	deleted = strchr(buf, '\t');
+	path = deleted ? strchr(deleted + 1, '\t') : NULL;
+	if (!path)
+		return;
 
-struct blame {
-	struct blame_commit *commit;
-	unsigned long lineno;
-	char text[1];
-};
+	job->added = *buf == '-' ? -1 : atoi(buf);
+	job->deleted = deleted[1] == '-' ? -1 : atoi(deleted + 1);
 
-struct blame_state {
-	struct blame_commit *commit;
-	int blamed;
-	bool done_reading;
-	bool auto_filename_display;
-	/* The history state for the current view is cached in the view
-	 * state so it always matches what was used to load the current blame
-	 * view. */
-	struct blame_history_state history_state;
-};
+	if (*++path)
+		status_numstat_set(section, job, path);
+	else
+		job->paths = 2;
+}
 
 static bool
-blame_detect_filename_display(struct view *view)
+status_numstat_poll(void *data)
 {
-	bool show_filenames = FALSE;
-	const char *filename = NULL;
+	struct view *view = VIEW(REQ_VIEW_STATUS);
+	bool running = FALSE, updated = FALSE;
 	int i;
 
-	if (opt_blame_argv) {
-		for (i = 0; opt_blame_argv[i]; i++) {
-			if (prefixcmp(opt_blame_argv[i], "-C"))
-				continue;
+	for (i = 0; i < ARRAY_SIZE(status_numstat); i++) {
+		struct status_numstat *job = &status_numstat[i];
+		bool can_read = TRUE;
+		struct timeval now;
+		char *buf;
 
-			show_filenames = TRUE;
+		if (!job->running)
+			continue;
+		if (!io_can_read(&job->io, FALSE)) {
+			running = TRUE;
+			continue;
 		}
-	}
 
-	for (i = 0; i < view->lines; i++) {
-		struct blame *blame = view->line[i].data;
+		for (; (buf = io_get(&job->io, 0, can_read)); can_read = FALSE) {
+			status_numstat_read(&status_sections[i], job, buf);
+			updated = TRUE;
+		}
 
-		if (blame->commit && blame->commit->id[0]) {
-			if (!filename)
-				filename = blame->commit->filename;
-			else if (strcmp(filename, blame->commit->filename))
-				show_filenames = TRUE;
+		if (!io_eof(&job->io) && !io_error(&job->io)) {
+			running = TRUE;
+			continue;
 		}
+
+		gettimeofday(&now, NULL);
+		io_trace("numstat %s: %zu files in %ld ms\n", i ? "unstaged" : "staged",
+			 job->files, (long) ((now.tv_sec - job->start.tv_sec) * 1000 +
+					     (now.tv_usec - job->start.tv_usec) / 1000));
+		io_done(&job->io);
+		job->running = FALSE;
 	}
 
-	return show_filenames;
+	if (updated && view_is_displayed(view))
+		redraw_view(view);
+
+	return running;
 }
 
-static bool
-blame_open(struct view *view, enum open_flags flags)
+/* Load line counts for the sections in the reload mask. */
+static void
+status_numstat_start(unsigned int reload)
 {
-	struct blame_state *state = view->private;
-	const char *file_argv[] = { opt_cdup, opt_file , NULL };
-	char path[SIZEOF_STR];
-	size_t i;
+	int i;
 
-	if (!opt_file[0]) {
-		report("No file chosen, press %s to open tree view",
-			get_view_key(view, REQ_VIEW_TREE));
-		return FALSE;
-	}
+	for (i = 0; i < ARRAY_SIZE(status_numstat); i++) {
+		struct status_numstat *job = &status_numstat[i];
 
-	if (!view->prev && *opt_prefix && !(flags & (OPEN_RELOAD | OPEN_REFRESH))) {
-		string_copy(path, opt_file);
-		if (!string_format(opt_file, "%s%s", opt_prefix, path)) {
-			report("Failed to setup the blame view");
-			return FALSE;
-		}
-	}
+		if (!(reload & (1 << i)))
+			continue;
 
-	if (*opt_ref || !begin_update(view, opt_cdup, file_argv, flags)) {
-		const char *blame_cat_file_argv[] = {
-			"git", "cat-file", "blob", "%(ref):%(file)", NULL
-		};
+		status_numstat_stop(i);
+		memset(job, 0, sizeof(*job));
+		if (!status_sections[i].size ||
+		    !io_run(&job->io, IO_RD, opt_cdup, opt_env, status_numstat_argv[i]))
+			continue;
 
-		if (!begin_update(view, opt_cdup, blame_cat_file_argv, flags))
-			return FALSE;
+		gettimeofday(&job->start, NULL);
+		job->running = TRUE;
+		if (!background_add(status_numstat_poll, NULL))
+			status_numstat_stop(i);
 	}
+}
 
-	/* First pass: remove multiple references to the same commit. */
-	for (i = 0; i < view->lines; i++) {
-		struct blame *blame = view->line[i].data;
+static void
+status_free_dirs(void)
+{
+	size_t i;
 
-		if (blame->commit && blame->commit->id[0])
-			blame->commit->id[0] = 0;
-		else
-			blame->commit = NULL;
-	}
+	for (i = 0; i < status_dirs_size; i++)
+		free(status_dirs[i]);
+	free(status_dirs);
+	status_dirs = NULL;
+	status_dirs_size = 0;
+}
 
-	/* Second pass: free existing references. */
-	for (i = 0; i < view->lines; i++) {
-		struct blame *blame = view->line[i].data;
+static bool
+status_is_expanded(struct status_section *section, const char *name)
+{
+	size_t i;
 
-		if (blame->commit)
-			free(blame->commit);
+	for (i = 0; i < section->expanded_size; i++)
+		if (section->expanded[i] == name)
+			return TRUE;
+	return FALSE;
+}
+
+static bool
+status_expand(struct status_section *section, const char *name, bool expand)
+{
+	size_t i;
+
+	for (i = 0; i < section->expanded_size; i++) {
+		if (section->expanded[i] != name)
+			continue;
+		if (!expand)
+			section->expanded[i] = section->expanded[--section->expanded_size];
+		return TRUE;
 	}
 
-	if (!(flags & OPEN_RELOAD))
-		reset_view_history(&blame_view_history);
-	string_copy_rev(state->history_state.id, opt_ref);
-	state->history_state.filename = get_path(opt_file);
-	if (!state->history_state.filename)
+	if (!expand)
+		return TRUE;
+	if (!realloc_status_expanded(&section->expanded, section->expanded_size, 1))
 		return FALSE;
-	string_format(view->vid, "%s", opt_file);
-	string_format(view->ref, "%s ...", opt_file);
+	section->expanded[section->expanded_size++] = name;
+	return TRUE;
+}
+
+/* Expand all directories leading to a file. */
+static bool
+status_expand_path(struct status_section *section, const char *name)
+{
+	const char *slash;
+
+	for (slash = strchr(name, '/'); slash && slash[1]; slash = strchr(slash + 1, '/')) {
+		char path[SIZEOF_STR];
+		const char *dirname;
+
+		if (slash - name + 1 >= sizeof(path))
+			return FALSE;
+		string_ncopy(path, name, slash - name + 1);
+		dirname = status_get_name(path);
+		if (!dirname || !status_expand(section, dirname, TRUE))
+			return FALSE;
+	}
 
 	return TRUE;
 }
 
-static struct blame_commit *
-get_blame_commit(struct view *view, const char *id)
+/* Find the end of the files starting at from which have the prefix. */
+static size_t
+status_dir_end(struct status_section *section, size_t from, size_t to,
+	       const char *prefix, size_t prefixlen)
+{
+	while (from < to) {
+		size_t pos = from + (to - from) / 2;
+
+		if (!strncmp(section->files[pos].new.name, prefix, prefixlen))
+			from = pos + 1;
+		else
+			to = pos;
+	}
+
+	return from;
+}
+
+static bool
+status_add_dir(struct view *view, enum line_type type, struct status_section *section,
+	       const char *name, size_t from, size_t to, unsigned int depth)
 {
+	struct status_dir *dir;
+	struct line *line;
 	size_t i;
 
-	for (i = 0; i < view->lines; i++) {
-		struct blame *blame = view->line[i].data;
+	if (!realloc_status_dirs(&status_dirs, status_dirs_size, 1) ||
+	    !(dir = calloc(1, sizeof(*dir))))
+		return FALSE;
+	status_dirs[status_dirs_size++] = dir;
+
+	dir->name = name;
+	dir->from = from;
+	dir->to = to;
+	dir->depth = depth;
+	dir->status = section->files[from].status;
+	for (i = from + 1; i < to && dir->status != '*'; i++)
+		if (section->files[i].status != dir->status)
+			dir->status = '*';
+
+	line = add_line(view, dir, type, 0, FALSE);
+	if (line)
+		line->user_flags |= STATUS_DIR_LINE;
+	return line != NULL;
+}
 
-		if (!blame->commit)
+/* Add lines for the files in the range, which all share the first
+ * prefixlen characters of their name. In grouped sections, files in
+ * subdirectories are only listed when their directory is expanded. */
+static bool
+status_add_files(struct view *view, enum line_type type, struct status_section *section,
+		 size_t from, size_t to, size_t prefixlen, unsigned int depth)
+{
+	while (from < to) {
+		const char *name = section->files[from].new.name;
+		const char *slash = strchr(name + prefixlen, '/');
+		char path[SIZEOF_STR];
+		const char *dirname;
+		size_t len, end;
+
+		/* Untracked directories are listed with a trailing slash. */
+		if (!section->grouped || !slash || !slash[1]) {
+			if (!add_line(view, &section->files[from++], type, 0, FALSE))
+				return FALSE;
 			continue;
+		}
 
-		if (!strncmp(blame->commit->id, id, SIZEOF_REV - 1))
-			return blame->commit;
+		len = slash - name + 1;
+		if (len >= sizeof(path))
+			return FALSE;
+		string_ncopy(path, name, len);
+		dirname = status_get_name(path);
+		end = status_dir_end(section, from, to, path, len);
+
+		if (!dirname ||
+		    !status_add_dir(view, type, section, dirname, from, end, depth) ||
+		    (status_is_expanded(section, dirname) &&
+		     !status_add_files(view, type, section, from, end, len, depth + 1)))
+			return FALSE;
+		from = end;
 	}
 
-	{
-		struct blame_commit *commit = calloc(1, sizeof(*commit));
-
-		if (commit)
-			string_ncopy(commit->id, id, SIZEOF_REV);
-		return commit;
-	}
+	return TRUE;
 }
 
-static struct blame_commit *
-read_blame_commit(struct view *view, const char *text, struct blame_state *state)
+/* Add the lines for all sections to a view with only the "On branch"
+ * line, dropping any old lines. */
+static bool
+status_add_lines(struct view *view)
 {
-	struct blame_header header;
-	struct blame_commit *commit;
-	struct blame *blame;
+	enum line_type types[] = {
+		LINE_STAT_STAGED, LINE_STAT_UNSTAGED, LINE_STAT_UNTRACKED
+	};
+	int i;
 
-	if (!parse_blame_header(&header, text, view->lines))
-		return NULL;
+	for (i = 0; i < view->lines; i++)
+		view->line[i].data = NULL;
+	view->lines = 0;
+	view->custom_lines = 0;
+	status_free_dirs();
 
-	commit = get_blame_commit(view, text);
-	if (!commit)
-		return NULL;
+	if (!add_line_nodata(view, LINE_STAT_HEAD))
+		return FALSE;
 
-	state->blamed += header.group;
-	while (header.group--) {
-		struct line *line = &view->line[header.lineno + header.group - 1];
+	for (i = 0; i < ARRAY_SIZE(types); i++) {
+		struct status_section *section = &status_sections[i];
 
-		blame = line->data;
-		blame->commit = commit;
-		blame->lineno = header.orig_lineno + header.group - 1;
-		line->dirty = 1;
+		if (!add_line_nodata(view, types[i]) ||
+		    !status_add_files(view, types[i], section, 0, section->size, 0, 0) ||
+		    (!section->size && !add_line_nodata(view, LINE_STAT_NONE)))
+			return FALSE;
 	}
 
-	return commit;
+	return TRUE;
+}
+
+static const char *
+status_line_name(struct line *line)
+{
+	if (status_line_is_dir(line))
+		return ((struct status_dir *) line->data)->name;
+	return line->data ? ((struct status *) line->data)->new.name : NULL;
 }
 
+/* Find the line of a file or directory by its interned name. */
 static bool
-blame_read_file(struct view *view, const char *text, struct blame_state *state)
+status_find_line(struct view *view, enum line_type type, const char *name, bool is_dir)
 {
-	if (!text) {
-		const char *blame_argv[] = {
-			"git", "blame", encoding_arg, "%(blameargs)", "--incremental",
-				*opt_ref ? opt_ref : "--incremental", "--", opt_file, NULL
-		};
+	unsigned long lineno;
 
-		if (view->lines == 0 && !view->prev)
-			die("No blame exist for %s", view->vid);
+	for (lineno = 0; lineno < view->lines; lineno++) {
+		struct line *line = &view->line[lineno];
 
-		if (view->lines == 0 || !begin_update(view, opt_cdup, blame_argv, OPEN_EXTRA)) {
-			report("Failed to load blame data");
+		if (line->type == type && status_line_is_dir(line) == is_dir &&
+		    status_line_name(line) == name) {
+			view->prev_pos.lineno = lineno;
 			return TRUE;
 		}
+	}
 
-		if (opt_goto_line > 0) {
-			select_view_line(view, opt_goto_line);
-			opt_goto_line = 0;
-		}
+	return FALSE;
+}
 
-		state->done_reading = TRUE;
+static bool
+status_load(struct view *view)
+{
+	if (!(opt_status_porcelain ? status_run_porcelain() : status_run_commands(~0)) ||
+	    !status_add_lines(view)) {
+		report("Failed to load status data");
 		return FALSE;
+	}
 
-	} else {
-		size_t textlen = strlen(text);
-		struct blame *blame;
+	status_added_width = status_deleted_width = 0;
+	status_numstat_start(~0);
 
-		if (!add_line_alloc(view, &blame, LINE_ID, textlen, FALSE))
-			return FALSE;
+	/* Restore the exact position or use the specialized restore
+	 * mode? */
+	status_restore(view);
+	return TRUE;
+}
 
-		blame->commit = NULL;
-		strncpy(blame->text, text, textlen);
-		blame->text[textlen] = 0;
-		return TRUE;
-	}
+/*
+ * Until git has listed the files, the unstaged files found from the stat
+ * data in the index are shown. Files which only may have changed and the
+ * staged and untracked files are missing from this first result.
+ */
+
+static struct position status_approximate_pos;
+static bool status_approximate;
+
+static bool
+status_approximate_file(const char *path, char status, void *data)
+{
+	return status_porcelain_add(data, status, path) != NULL;
 }
 
 static bool
-blame_read(struct view *view, char *line)
+status_approximate_poll(void *data)
 {
-	struct blame_state *state = view->private;
+	struct view *view = data;
 
-	if (!state->done_reading)
-		return blame_read_file(view, line, state);
+	if (!status_approximate)
+		return FALSE;
+	status_approximate = FALSE;
 
-	if (!line) {
-		state->auto_filename_display = blame_detect_filename_display(view);
-		string_format(view->ref, "%s", view->vid);
-		if (view_is_displayed(view)) {
-			update_view_title(view);
-			redraw_view_from(view, 0);
-		}
-		return TRUE;
+	/* Show the first result while waiting for git. */
+	doupdate();
+
+	view->prev_pos = status_approximate_pos;
+	status_load(view);
+	if (view_is_displayed(view)) {
+		redraw_view(view);
+		update_view_title(view);
 	}
+	return FALSE;
+}
 
-	if (!state->commit) {
-		state->commit = read_blame_commit(view, line, state);
-		string_format(view->ref, "%s %2zd%%", view->vid,
-			      view->lines ? state->blamed * 100 / view->lines : 0);
+static bool
+status_open_approximate(struct view *view)
+{
+	struct status_section loaded = {};
 
-	} else if (parse_blame_info(state->commit, line)) {
-		if (!state->commit->filename)
-			return FALSE;
-		state->commit = NULL;
+	if (opt_status_porcelain ||
+	    !index_diff_worktree_files(opt_git_dir, *opt_cdup ? opt_cdup : ".",
+				       status_approximate_file, &loaded) ||
+	    !background_add(status_approximate_poll, view)) {
+		status_section_free(&loaded);
+		return FALSE;
+	}
+
+	status_section_set(&status_sections[1], &loaded);
+	if (!status_add_lines(view)) {
+		status_approximate = FALSE;
+		return FALSE;
 	}
 
+	/* Restore the position once the files are loaded. */
+	status_approximate_pos = view->prev_pos;
+	clear_position(&view->prev_pos);
+	status_approximate = TRUE;
 	return TRUE;
 }
 
 static bool
-blame_draw(struct view *view, struct line *line, unsigned int lineno)
+status_open(struct view *view, enum open_flags flags)
 {
-	struct blame_state *state = view->private;
-	struct blame *blame = line->data;
-	struct time *time = NULL;
-	const char *id = NULL, *filename = NULL;
-	const struct ident *author = NULL;
-	enum line_type id_type = LINE_ID;
-	static const enum line_type blame_colors[] = {
-		LINE_PALETTE_0,
-		LINE_PALETTE_1,
-		LINE_PALETTE_2,
-		LINE_PALETTE_3,
-		LINE_PALETTE_4,
-		LINE_PALETTE_5,
-		LINE_PALETTE_6,
-	};
-
-#define BLAME_COLOR(i) \
-	(blame_colors[(i) % ARRAY_SIZE(blame_colors)])
-
-	if (blame->commit && blame->commit->filename) {
-		id = blame->commit->id;
-		author = blame->commit->author;
-		filename = blame->commit->filename;
-		time = &blame->commit->time;
-		id_type = BLAME_COLOR((long) blame->commit);
+	if (opt_is_inside_work_tree == FALSE) {
+		report("The status view requires a working tree");
+		return FALSE;
 	}
 
-	if (draw_date(view, time))
-		return TRUE;
+	reset_view(view);
 
-	if (draw_author(view, author))
-		return TRUE;
+	status_update_onbranch();
 
-	if (draw_filename(view, filename, state->auto_filename_display))
+	/* Views refreshed after an update look up the files right away. */
+	if (!(flags & OPEN_REFRESH) && status_open_approximate(view))
 		return TRUE;
+	return status_load(view);
+}
 
-	if (draw_id_custom(view, id_type, id, opt_id_cols))
-		return TRUE;
+static void
+status_done(struct view *view)
+{
+	int i;
 
-	if (draw_lineno(view, lineno))
-		return TRUE;
+	/* Lines point into the sections. */
+	for (i = 0; i < view->lines; i++)
+		view->line[i].data = NULL;
 
-	draw_text(view, LINE_DEFAULT, blame->text);
-	return TRUE;
+	status_free_dirs();
+	for (i = 0; i < ARRAY_SIZE(status_sections); i++)
+		status_section_free(&status_sections[i]);
+	for (i = 0; i < ARRAY_SIZE(status_numstat); i++)
+		status_numstat_stop(i);
 }
 
+/* Reload only the sections affected by the changes, and stay on the
+ * selected file if it is still listed. */
 static bool
-check_blame_commit(struct blame *blame, bool check_null_id)
-{
-	if (!blame->commit)
-		report("Commit data not loaded yet");
-	else if (check_null_id && string_rev_is_null(blame->commit->id))
-		report("No commit exist for the selected line");
-	else
-		return TRUE;
-	return FALSE;
-}
-
-static void
-setup_blame_parent_line(struct view *view, struct blame *blame)
+status_reload(struct view *view, enum watch_event events)
 {
-	char from[SIZEOF_REF + SIZEOF_STR];
-	char to[SIZEOF_REF + SIZEOF_STR];
-	const char *diff_tree_argv[] = {
-		"git", "diff", encoding_arg, "--no-textconv", "--no-extdiff",
-			"--no-color", "-U0", from, to, "--", NULL
-	};
-	struct io io;
-	int parent_lineno = -1;
-	int blamed_lineno = -1;
-	char *line;
+	struct line *selected = view->lines ? &view->line[view->pos.lineno] : NULL;
+	const char *prev_name = selected ? status_line_name(selected) : NULL;
+	bool prev_is_dir = selected && status_line_is_dir(selected);
+	enum line_type prev_type = selected ? selected->type : LINE_DEFAULT;
+	unsigned int reload = 0;
+	bool ok;
 
-	if (!string_format(from, "%s:%s", opt_ref, opt_file) ||
-	    !string_format(to, "%s:%s", blame->commit->id, blame->commit->filename) ||
-	    !io_run(&io, IO_RD, NULL, opt_env, diff_tree_argv))
-		return;
+	if (events & (WATCH_INDEX | WATCH_HEAD))
+		reload |= 1 << 0;
+	if (events & (WATCH_INDEX | WATCH_WORKTREE))
+		reload |= (1 << 1) | (1 << 2);
+	if (!reload)
+		return TRUE;
 
-	while ((line = io_get(&io, '\n', TRUE))) {
-		if (*line == '@') {
-			char *pos = strchr(line, '+');
+	view->prev_pos = view->pos;
+	status_update_onbranch();
 
-			parent_lineno = atoi(line + 4);
-			if (pos)
-				blamed_lineno = atoi(pos + 1);
+	if (opt_status_porcelain)
+		reload = ~0;
+	ok = opt_status_porcelain ? status_run_porcelain() : status_run_commands(reload);
+	ok = status_add_lines(view) && ok;
+	status_numstat_start(reload);
 
-		} else if (*line == '+' && parent_lineno != -1) {
-			if (blame->lineno == blamed_lineno - 1 &&
-			    !strcmp(blame->text, line + 1)) {
-				view->pos.lineno = parent_lineno ? parent_lineno - 1 : 0;
-				break;
-			}
-			blamed_lineno++;
-		}
-	}
+	if (prev_name)
+		status_find_line(view, prev_type, prev_name, prev_is_dir);
+	status_restore(view);
 
-	io_done(&io);
+	if (!ok)
+		report("Failed to reload status data");
+	return ok;
 }
 
+/* Expand or collapse a directory and stay on it. */
 static void
-blame_go_forward(struct view *view, struct blame *blame, bool parent)
+status_toggle_dir(struct view *view, struct line *line)
 {
-	struct blame_state *state = view->private;
-	struct blame_history_state *history_state = &state->history_state;
-	struct blame_commit *commit = blame->commit;
-	const char *id = parent ? commit->parent_id : commit->id;
-	const char *filename = parent ? commit->parent_filename : commit->filename;
-
-	if (!*id && parent) {
-		report("The selected commit has no parents");
-		return;
-	}
-
-	if (!strcmp(history_state->id, id) && !strcmp(history_state->filename, filename)) {
-		report("The selected commit is already displayed");
-		return;
-	}
+	struct status_section *section = status_get_section(line->type);
+	struct status_dir *dir = line->data;
+	const char *name = dir->name;
+	enum line_type type = line->type;
 
-	if (!push_view_history_state(&blame_view_history, &view->pos, history_state)) {
-		report("Failed to save current view state");
+	view->prev_pos = view->pos;
+	if (!status_expand(section, name, !status_is_expanded(section, name)) ||
+	    !status_add_lines(view)) {
+		report("Failed to update the directory");
 		return;
 	}
 
-	string_ncopy(opt_ref, id, sizeof(commit->id));
-	string_ncopy(opt_file, filename, strlen(filename));
-	if (parent)
-		setup_blame_parent_line(view, blame);
-	opt_goto_line = blame->lineno;
-	reload_view(view);
+	status_find_line(view, type, name, TRUE);
+	status_restore(view);
+	redraw_view(view);
 }
 
-static void
-blame_go_back(struct view *view)
+static bool
+status_draw_numstat(struct view *view, enum line_type type, struct status *status)
 {
-	struct blame_history_state history_state;
+	char added[32] = "", deleted[32] = "";
 
-	if (!pop_view_history_state(&blame_view_history, &view->pos, &history_state)) {
-		report("Already at start of history");
-		return;
-	}
+	if (type == LINE_STAT_UNTRACKED || !status_added_width)
+		return FALSE;
 
-	string_copy(opt_ref, history_state.id);
-	string_ncopy(opt_file, history_state.filename, strlen(history_state.filename));
-	opt_goto_line = view->pos.lineno;
-	reload_view(view);
+	if (status && status->added >= 0 &&
+	    (!string_format(added, "+%d", status->added) ||
+	     !string_format(deleted, "-%d", status->deleted)))
+		return TRUE;
+
+	return draw_field(view, LINE_DIFF_ADD, added, status_added_width, ALIGN_RIGHT, FALSE) ||
+	       draw_field(view, LINE_DIFF_DEL, deleted, status_deleted_width, ALIGN_RIGHT, FALSE);
 }
 
-static enum request
-blame_request(struct view *view, enum request request, struct line *line)
+static bool
+status_draw(struct view *view, struct line *line, unsigned int lineno)
 {
-	enum open_flags flags = view_is_displayed(view) ? OPEN_SPLIT : OPEN_DEFAULT;
-	struct blame *blame = line->data;
+	struct status *status = line->data;
+	enum line_type type;
+	const char *text;
 
-	switch (request) {
-	case REQ_VIEW_BLAME:
-	case REQ_PARENT:
-		if (!check_blame_commit(blame, TRUE))
+	if (!status) {
+		switch (line->type) {
+		case LINE_STAT_STAGED:
+			type = LINE_STAT_SECTION;
+			text = "Changes to be committed:";
 			break;
-		blame_go_forward(view, blame, request == REQ_PARENT);
-		break;
 
-	case REQ_BACK:
-		blame_go_back(view);
-		break;
+		case LINE_STAT_UNSTAGED:
+			type = LINE_STAT_SECTION;
+			text = "Changed but not updated:";
+			break;
 
-	case REQ_ENTER:
-		if (!check_blame_commit(blame, FALSE))
+		case LINE_STAT_UNTRACKED:
+			type = LINE_STAT_SECTION;
+			text = "Untracked files:";
 			break;
 
-		if (view_is_displayed(VIEW(REQ_VIEW_DIFF)) &&
-		    !strcmp(blame->commit->id, VIEW(REQ_VIEW_DIFF)->ref))
+		case LINE_STAT_NONE:
+			type = LINE_DEFAULT;
+			text = "  (no files)";
 			break;
 
-		if (string_rev_is_null(blame->commit->id)) {
-			struct view *diff = VIEW(REQ_VIEW_DIFF);
-			const char *diff_parent_argv[] = {
-				GIT_DIFF_BLAME(encoding_arg,
-					opt_diff_context_arg,
-					opt_ignore_space_arg, view->vid)
-			};
-			const char *diff_no_parent_argv[] = {
-				GIT_DIFF_BLAME_NO_PARENT(encoding_arg,
-					opt_diff_context_arg,
-					opt_ignore_space_arg, view->vid)
-			};
-			const char **diff_index_argv = *blame->commit->parent_id
-				? diff_parent_argv : diff_no_parent_argv;
+		case LINE_STAT_HEAD:
+			type = LINE_STAT_HEAD;
+			text = status_onbranch;
+			break;
+
+		default:
+			return FALSE;
+		}
+	} else {
+		struct status_section *section = status_get_section(line->type);
+		static char buf[] = { '?', ' ', ' ', ' ', 0 };
+		unsigned int depth = 0;
+
+		type = LINE_DEFAULT;
+
+		if (status_line_is_dir(line)) {
+			struct status_dir *dir = line->data;
+			size_t len = strlen(dir->name) - 1;
+			char files[64];
+
+			buf[0] = dir->status;
+			if (draw_text(view, line->type, buf) ||
+			    status_draw_numstat(view, line->type, NULL) ||
+			    draw_space(view, LINE_DEFAULT, dir->depth * 2, dir->depth * 2) ||
+			    draw_text(view, LINE_DELIMITER,
+				      status_is_expanded(section, dir->name) ? "- " : "+ "))
+				return TRUE;
+
+			while (len > 0 && dir->name[len - 1] != '/')
+				len--;
+			if (draw_text(view, LINE_TREE_DIR, dir->name + len))
+				return TRUE;
+
+			string_format(files, " (%zu files)", dir->to - dir->from);
+			draw_text(view, LINE_DELIMITER, files);
+			return TRUE;
+		}
+
+		buf[0] = status->status;
+		if (draw_text(view, line->type, buf))
+			return TRUE;
+		text = status->new.name;
+		if (status_draw_numstat(view, line->type, status))
+			return TRUE;
+
+		/* Files in grouped sections are listed below their directory. */
+		if (section && section->grouped) {
+			const char *name = text;
+			const char *end = text + strlen(text) - 1;
+
+			for (; *name && name < end; name++) {
+				if (*name == '/') {
+					text = name + 1;
+					depth++;
+				}
+			}
+			if (draw_space(view, LINE_DEFAULT, depth * 2, depth * 2))
+				return TRUE;
+		}
+	}
+
+	draw_text(view, type, text);
+	return TRUE;
+}
+
+static enum request
+status_enter(struct view *view, struct line *line)
+{
+	struct status *status = line->data;
+	enum open_flags flags = view_is_displayed(view) ? OPEN_SPLIT : OPEN_DEFAULT;
+
+	if (status_line_is_dir(line)) {
+		status_toggle_dir(view, line);
+		return REQ_NONE;
+	}
+
+	if (line->type == LINE_STAT_NONE ||
+	    (!status && line[1].type == LINE_STAT_NONE)) {
+		report("No file to diff");
+		return REQ_NONE;
+	}
 
-			open_argv(view, diff, diff_index_argv, NULL, flags);
-			if (diff->pipe)
-				string_copy_rev(diff->ref, NULL_ID);
-		} else {
-			open_view(view, REQ_VIEW_DIFF, flags);
+	switch (line->type) {
+	case LINE_STAT_STAGED:
+	case LINE_STAT_UNSTAGED:
+		break;
+
+	case LINE_STAT_UNTRACKED:
+		if (!status) {
+			report("No file to show");
+			return REQ_NONE;
+		}
+
+	    	if (!suffixcmp(status->new.name, -1, "/")) {
+			report("Cannot display a directory");
+			return REQ_NONE;
 		}
 		break;
 
+	case LINE_STAT_HEAD:
+		return REQ_NONE;
+
 	default:
-		return request;
+		die("line type %d not handled in switch", line->type);
+	}
+
+	if (status) {
+		stage_status = *status;
+	} else {
+		memset(&stage_status, 0, sizeof(stage_status));
+		stage_status.old.name = stage_status.new.name = "";
+		stage_status.added = stage_status.deleted = -1;
 	}
 
+	stage_line_type = line->type;
+
+	open_view(view, REQ_VIEW_STAGE, flags);
 	return REQ_NONE;
 }
 
 static bool
-blame_grep(struct view *view, struct line *line)
+status_exists(struct view *view, struct status *status, enum line_type type)
 {
-	struct blame *blame = line->data;
-	struct blame_commit *commit = blame->commit;
-	const char *text[] = {
-		blame->text,
-		commit ? commit->title : "",
-		commit ? commit->id : "",
-		commit ? mkauthor(commit->author, opt_author_width, opt_author) : "",
-		commit ? mkdate(&commit->time, opt_date) : "",
-		NULL
-	};
-
-	return grep_text(view, text);
-}
+	struct status_section *section = status_get_section(type);
+	unsigned long lineno;
 
-static void
-blame_select(struct view *view, struct line *line)
-{
-	struct blame *blame = line->data;
-	struct blame_commit *commit = blame->commit;
+	for (lineno = 0; lineno < view->lines; lineno++) {
+		struct line *line = &view->line[lineno];
+		struct status *pos = status_line_file(line);
 
-	if (!commit)
-		return;
+		if (line->type != type)
+			continue;
+		if (!line->data && (!status || !status->status) && line[1].data) {
+			select_view_line(view, lineno);
+			return TRUE;
+		}
+		if (pos && !strcmp(status->new.name, pos->new.name)) {
+			select_view_line(view, lineno);
+			return TRUE;
+		}
 
-	if (string_rev_is_null(commit->id))
-		string_ncopy(ref_commit, "HEAD", 4);
-	else
-		string_copy_rev(ref_commit, commit->id);
-}
+		/* Expand the directories of a file in a grouped section. */
+		if (status_line_is_dir(line) && status && status->status && section->grouped) {
+			struct status_dir *dir = line->data;
 
-static struct view_ops blame_ops = {
-	"line",
-	{ "blame" },
-	VIEW_ALWAYS_LINENO | VIEW_SEND_CHILD_ENTER,
-	sizeof(struct blame_state),
-	blame_open,
-	blame_read,
-	blame_draw,
-	blame_request,
-	blame_grep,
-	blame_select,
-};
+			if (!strncmp(status->new.name, dir->name, strlen(dir->name)) &&
+			    !status_is_expanded(section, dir->name)) {
+				if (!status_expand_path(section, status->new.name) ||
+				    !status_add_lines(view))
+					return FALSE;
+				return status_exists(view, status, type);
+			}
+		}
+	}
 
-/*
- * Branch backend
- */
+	return FALSE;
+}
 
-struct branch {
-	const struct ident *author;	/* Author of the last commit. */
-	struct time time;		/* Date of the last activity. */
-	char title[128];		/* First line of the commit message. */
-	const struct ref *ref;		/* Name and commit ID information. */
-};
+static bool
+status_update_prepare(struct io *io, enum line_type type)
+{
+	const char *staged_argv[] = {
+		"git", "update-index", "-z", "--index-info", NULL
+	};
+	const char *others_argv[] = {
+		"git", "update-index", "-z", "--add", "--remove", "--stdin", NULL
+	};
 
-static const struct ref branch_all;
-#define BRANCH_ALL_NAME	"All branches"
-#define branch_is_all(branch) ((branch)->ref == &branch_all)
+	switch (type) {
+	case LINE_STAT_STAGED:
+		return io_run(io, IO_WR, opt_cdup, opt_env, staged_argv);
 
-static const enum sort_field branch_sort_fields[] = {
-	ORDERBY_NAME, ORDERBY_DATE, ORDERBY_AUTHOR
-};
-static struct sort_state branch_sort_state = SORT_STATE(branch_sort_fields);
+	case LINE_STAT_UNSTAGED:
+	case LINE_STAT_UNTRACKED:
+		return io_run(io, IO_WR, opt_cdup, opt_env, others_argv);
 
-struct branch_state {
-	char id[SIZEOF_REV];
-	size_t max_ref_length;
-};
+	default:
+		die("line type %d not handled in switch", type);
+		return FALSE;
+	}
+}
 
-static int
-branch_compare(const void *l1, const void *l2)
+static bool
+status_update_write(struct io *io, struct status *status, enum line_type type)
 {
-	const struct branch *branch1 = ((const struct line *) l1)->data;
-	const struct branch *branch2 = ((const struct line *) l2)->data;
-
-	if (branch_is_all(branch1))
-		return -1;
-	else if (branch_is_all(branch2))
-		return 1;
-
-	switch (get_sort_field(branch_sort_state)) {
-	case ORDERBY_DATE:
-		return sort_order(branch_sort_state, timecmp(&branch1->time, &branch2->time));
+	switch (type) {
+	case LINE_STAT_STAGED:
+		return io_printf(io, "%06o %s\t%s%c", status->old.mode,
+				 status->old.rev, status->old.name, 0);
 
-	case ORDERBY_AUTHOR:
-		return sort_order(branch_sort_state, ident_compare(branch1->author, branch2->author));
+	case LINE_STAT_UNSTAGED:
+	case LINE_STAT_UNTRACKED:
+		return io_printf(io, "%s%c", status->new.name, 0);
 
-	case ORDERBY_NAME:
 	default:
-		return sort_order(branch_sort_state, strcmp(branch1->ref->name, branch2->ref->name));
+		die("line type %d not handled in switch", type);
+		return FALSE;
 	}
 }
 
 static bool
-branch_draw(struct view *view, struct line *line, unsigned int lineno)
+status_update_file(struct status *status, enum line_type type)
 {
-	struct branch_state *state = view->private;
-	struct branch *branch = line->data;
-	enum line_type type = branch_is_all(branch) ? LINE_DEFAULT : get_line_type_from_ref(branch->ref);
-	const char *branch_name = branch_is_all(branch) ? BRANCH_ALL_NAME : branch->ref->name;
-
-	if (draw_lineno(view, lineno))
-		return TRUE;
+	struct io io;
+	bool result;
 
-	if (draw_date(view, &branch->time))
-		return TRUE;
+	if (!status_update_prepare(&io, type))
+		return FALSE;
 
-	if (draw_author(view, branch->author))
-		return TRUE;
+	result = status_update_write(&io, status, type);
+	return io_done(&io) && result;
+}
 
-	if (draw_field(view, type, branch_name, state->max_ref_length, ALIGN_LEFT, FALSE))
-		return TRUE;
+/*
+ * Updating many files is done in the background, so that the paths can
+ * be streamed to git-update-index without blocking the UI.
+ */
 
-	if (draw_id(view, branch->ref->id))
-		return TRUE;
+static struct status_update {
+	struct io io;
+	bool running;
+	bool failed;
+	enum line_type type;
+	struct status *files;	/* Copied, since sections may be reloaded. */
+	size_t files_size;	/* Files to write, less when stopped. */
+	size_t total;
+	size_t file;		/* Next file to write. */
+	char buf[65536];	/* Paths not yet taken by the pipe. */
+	size_t bufpos;
+	size_t bufsize;
+} status_update_job;
 
-	draw_text(view, LINE_DEFAULT, branch->title);
+static bool
+status_update_is_running(struct view *view)
+{
+	if (!status_update_job.running)
+		return FALSE;
+	report("Files are still being updated, press %s to stop",
+	       get_view_key(view, REQ_STOP_LOADING));
 	return TRUE;
 }
 
-static enum request
-branch_request(struct view *view, enum request request, struct line *line)
+/* Stop writing paths. The files already written are still updated. */
+static bool
+status_update_stop(void)
 {
-	struct branch *branch = line->data;
+	struct status_update *job = &status_update_job;
 
-	switch (request) {
-	case REQ_REFRESH:
-		load_refs(TRUE);
-		refresh_view(view);
-		return REQ_NONE;
+	if (!job->running || job->file >= job->files_size)
+		return FALSE;
+	job->files_size = job->file;
+	return TRUE;
+}
 
-	case REQ_TOGGLE_SORT_FIELD:
-	case REQ_TOGGLE_SORT_ORDER:
-		sort_view(view, request, &branch_sort_state, branch_compare);
-		return REQ_NONE;
+static int
+status_update_format(char *buf, size_t bufsize, struct status *status, enum line_type type)
+{
+	if (type == LINE_STAT_STAGED)
+		return snprintf(buf, bufsize, "%06o %s\t%s%c", status->old.mode,
+				status->old.rev, status->old.name, 0);
+	return snprintf(buf, bufsize, "%s%c", status->new.name, 0);
+}
 
-	case REQ_ENTER:
-	{
-		const struct ref *ref = branch->ref;
-		const char *all_branches_argv[] = {
-			GIT_MAIN_LOG(encoding_arg, "", branch_is_all(branch) ? "--all" : ref->name, "")
-		};
-		struct view *main_view = VIEW(REQ_VIEW_MAIN);
+/* Write the buffered paths with one non-blocking write, refilling the
+ * buffer once the pipe has taken all of it. */
+static bool
+status_update_write_files(struct status_update *job)
+{
+	ssize_t size;
 
-		open_argv(view, main_view, all_branches_argv, NULL, OPEN_SPLIT);
-		return REQ_NONE;
-	}
-	case REQ_JUMP_COMMIT:
-	{
-		int lineno;
+	if (job->bufpos == job->bufsize) {
+		job->bufpos = job->bufsize = 0;
 
-		for (lineno = 0; lineno < view->lines; lineno++) {
-			struct branch *branch = view->line[lineno].data;
+		while (job->file < job->files_size) {
+			struct status *status = &job->files[job->file];
+			size_t bufleft = sizeof(job->buf) - job->bufsize;
+			int len = status_update_format(job->buf + job->bufsize, bufleft,
+						       status, job->type);
 
-			if (!strncasecmp(branch->ref->id, opt_search, strlen(opt_search))) {
-				select_view_line(view, lineno);
-				report_clear();
-				return REQ_NONE;
-			}
+			if (len < 0 || (len >= bufleft && !job->bufsize))
+				return FALSE;
+			if (len >= bufleft)
+				break;
+			job->bufsize += len;
+			job->file++;
 		}
 	}
-	default:
-		return request;
-	}
-}
 
-static bool
-branch_read(struct view *view, char *line)
-{
-	struct branch_state *state = view->private;
-	const char *title = NULL;
-	const struct ident *author = NULL;
-	struct time time = {};
-	size_t i;
+	size = io_write_some(&job->io, job->buf + job->bufpos, job->bufsize - job->bufpos);
+	if (size < 0)
+		return FALSE;
+	job->bufpos += size;
+	return TRUE;
+}
 
-	if (!line)
-		return TRUE;
+static void
+status_update_done(struct status_update *job)
+{
+	struct view *status_view = VIEW(REQ_VIEW_STATUS);
+	struct view *stage_view = VIEW(REQ_VIEW_STAGE);
+	size_t files = job->file;
+	bool stopped = job->file < job->total;
 
-	switch (get_line_type(line)) {
-	case LINE_COMMIT:
-		string_copy_rev_from_commit_line(state->id, line);
-		return TRUE;
+	if (!io_done(&job->io) || job->failed)
+		report("Failed to update file status");
+	else if (stopped)
+		report("Stopped after updating %zu of %zu files", files, job->total);
+	else
+		report("Updated %zu files", files);
 
-	case LINE_AUTHOR:
-		parse_author_line(line + STRING_SIZE("author "), &author, &time);
-		break;
+	free(job->files);
+	memset(job, 0, sizeof(*job));
 
-	default:
-		title = line + STRING_SIZE("title ");
+	if (status_view->lines)
+		status_reload(status_view, WATCH_INDEX);
+	if (view_is_displayed(status_view)) {
+		redraw_view(status_view);
+		update_view_title(status_view);
 	}
+	if (view_is_displayed(stage_view) && stage_view->parent == status_view)
+		refresh_view(stage_view);
+}
 
-	for (i = 0; i < view->lines; i++) {
-		struct branch *branch = view->line[i].data;
+static bool
+status_update_poll(void *data)
+{
+	struct status_update *job = &status_update_job;
+	struct view *view = VIEW(REQ_VIEW_STATUS);
+	bool success = TRUE;
 
-		if (strcmp(branch->ref->id, state->id))
-			continue;
+	if (!job->running)
+		return FALSE;
 
-		if (author) {
-			branch->author = author;
-			branch->time = time;
+	if (job->bufpos < job->bufsize || job->file < job->files_size) {
+		if (!status_update_write_files(job)) {
+			job->failed = TRUE;
+			job->files_size = job->file;
+			job->bufpos = job->bufsize;
 		}
+	}
 
-		if (title)
-			string_expand(branch->title, sizeof(branch->title), title, 1);
-
-		view->line[i].dirty = TRUE;
+	if (job->bufpos < job->bufsize || job->file < job->files_size) {
+		if (!view_is_displayed(view))
+			view = VIEW(REQ_VIEW_STAGE);
+		if (view_is_displayed(view)) {
+			string_format(view->ref, "updating file %zu of %zu (%zu%% done)",
+				      job->file, job->total, job->file * 100 / job->total);
+			update_view_title(view);
+		}
+		return TRUE;
 	}
 
-	return TRUE;
+	/* End the input and let git-update-index write the index. */
+	io_close(&job->io);
+	if (!io_exited(&job->io, &success))
+		return TRUE;
+	if (!success)
+		job->failed = TRUE;
+
+	status_update_done(job);
+	return FALSE;
 }
 
+/* Update the files in a range of a section in the background. */
 static bool
-branch_open_visitor(void *data, const struct ref *ref)
+status_update_files(struct view *view, enum line_type type, size_t from, size_t to)
 {
-	struct view *view = data;
-	struct branch_state *state = view->private;
-	struct branch *branch;
-	bool is_all = ref == &branch_all;
-	size_t ref_length;
+	struct status_section *section = status_get_section(type);
+	struct status_update *job = &status_update_job;
 
-	if (ref->tag || ref->ltag)
+	if (from >= to)
 		return TRUE;
 
-	if (!add_line_alloc(view, &branch, LINE_DEFAULT, 0, is_all))
+	memset(job, 0, sizeof(*job));
+	job->files = calloc(to - from, sizeof(*job->files));
+	if (!job->files)
 		return FALSE;
+	memcpy(job->files, &section->files[from], (to - from) * sizeof(*job->files));
 
-	ref_length = is_all ? STRING_SIZE(BRANCH_ALL_NAME) : strlen(ref->name);
-	if (ref_length > state->max_ref_length)
-		state->max_ref_length = ref_length;
+	if (!status_update_prepare(&job->io, type) ||
+	    !background_add(status_update_poll, NULL)) {
+		io_done(&job->io);
+		free(job->files);
+		job->files = NULL;
+		return FALSE;
+	}
 
-	branch->ref = ref;
+	job->type = type;
+	job->files_size = job->total = to - from;
+	job->running = TRUE;
 	return TRUE;
 }
 
 static bool
-branch_open(struct view *view, enum open_flags flags)
+status_update(struct view *view)
 {
-	const char *branch_log[] = {
-		"git", "log", encoding_arg, "--no-color", "--date=raw",
-			"--pretty=format:commit %H%nauthor %an <%ae> %ad%ntitle %s",
-			"--all", "--simplify-by-decoration", NULL
-	};
+	struct line *line = &view->line[view->pos.lineno];
+	struct status_section *section = status_get_section(line->type);
 
-	if (!begin_update(view, NULL, branch_log, OPEN_RELOAD)) {
-		report("Failed to load branch data");
+	assert(view->lines);
+
+	if (status_line_is_dir(line)) {
+		struct status_dir *dir = line->data;
+
+		if (!status_update_files(view, line->type, dir->from, dir->to)) {
+			report("Failed to update file status");
+			return FALSE;
+		}
+
+	} else if (!line->data) {
+		if (status_has_none(view, line)) {
+			report("Nothing to update");
+			return FALSE;
+		}
+
+		if (!status_update_files(view, line->type, 0, section->size)) {
+			report("Failed to update file status");
+			return FALSE;
+		}
+
+	} else if (!status_update_file(line->data, line->type)) {
+		report("Failed to update file status");
 		return FALSE;
 	}
 
-	branch_open_visitor(view, &branch_all);
-	foreach_ref(branch_open_visitor, view);
-
 	return TRUE;
 }
 
 static bool
-branch_grep(struct view *view, struct line *line)
+status_revert(struct status *status, enum line_type type, bool has_none)
 {
-	struct branch *branch = line->data;
-	const char *text[] = {
-		branch->ref->name,
-		mkauthor(branch->author, opt_author_width, opt_author),
-		NULL
-	};
+	if (!status || type != LINE_STAT_UNSTAGED) {
+		if (type == LINE_STAT_STAGED) {
+			report("Cannot revert changes to staged files");
+		} else if (type == LINE_STAT_UNTRACKED) {
+			report("Cannot revert changes to untracked files");
+		} else if (has_none) {
+			report("Nothing to revert");
+		} else {
+			report("Cannot revert changes to multiple files");
+		}
 
-	return grep_text(view, text);
-}
+	} else if (prompt_yesno("Are you sure you want to revert changes?")) {
+		char mode[10] = "100644";
+		const char *reset_argv[] = {
+			"git", "update-index", "--cacheinfo", mode,
+				status->old.rev, status->old.name, NULL
+		};
+		const char *checkout_argv[] = {
+			"git", "checkout", "--", status->old.name, NULL
+		};
 
-static void
-branch_select(struct view *view, struct line *line)
-{
-	struct branch *branch = line->data;
+		if (status->status == 'U') {
+			string_format(mode, "%5o", status->old.mode);
 
-	if (branch_is_all(branch)) {
-		string_copy(view->ref, BRANCH_ALL_NAME);
-		return;
+			if (status->old.mode == 0 && status->new.mode == 0) {
+				reset_argv[2] = "--force-remove";
+				reset_argv[3] = status->old.name;
+				reset_argv[4] = NULL;
+			}
+
+			if (!io_run_fg(reset_argv, opt_cdup))
+				return FALSE;
+			if (status->old.mode == 0 && status->new.mode == 0)
+				return TRUE;
+		}
+
+		return io_run_fg(checkout_argv, opt_cdup);
 	}
-	string_copy_rev(view->ref, branch->ref->id);
-	string_copy_rev(ref_commit, branch->ref->id);
-	string_copy_rev(ref_head, branch->ref->id);
-	string_copy_rev(ref_branch, branch->ref->name);
-}
 
-static struct view_ops branch_ops = {
-	"branch",
-	{ "branch" },
-	VIEW_NO_FLAGS,
-	sizeof(struct branch_state),
-	branch_open,
-	branch_read,
-	branch_draw,
-	branch_request,
-	branch_grep,
-	branch_select,
-};
+	return FALSE;
+}
 
-/*
- * Status backend
- */
+static enum request
+status_request(struct view *view, enum request request, struct line *line)
+{
+	struct status *status = status_line_file(line);
 
-struct status {
-	char status;
-	struct {
-		mode_t mode;
-		char rev[SIZEOF_REV];
-		char name[SIZEOF_STR];
-	} old;
-	struct {
-		mode_t mode;
-		char rev[SIZEOF_REV];
-		char name[SIZEOF_STR];
-	} new;
-};
+	switch (request) {
+	case REQ_STATUS_UPDATE:
+		if (status_update_is_running(view) || !status_update(view))
+			return REQ_NONE;
+		/* The view is reloaded when the files have been updated. */
+		if (status_update_job.running)
+			return REQ_NONE;
+		break;
 
-static char status_onbranch[SIZEOF_STR];
-static struct status stage_status;
-static enum line_type stage_line_type;
+	case REQ_STATUS_REVERT:
+		if (status_update_is_running(view) ||
+		    !status_revert(status, line->type, status_has_none(view, line)))
+			return REQ_NONE;
+		break;
 
-DEFINE_ALLOCATOR(realloc_ints, int, 32)
+	case REQ_STATUS_MERGE:
+		if (!status || status->status != 'U') {
+			report("Merging only possible for files with unmerged status ('U').");
+			return REQ_NONE;
+		}
+		open_mergetool(status->new.name);
+		break;
 
-/* This should work even for the "On branch" line. */
-static inline bool
-status_has_none(struct view *view, struct line *line)
-{
-	return view_has_line(view, line) && !line[1].data;
-}
+	case REQ_EDIT:
+		if (!status)
+			return request;
+		if (status->status == 'D') {
+			report("File has been deleted.");
+			return REQ_NONE;
+		}
 
-/* Get fields from the diff line:
- * :100644 100644 06a5d6ae9eca55be2e0e585a152e6b1336f2b20e 0000000000000000000000000000000000000000 M
- */
-static inline bool
-status_get_diff(struct status *file, const char *buf, size_t bufsize)
-{
-	const char *old_mode = buf +  1;
-	const char *new_mode = buf +  8;
-	const char *old_rev  = buf + 15;
-	const char *new_rev  = buf + 56;
-	const char *status   = buf + 97;
+		open_editor(status->new.name, 0);
+		break;
 
-	if (bufsize < 98 ||
-	    old_mode[-1] != ':' ||
-	    new_mode[-1] != ' ' ||
-	    old_rev[-1]  != ' ' ||
-	    new_rev[-1]  != ' ' ||
-	    status[-1]   != ' ')
-		return FALSE;
+	case REQ_VIEW_BLAME:
+		if (status)
+			opt_ref[0] = 0;
+		return request;
 
-	file->status = *status;
+	case REQ_ENTER:
+		/* After returning the status view has been split to
+		 * show the stage view. No further reloading is
+		 * necessary. */
+		return status_enter(view, line);
 
-	string_copy_rev(file->old.rev, old_rev);
-	string_copy_rev(file->new.rev, new_rev);
+	case REQ_REFRESH:
+		/* Load the current branch information and then the view. */
+		load_refs(TRUE);
+		break;
 
-	file->old.mode = strtoul(old_mode, NULL, 8);
-	file->new.mode = strtoul(new_mode, NULL, 8);
+	default:
+		return request;
+	}
 
-	file->old.name[0] = file->new.name[0] = 0;
+	refresh_view(view);
 
-	return TRUE;
+	return REQ_NONE;
 }
 
 static bool
-status_run(struct view *view, const char *argv[], char status, enum line_type type)
+status_stage_info_(char *buf, size_t bufsize,
+		   enum line_type type, struct status *status)
 {
-	struct status *unmerged = NULL;
-	char *buf;
-	struct io io;
+	const char *file = status ? status->new.name : "";
+	const char *info;
+
+	switch (type) {
+	case LINE_STAT_STAGED:
+		if (status && status->status)
+			info = "Staged changes to %s";
+		else
+			info = "Staged changes";
+		break;
+
+	case LINE_STAT_UNSTAGED:
+		if (status && status->status)
+			info = "Unstaged changes to %s";
+		else
+			info = "Unstaged changes";
+		break;
 
-	if (!io_run(&io, IO_RD, opt_cdup, opt_env, argv))
-		return FALSE;
+	case LINE_STAT_UNTRACKED:
+		info = "Untracked file %s";
+		break;
 
-	add_line_nodata(view, type);
+	case LINE_STAT_HEAD:
+	default:
+		info = "";
+	}
 
-	while ((buf = io_get(&io, 0, TRUE))) {
-		struct status *file = unmerged;
+	return string_nformat(buf, bufsize, NULL, info, file);
+}
+#define status_stage_info(buf, type, status) \
+	status_stage_info_(buf, sizeof(buf), type, status)
 
-		if (!file) {
-			if (!add_line_alloc(view, &file, type, 0, FALSE))
-				goto error_out;
-		}
+static void
+status_select(struct view *view, struct line *line)
+{
+	struct status *status = status_line_file(line);
+	char file[SIZEOF_STR] = "all files";
+	const char *text;
+	const char *key;
 
-		/* Parse diff info part. */
-		if (status) {
-			file->status = status;
-			if (status == 'A')
-				string_copy(file->old.rev, NULL_ID);
+	if (line->data && !string_format(file, "'%s'", status_line_name(line)))
+		return;
 
-		} else if (!file->status || file == unmerged) {
-			if (!status_get_diff(file, buf, strlen(buf)))
-				goto error_out;
+	if (!line->data && line[1].type == LINE_STAT_NONE)
+		line++;
 
-			buf = io_get(&io, 0, TRUE);
-			if (!buf)
-				break;
+	switch (line->type) {
+	case LINE_STAT_STAGED:
+		text = "Press %s to unstage %s for commit";
+		break;
 
-			/* Collapse all modified entries that follow an
-			 * associated unmerged entry. */
-			if (unmerged == file) {
-				unmerged->status = 'U';
-				unmerged = NULL;
-			} else if (file->status == 'U') {
-				unmerged = file;
-			}
-		}
+	case LINE_STAT_UNSTAGED:
+		text = "Press %s to stage %s for commit";
+		break;
 
-		/* Grab the old name for rename/copy. */
-		if (!*file->old.name &&
-		    (file->status == 'R' || file->status == 'C')) {
-			string_ncopy(file->old.name, buf, strlen(buf));
+	case LINE_STAT_UNTRACKED:
+		text = "Press %s to stage %s for addition";
+		break;
 
-			buf = io_get(&io, 0, TRUE);
-			if (!buf)
-				break;
-		}
+	case LINE_STAT_HEAD:
+	case LINE_STAT_NONE:
+		text = "Nothing to update";
+		break;
 
-		/* git-ls-files just delivers a NUL separated list of
-		 * file names similar to the second half of the
-		 * git-diff-* output. */
-		string_ncopy(file->new.name, buf, strlen(buf));
-		if (!*file->old.name)
-			string_copy(file->old.name, file->new.name);
-		file = NULL;
+	default:
+		die("line type %d not handled in switch", line->type);
 	}
 
-	if (io_error(&io)) {
-error_out:
-		io_done(&io);
-		return FALSE;
-	}
+	if (status && status->status == 'U') {
+		text = "Press %s to resolve conflict in %s";
+		key = get_view_key(view, REQ_STATUS_MERGE);
 
-	if (!view->line[view->lines - 1].data)
-		add_line_nodata(view, LINE_STAT_NONE);
+	} else {
+		key = get_view_key(view, REQ_STATUS_UPDATE);
+	}
 
-	io_done(&io);
-	return TRUE;
+	string_format(view->ref, text, key, file);
+	status_stage_info(ref_status, line->type, status);
+	if (status)
+		string_ncopy(opt_file, status->new.name, strlen(status->new.name));
 }
 
-static const char *status_diff_index_argv[] = { GIT_DIFF_STAGED_FILES("-z") };
-static const char *status_diff_files_argv[] = { GIT_DIFF_UNSTAGED_FILES("-z") };
-
-static const char *status_list_other_argv[] = {
-	"git", "ls-files", "-z", "--others", "--exclude-standard", opt_prefix, NULL, NULL,
-};
-
-static const char *status_list_no_head_argv[] = {
-	"git", "ls-files", "-z", "--cached", "--exclude-standard", NULL
-};
-
-static const char *update_index_argv[] = {
-	"git", "update-index", "-q", "--unmerged", "--refresh", NULL
-};
-
-/* Restore the previous line number to stay in the context or select a
- * line with something that can be updated. */
-static void
-status_restore(struct view *view)
+static bool
+status_grep(struct view *view, struct line *line)
 {
-	if (!check_position(&view->prev_pos))
-		return;
-
-	if (view->prev_pos.lineno >= view->lines)
-		view->prev_pos.lineno = view->lines - 1;
-	while (view->prev_pos.lineno < view->lines && !view->line[view->prev_pos.lineno].data)
-		view->prev_pos.lineno++;
-	while (view->prev_pos.lineno > 0 && !view->line[view->prev_pos.lineno].data)
-		view->prev_pos.lineno--;
+	struct status *status = status_line_file(line);
+	const char *name = status_line_name(line);
 
-	/* If the above fails, always skip the "On branch" line. */
-	if (view->prev_pos.lineno < view->lines)
-		view->pos.lineno = view->prev_pos.lineno;
-	else
-		view->pos.lineno = 1;
+	if (name) {
+		const char buf[2] = { status ? status->status : 0, 0 };
+		const char *text[] = { name, buf, NULL };
 
-	if (view->prev_pos.offset > view->pos.lineno)
-		view->pos.offset = view->pos.lineno;
-	else if (view->prev_pos.offset < view->lines)
-		view->pos.offset = view->prev_pos.offset;
+		return grep_text(view, text);
+	}
 
-	clear_position(&view->prev_pos);
+	return FALSE;
 }
 
-static void
-status_update_onbranch(void)
-{
-	static const char *paths[][2] = {
-		{ "rebase-apply/rebasing",	"Rebasing" },
-		{ "rebase-apply/applying",	"Applying mailbox" },
-		{ "rebase-apply/",		"Rebasing mailbox" },
-		{ "rebase-merge/interactive",	"Interactive rebase" },
-		{ "rebase-merge/",		"Rebase merge" },
-		{ "MERGE_HEAD",			"Merging" },
-		{ "BISECT_LOG",			"Bisecting" },
-		{ "HEAD",			"On branch" },
-	};
-	char buf[SIZEOF_STR];
-	struct stat stat;
-	int i;
-
-	if (is_initial_commit()) {
-		string_copy(status_onbranch, "Initial commit");
-		return;
-	}
+static struct view_ops status_ops = {
+	"file",
+	{ "status" },
+	VIEW_CUSTOM_STATUS | VIEW_SEND_CHILD_ENTER | VIEW_STATUS_LIKE,
+	0,
+	status_open,
+	NULL,
+	status_draw,
+	status_request,
+	status_grep,
+	status_select,
+	status_done,
+};
 
-	for (i = 0; i < ARRAY_SIZE(paths); i++) {
-		char *head = opt_head;
 
-		if (!string_format(buf, "%s/%s", opt_git_dir, paths[i][0]) ||
-		    lstat(buf, &stat) < 0)
-			continue;
+struct stage_state {
+	struct diff_state diff;
+	size_t selected;	/* Lines selected with stage-select-line. */
+	bool updated;		/* Lines were updated in place. */
+};
 
-		if (!*opt_head) {
-			struct io io;
+#define STAGE_LINE_SELECTED	2
 
-			if (io_open(&io, "%s/rebase-merge/head-name", opt_git_dir) &&
-			    io_read_buf(&io, buf, sizeof(buf))) {
-				head = buf;
-				if (!prefixcmp(head, "refs/heads/"))
-					head += STRING_SIZE("refs/heads/");
-			}
-		}
+#define stage_line_is_change(line) \
+	((line)->type == LINE_DIFF_ADD || (line)->type == LINE_DIFF_DEL)
+#define stage_line_is_selected(line) \
+	((line)->user_flags & STAGE_LINE_SELECTED)
 
-		if (!string_format(status_onbranch, "%s %s", paths[i][1], head))
-			string_copy(status_onbranch, opt_head);
-		return;
+static bool
+stage_diff_write(struct io *io, struct line *line, struct line *end)
+{
+	while (line < end) {
+		if (!io_write(io, line->data, strlen(line->data)) ||
+		    !io_write(io, "\n", 1))
+			return FALSE;
+		line++;
+		if (line->type == LINE_DIFF_CHUNK ||
+		    line->type == LINE_DIFF_HEADER)
+			break;
 	}
 
-	string_copy(status_onbranch, "Not currently on any branch");
+	return TRUE;
 }
 
-/* First parse staged info using git-diff-index(1), then parse unstaged
- * info using git-diff-files(1), and finally untracked files using
- * git-ls-files(1). */
 static bool
-status_open(struct view *view, enum open_flags flags)
+stage_apply_chunk(struct view *view, struct line *chunk, struct line *line, bool revert)
 {
-	const char **staged_argv = is_initial_commit() ?
-		status_list_no_head_argv : status_diff_index_argv;
-	char staged_status = staged_argv == status_list_no_head_argv ? 'A' : 0;
+	const char *apply_argv[SIZEOF_ARG] = {
+		"git", "apply", "--whitespace=nowarn", NULL
+	};
+	struct line *diff_hdr;
+	struct io io;
+	int argc = 3;
 
-	if (opt_is_inside_work_tree == FALSE) {
-		report("The status view requires a working tree");
+	diff_hdr = find_prev_line_by_type(view, chunk, LINE_DIFF_HEADER);
+	if (!diff_hdr)
 		return FALSE;
-	}
 
-	reset_view(view);
+	if (!revert)
+		apply_argv[argc++] = "--cached";
+	if (line != NULL)
+		apply_argv[argc++] = "--unidiff-zero";
+	if (revert || stage_line_type == LINE_STAT_STAGED)
+		apply_argv[argc++] = "-R";
+	apply_argv[argc++] = "-";
+	apply_argv[argc++] = NULL;
+	if (!io_run(&io, IO_WR, opt_cdup, opt_env, apply_argv))
+		return FALSE;
 
-	add_line_nodata(view, LINE_STAT_HEAD);
-	status_update_onbranch();
+	if (line != NULL) {
+		unsigned long lineno = 0;
+		struct line *context = chunk + 1;
+		const char *markers[] = {
+			line->type == LINE_DIFF_DEL ? ""   : ",0",
+			line->type == LINE_DIFF_DEL ? ",0" : "",
+		};
 
-	io_run_bg(update_index_argv);
+		parse_chunk_lineno(&lineno, chunk->data, line->type == LINE_DIFF_DEL ? '+' : '-');
 
-	status_list_other_argv[ARRAY_SIZE(status_list_other_argv) - 2] =
-		opt_untracked_dirs_content ? NULL : "--directory";
+		while (context < line) {
+			if (context->type == LINE_DIFF_CHUNK || context->type == LINE_DIFF_HEADER) {
+				break;
+			} else if (context->type != LINE_DIFF_DEL && context->type != LINE_DIFF_ADD) {
+				lineno++;
+			}
+			context++;
+		}
 
-	if (!status_run(view, staged_argv, staged_status, LINE_STAT_STAGED) ||
-	    !status_run(view, status_diff_files_argv, 0, LINE_STAT_UNSTAGED) ||
-	    !status_run(view, status_list_other_argv, '?', LINE_STAT_UNTRACKED)) {
-		report("Failed to load status data");
-		return FALSE;
+		if (!stage_diff_write(&io, diff_hdr, chunk) ||
+		    !io_printf(&io, "@@ -%lu%s +%lu%s @@\n",
+			       lineno, markers[0], lineno, markers[1]) ||
+		    !stage_diff_write(&io, line, line + 1)) {
+			chunk = NULL;
+		}
+	} else {
+		if (!stage_diff_write(&io, diff_hdr, chunk) ||
+		    !stage_diff_write(&io, chunk, view->line + view->lines))
+			chunk = NULL;
 	}
 
-	/* Restore the exact position or use the specialized restore
-	 * mode? */
-	status_restore(view);
-	return TRUE;
-}
-
-static bool
-status_draw(struct view *view, struct line *line, unsigned int lineno)
-{
-	struct status *status = line->data;
-	enum line_type type;
-	const char *text;
+	io_done(&io);
 
-	if (!status) {
-		switch (line->type) {
-		case LINE_STAT_STAGED:
-			type = LINE_STAT_SECTION;
-			text = "Changes to be committed:";
-			break;
+	return chunk ? TRUE : FALSE;
+}
 
-		case LINE_STAT_UNSTAGED:
-			type = LINE_STAT_SECTION;
-			text = "Changed but not updated:";
-			break;
+static void
+stage_select_line(struct view *view, struct line *line, bool select)
+{
+	struct stage_state *state = view->private;
 
-		case LINE_STAT_UNTRACKED:
-			type = LINE_STAT_SECTION;
-			text = "Untracked files:";
-			break;
+	if (!stage_line_is_selected(line) == !select)
+		return;
+	if (select) {
+		line->user_flags |= STAGE_LINE_SELECTED;
+		state->selected++;
+	} else {
+		line->user_flags &= ~STAGE_LINE_SELECTED;
+		state->selected--;
+	}
+}
 
-		case LINE_STAT_NONE:
-			type = LINE_DEFAULT;
-			text = "  (no files)";
-			break;
+/* Toggle the selection of a change, or of all changes in a chunk. */
+static void
+stage_select(struct view *view, struct line *line)
+{
+	struct stage_state *state = view->private;
+	struct line *pos;
+	bool select = FALSE;
 
-		case LINE_STAT_HEAD:
-			type = LINE_STAT_HEAD;
-			text = status_onbranch;
-			break;
+	if (line->type != LINE_DIFF_CHUNK) {
+		stage_select_line(view, line, !stage_line_is_selected(line));
 
-		default:
-			return FALSE;
-		}
 	} else {
-		static char buf[] = { '?', ' ', ' ', ' ', 0 };
+		for (pos = line + 1; view_has_line(view, pos); pos++) {
+			if (pos->type == LINE_DIFF_CHUNK || pos->type == LINE_DIFF_HEADER)
+				break;
+			if (stage_line_is_change(pos) && !stage_line_is_selected(pos))
+				select = TRUE;
+		}
 
-		buf[0] = status->status;
-		if (draw_text(view, line->type, buf))
-			return TRUE;
-		type = LINE_DEFAULT;
-		text = status->new.name;
+		for (pos = line + 1; view_has_line(view, pos); pos++) {
+			if (pos->type == LINE_DIFF_CHUNK || pos->type == LINE_DIFF_HEADER)
+				break;
+			if (stage_line_is_change(pos))
+				stage_select_line(view, pos, select);
+		}
 	}
 
-	draw_text(view, type, text);
-	return TRUE;
+	redraw_view(view);
+	if (state->selected)
+		report("%zu lines selected, press %s to update them", state->selected,
+		       get_view_key(view, REQ_STATUS_UPDATE));
+	else
+		report("No lines selected");
 }
 
-static enum request
-status_enter(struct view *view, struct line *line)
+/* Write the selected changes of a chunk. Changes that are not selected
+ * become context if they are part of the file being patched, and are
+ * left out otherwise. The chunk header is made to match, with @delta
+ * holding the offset caused by the previous chunks of the file. */
+static bool
+stage_diff_write_selected(struct io *io, struct view *view, struct line *chunk,
+			  bool reverse, long *delta)
 {
-	struct status *status = line->data;
-	enum open_flags flags = view_is_displayed(view) ? OPEN_SPLIT : OPEN_DEFAULT;
+	struct chunk_header header;
+	struct chunk_header_position *target, *other;
+	unsigned long other_lines = 0, first;
+	char keep_marker = reverse ? '+' : '-';
+	char other_marker = reverse ? '-' : '+';
+	struct line *line;
+	bool kept = FALSE;
+	int pass;
 
-	if (line->type == LINE_STAT_NONE ||
-	    (!status && line[1].type == LINE_STAT_NONE)) {
-		report("No file to diff");
-		return REQ_NONE;
-	}
+	if (!parse_chunk_header(&header, chunk->data))
+		return FALSE;
 
-	switch (line->type) {
-	case LINE_STAT_STAGED:
-	case LINE_STAT_UNSTAGED:
-		break;
+	target = reverse ? &header.new : &header.old;
+	other = reverse ? &header.old : &header.new;
 
-	case LINE_STAT_UNTRACKED:
-		if (!status) {
-			report("No file to show");
-			return REQ_NONE;
-		}
+	for (pass = 0; pass < 2; pass++) {
+		for (line = chunk + 1; view_has_line(view, line); line++) {
+			const char *text = line->data;
+			char marker = *text;
 
-	    	if (!suffixcmp(status->new.name, -1, "/")) {
-			report("Cannot display a directory");
-			return REQ_NONE;
+			if (line->type == LINE_DIFF_CHUNK || line->type == LINE_DIFF_HEADER)
+				break;
+
+			if (marker == '\\') {
+				if (!kept)
+					continue;
+			} else if (stage_line_is_change(line) && !stage_line_is_selected(line)) {
+				kept = marker == keep_marker;
+				if (!kept)
+					continue;
+				marker = ' ';
+			} else {
+				kept = TRUE;
+			}
+
+			if (!pass) {
+				if (marker == ' ' || marker == other_marker)
+					other_lines++;
+			} else if (!io_write(io, &marker, 1) ||
+				   !io_write(io, text + 1, strlen(text + 1)) ||
+				   !io_write(io, "\n", 1)) {
+				return FALSE;
+			}
 		}
-		break;
 
-	case LINE_STAT_HEAD:
-		return REQ_NONE;
+		if (pass)
+			break;
 
-	default:
-		die("line type %d not handled in switch", line->type);
-	}
+		/* A position refers to the line before when there are none. */
+		first = target->position + !target->lines + *delta;
+		other->position = first - !other_lines;
+		other->lines = other_lines;
+		*delta += (long) other->lines - (long) target->lines;
 
-	if (status) {
-		stage_status = *status;
-	} else {
-		memset(&stage_status, 0, sizeof(stage_status));
+		if (!io_printf(io, "@@ -%lu,%lu +%lu,%lu @@\n",
+			       header.old.position, header.old.lines,
+			       header.new.position, header.new.lines))
+			return FALSE;
 	}
 
-	stage_line_type = line->type;
-
-	open_view(view, REQ_VIEW_STAGE, flags);
-	return REQ_NONE;
+	return TRUE;
 }
 
 static bool
-status_exists(struct view *view, struct status *status, enum line_type type)
+stage_chunk_has_selected(struct view *view, struct line *chunk)
 {
-	unsigned long lineno;
-
-	for (lineno = 0; lineno < view->lines; lineno++) {
-		struct line *line = &view->line[lineno];
-		struct status *pos = line->data;
+	struct line *line;
 
-		if (line->type != type)
-			continue;
-		if (!pos && (!status || !status->status) && line[1].data) {
-			select_view_line(view, lineno);
-			return TRUE;
-		}
-		if (pos && !strcmp(status->new.name, pos->new.name)) {
-			select_view_line(view, lineno);
+	for (line = chunk + 1; view_has_line(view, line); line++) {
+		if (line->type == LINE_DIFF_CHUNK || line->type == LINE_DIFF_HEADER)
+			break;
+		if (stage_line_is_selected(line))
 			return TRUE;
-		}
 	}
 
 	return FALSE;
 }
 
-
+/* Apply the selected lines of all chunks as one patch. */
 static bool
-status_update_prepare(struct io *io, enum line_type type)
+stage_apply_selected(struct view *view, bool revert)
 {
-	const char *staged_argv[] = {
-		"git", "update-index", "-z", "--index-info", NULL
-	};
-	const char *others_argv[] = {
-		"git", "update-index", "-z", "--add", "--remove", "--stdin", NULL
+	const char *apply_argv[SIZEOF_ARG] = {
+		"git", "apply", "--whitespace=nowarn", "--unidiff-zero", NULL
 	};
+	bool reverse = revert || stage_line_type == LINE_STAT_STAGED;
+	struct line *diff_hdr = NULL;
+	bool diff_hdr_written = FALSE;
+	long delta = 0;
+	bool ok = TRUE;
+	struct io io;
+	int argc = 4;
+	size_t i;
 
-	switch (type) {
-	case LINE_STAT_STAGED:
-		return io_run(io, IO_WR, opt_cdup, opt_env, staged_argv);
+	if (!revert)
+		apply_argv[argc++] = "--cached";
+	if (reverse)
+		apply_argv[argc++] = "-R";
+	apply_argv[argc++] = "-";
+	apply_argv[argc++] = NULL;
+	if (!io_run(&io, IO_WR, opt_cdup, opt_env, apply_argv))
+		return FALSE;
 
-	case LINE_STAT_UNSTAGED:
-	case LINE_STAT_UNTRACKED:
-		return io_run(io, IO_WR, opt_cdup, opt_env, others_argv);
+	for (i = 0; ok && i < view->lines; i++) {
+		struct line *line = &view->line[i];
 
-	default:
-		die("line type %d not handled in switch", type);
-		return FALSE;
+		if (line->type == LINE_DIFF_HEADER) {
+			diff_hdr = line;
+			diff_hdr_written = FALSE;
+			delta = 0;
+
+		} else if (line->type == LINE_DIFF_CHUNK && diff_hdr &&
+			   stage_chunk_has_selected(view, line)) {
+			if (!diff_hdr_written)
+				ok = stage_diff_write(&io, diff_hdr, line);
+			diff_hdr_written = TRUE;
+			ok = ok && stage_diff_write_selected(&io, view, line, reverse, &delta);
+		}
 	}
+
+	return io_done(&io) && ok;
 }
 
-static bool
-status_update_write(struct io *io, struct status *status, enum line_type type)
+static void
+stage_remove_lines(struct view *view, size_t from, size_t to)
 {
-	switch (type) {
-	case LINE_STAT_STAGED:
-		return io_printf(io, "%06o %s\t%s%c", status->old.mode,
-				 status->old.rev, status->old.name, 0);
-
-	case LINE_STAT_UNSTAGED:
-	case LINE_STAT_UNTRACKED:
-		return io_printf(io, "%s%c", status->new.name, 0);
+	size_t i;
 
-	default:
-		die("line type %d not handled in switch", type);
-		return FALSE;
-	}
+	for (i = from; i < to; i++)
+		free(view->line[i].data);
 }
 
+/* Format a chunk header like git, which leaves out the line count of a
+ * side with a single line. */
 static bool
-status_update_file(struct status *status, enum line_type type)
+stage_format_chunk_header(char buf[SIZEOF_STR], struct chunk_header *header,
+			  const char *context)
 {
-	struct io io;
-	bool result;
-
-	if (!status_update_prepare(&io, type))
-		return FALSE;
+	size_t bufpos = 0;
 
-	result = status_update_write(&io, status, type);
-	return io_done(&io) && result;
+	return string_nformat(buf, SIZEOF_STR, &bufpos, "@@ -%lu", header->old.position) &&
+	       (header->old.lines == 1 ||
+		string_nformat(buf, SIZEOF_STR, &bufpos, ",%lu", header->old.lines)) &&
+	       string_nformat(buf, SIZEOF_STR, &bufpos, " +%lu", header->new.position) &&
+	       (header->new.lines == 1 ||
+		string_nformat(buf, SIZEOF_STR, &bufpos, ",%lu", header->new.lines)) &&
+	       string_nformat(buf, SIZEOF_STR, &bufpos, " @@%s", context);
 }
 
-static bool
-status_update_files(struct view *view, struct line *line)
-{
-	char buf[sizeof(view->ref)];
-	struct io io;
-	bool result = TRUE;
-	struct line *pos;
-	int files = 0;
-	int file, done;
-	int cursor_y = -1, cursor_x = -1;
+static void
+stage_update_chunk(struct view *view, size_t chunk, size_t end,
+		   struct chunk_header *header, long *delta, bool reverse)
+{
+	struct chunk_header_position *target = reverse ? &header->new : &header->old;
+	unsigned long old_lines = 0, new_lines = 0, target_lines;
+	unsigned long first = target->position + !target->lines + *delta;
+	const char *text = view->line[chunk].data;
+	const char *context = strstr(text + 2, "@@");
+	char buf[SIZEOF_STR];
+	size_t i;
 
-	if (!status_update_prepare(&io, line->type))
-		return FALSE;
+	for (i = chunk + 1; i < end; i++) {
+		const char *data = view->line[i].data;
+
+		if (*data == ' ' || *data == '-')
+			old_lines++;
+		if (*data == ' ' || *data == '+')
+			new_lines++;
+	}
 
-	for (pos = line; view_has_line(view, pos) && pos->data; pos++)
-		files++;
+	target_lines = reverse ? new_lines : old_lines;
+	*delta += (long) target_lines - (long) target->lines;
+	target->position = first - !target_lines;
+	target->lines = target_lines;
 
-	string_copy(buf, view->ref);
-	getsyx(cursor_y, cursor_x);
-	for (file = 0, done = 5; result && file < files; line++, file++) {
-		int almost_done = file * 100 / files;
+	if (stage_format_chunk_header(buf, header, context ? context + 2 : "")) {
+		char *data = strdup(buf);
 
-		if (almost_done > done) {
-			done = almost_done;
-			string_format(view->ref, "updating file %u of %u (%d%% done)",
-				      file, files, done);
-			update_view_title(view);
-			setsyx(cursor_y, cursor_x);
-			doupdate();
+		if (data) {
+			free(view->line[chunk].data);
+			view->line[chunk].data = data;
 		}
-		result = status_update_write(&io, line->data, line->type);
 	}
-	string_copy(view->ref, buf);
-
-	return io_done(&io) && result;
 }
 
+/* Find the next changes in the chunk lines [from, end) that git shows
+ * together, i.e. with at most twice the context lines between them, and
+ * the context shown around them. */
 static bool
-status_update(struct view *view)
+stage_find_chunk_group(struct view *view, size_t from, size_t end,
+		       size_t *group_start, size_t *group_end)
 {
-	struct line *line = &view->line[view->pos.lineno];
+	unsigned long context = opt_diff_context, lines = 0;
+	size_t first, last, pos;
 
-	assert(view->lines);
+	for (first = from; first < end; first++) {
+		const char *data = view->line[first].data;
 
-	if (!line->data) {
-		if (status_has_none(view, line)) {
-			report("Nothing to update");
-			return FALSE;
-		}
+		if (*data == '-' || *data == '+')
+			break;
+	}
+	if (first == end)
+		return FALSE;
 
-		if (!status_update_files(view, line + 1)) {
-			report("Failed to update file status");
-			return FALSE;
-		}
+	for (last = pos = first; pos < end; pos++) {
+		const char *data = view->line[pos].data;
 
-	} else if (!status_update_file(line->data, line->type)) {
-		report("Failed to update file status");
-		return FALSE;
+		if (*data == '-' || *data == '+') {
+			if (lines > 2 * context)
+				break;
+			last = pos;
+			lines = 0;
+		} else if (*data == ' ') {
+			lines++;
+		}
 	}
 
+	for (pos = first, lines = 0; pos > from && lines < context; pos--, lines++)
+		if (*(char *) view->line[pos - 1].data != ' ')
+			break;
+	*group_start = pos;
+
+	for (pos = last + 1, lines = 0; pos < end; pos++) {
+		const char *data = view->line[pos].data;
+
+		if (*data == ' ' && lines < context)
+			lines++;
+		else if (*data != '\\')
+			break;
+	}
+	*group_end = pos;
 	return TRUE;
 }
 
+/* Format the header of a chunk trimmed to the lines [start, end). Like
+ * git, the function name is that of the last line before the chunk on
+ * the old side that starts with an identifier. */
 static bool
-status_revert(struct status *status, enum line_type type, bool has_none)
-{
-	if (!status || type != LINE_STAT_UNSTAGED) {
-		if (type == LINE_STAT_STAGED) {
-			report("Cannot revert changes to staged files");
-		} else if (type == LINE_STAT_UNTRACKED) {
-			report("Cannot revert changes to untracked files");
-		} else if (has_none) {
-			report("Nothing to revert");
-		} else {
-			report("Cannot revert changes to multiple files");
+stage_format_chunk_group(struct view *view, size_t chunk, size_t start, size_t end,
+			 struct chunk_header *header, char buf[SIZEOF_STR])
+{
+	const char *context = strstr((char *) view->line[chunk].data + 2, "@@");
+	unsigned long old_line = header->old.position + !header->old.lines;
+	unsigned long new_line = header->new.position + !header->new.lines;
+	struct chunk_header group = {};
+	char funcname[SIZEOF_STR];
+	size_t i;
+
+	context = context ? context + 2 : "";
+	for (i = start; i > chunk + 1; i--) {
+		const char *data = view->line[i - 1].data;
+		size_t len = strlen(data + 1);
+
+		if (*data != ' ' && *data != '-')
+			continue;
+		if (!isalpha((unsigned char) data[1]) && data[1] != '_' && data[1] != '$')
+			continue;
+		len = MIN(len, 80);
+		while (len > 0 && isspace((unsigned char) data[len]))
+			len--;
+		if (string_format(funcname, " %.*s", (int) len, data + 1))
+			context = funcname;
+		break;
+	}
+
+	for (i = chunk + 1; i < end; i++) {
+		const char *data = view->line[i].data;
+
+		if (i == start) {
+			group.old.position = old_line;
+			group.new.position = new_line;
+		}
+		if (*data == ' ' || *data == '-') {
+			old_line++;
+			group.old.lines += i >= start;
 		}
+		if (*data == ' ' || *data == '+') {
+			new_line++;
+			group.new.lines += i >= start;
+		}
+	}
+	group.old.position -= !group.old.lines;
+	group.new.position -= !group.new.lines;
 
-	} else if (prompt_yesno("Are you sure you want to revert changes?")) {
-		char mode[10] = "100644";
-		const char *reset_argv[] = {
-			"git", "update-index", "--cacheinfo", mode,
-				status->old.rev, status->old.name, NULL
-		};
-		const char *checkout_argv[] = {
-			"git", "checkout", "--", status->old.name, NULL
-		};
+	return stage_format_chunk_header(buf, &group, context);
+}
 
-		if (status->status == 'U') {
-			string_format(mode, "%5o", status->old.mode);
+static void
+stage_move_line(struct view *view, size_t from, size_t *to, struct position *pos)
+{
+	if (from == view->pos.lineno)
+		pos->lineno = *to;
+	if (from == view->pos.offset)
+		pos->offset = *to;
+	if (from != *to)
+		view->line[*to] = view->line[from];
+	view->line[*to].lineno = *to + 1;
+	view->line[*to].dirty = 1;
+	(*to)++;
+}
 
-			if (status->old.mode == 0 && status->new.mode == 0) {
-				reset_argv[2] = "--force-remove";
-				reset_argv[3] = status->old.name;
-				reset_argv[4] = NULL;
-			}
+static void
+stage_drop_line(struct view *view, size_t from, size_t to, struct position *pos)
+{
+	if (from == view->pos.lineno)
+		pos->lineno = to;
+	if (from == view->pos.offset)
+		pos->offset = to;
+	free(view->line[from].data);
+}
+
+/* Trim the context of a chunk to what git shows and split it where the
+ * remaining changes are far enough apart, so the diff loaded again to
+ * confirm the update is the same. Each split drops at least one line,
+ * so the lines are moved down in place. */
+static size_t
+stage_trim_chunk(struct view *view, size_t chunk, size_t end, size_t to,
+		 struct position *pos)
+{
+	struct chunk_header header;
+	struct line chunk_line = view->line[chunk];
+	char buf[SIZEOF_STR];
+	char **headers = NULL;
+	size_t groups = 0, group, from, start, stop;
 
-			if (!io_run_fg(reset_argv, opt_cdup))
-				return FALSE;
-			if (status->old.mode == 0 && status->new.mode == 0)
-				return TRUE;
+	if (parse_chunk_header(&header, chunk_line.data)) {
+		for (from = chunk + 1; stage_find_chunk_group(view, from, end, &start, &stop); from = stop)
+			groups++;
+		headers = groups ? calloc(groups, sizeof(*headers)) : NULL;
+	}
+
+	for (from = chunk + 1, group = 0; headers && group < groups; from = stop, group++) {
+		stage_find_chunk_group(view, from, end, &start, &stop);
+		if (!stage_format_chunk_group(view, chunk, start, stop, &header, buf) ||
+		    !(headers[group] = strdup(buf))) {
+			while (group > 0)
+				free(headers[--group]);
+			free(headers);
+			headers = NULL;
 		}
+	}
 
-		return io_run_fg(checkout_argv, opt_cdup);
+	if (!headers) {
+		for (from = chunk; from < end; from++)
+			stage_move_line(view, from, &to, pos);
+		return to;
 	}
 
-	return FALSE;
+	stage_move_line(view, chunk, &to, pos);
+	view->line[to - 1].data = headers[0];
+	for (from = chunk + 1, group = 0; group < groups; group++) {
+		stage_find_chunk_group(view, from, end, &start, &stop);
+		for (; from < start; from++)
+			stage_drop_line(view, from, to, pos);
+		if (group > 0) {
+			view->line[to] = chunk_line;
+			view->line[to].data = headers[group];
+			view->line[to].lineno = to + 1;
+			view->line[to].dirty = 1;
+			to++;
+		}
+		for (; from < stop; from++)
+			stage_move_line(view, from, &to, pos);
+	}
+	for (; from < end; from++)
+		stage_drop_line(view, from, to, pos);
+
+	free(chunk_line.data);
+	free(headers);
+	return to;
 }
 
-static enum request
-status_request(struct view *view, enum request request, struct line *line)
+static void
+stage_trim_chunks(struct view *view)
 {
-	struct status *status = line->data;
+	struct position pos = view->pos;
+	size_t from = 0, to = 0, end;
 
-	switch (request) {
-	case REQ_STATUS_UPDATE:
-		if (!status_update(view))
-			return REQ_NONE;
-		break;
+	while (from < view->lines) {
+		if (view->line[from].type != LINE_DIFF_CHUNK) {
+			stage_move_line(view, from++, &to, &pos);
+			continue;
+		}
 
-	case REQ_STATUS_REVERT:
-		if (!status_revert(status, line->type, status_has_none(view, line)))
-			return REQ_NONE;
-		break;
+		for (end = from + 1; end < view->lines; end++)
+			if (view->line[end].type == LINE_DIFF_CHUNK ||
+			    view->line[end].type == LINE_DIFF_HEADER)
+				break;
+		to = stage_trim_chunk(view, from, end, to, &pos);
+		from = end;
+	}
 
-	case REQ_STATUS_MERGE:
-		if (!status || status->status != 'U') {
-			report("Merging only possible for files with unmerged status ('U').");
-			return REQ_NONE;
-		}
-		open_mergetool(status->new.name);
-		break;
+	view->lines = to;
+	view->pos = pos;
+}
 
-	case REQ_EDIT:
-		if (!status)
-			return request;
-		if (status->status == 'D') {
-			report("File has been deleted.");
-			return REQ_NONE;
+/* Update the diff after the selected lines have been applied instead of
+ * loading it again. Applied lines become context when they are now on
+ * both sides, and are removed otherwise. Chunks and files left without
+ * changes are removed, the chunk headers of the patched side are moved
+ * by the lines added or removed before them, and the context is trimmed
+ * to what git shows. */
+static void
+stage_update_view(struct view *view, bool reverse)
+{
+	struct stage_state *state = view->private;
+	const char context_marker = reverse ? '-' : '+';
+	struct chunk_header header;
+	size_t file = 0, chunk = 0;
+	bool in_file = FALSE, in_chunk = FALSE;
+	bool file_has_chunks = FALSE, chunk_has_changes = FALSE;
+	bool removed = FALSE;
+	long delta = 0;
+	struct position pos = view->pos;
+	size_t from, to;
+
+	if (opt_wrap_lines)
+		return;
+
+	for (from = to = 0; from <= view->lines; from++) {
+		struct line *line = from < view->lines ? &view->line[from] : NULL;
+
+		if (!line || line->type == LINE_DIFF_CHUNK || line->type == LINE_DIFF_HEADER) {
+			if (in_chunk) {
+				stage_update_chunk(view, chunk, to, &header, &delta, reverse);
+				if (!chunk_has_changes) {
+					stage_remove_lines(view, chunk, to);
+					to = chunk;
+					pos.lineno = MIN(pos.lineno, to);
+					pos.offset = MIN(pos.offset, to);
+				} else {
+					file_has_chunks = TRUE;
+				}
+			}
+			in_chunk = line && line->type == LINE_DIFF_CHUNK &&
+				   parse_chunk_header(&header, line->data);
+			chunk = to;
+			chunk_has_changes = FALSE;
+		}
+
+		if (!line || line->type == LINE_DIFF_HEADER) {
+			if (in_file && !file_has_chunks) {
+				stage_remove_lines(view, file, to);
+				to = file;
+				pos.lineno = MIN(pos.lineno, to);
+				pos.offset = MIN(pos.offset, to);
+			}
+			in_file = line != NULL;
+			file = to;
+			file_has_chunks = FALSE;
+			delta = 0;
 		}
 
-		open_editor(status->new.name, 0);
-		break;
+		if (!line)
+			break;
 
-	case REQ_VIEW_BLAME:
-		if (status)
-			opt_ref[0] = 0;
-		return request;
+		/* Removed lines move the cursor to the next line kept. */
+		if (from == view->pos.lineno)
+			pos.lineno = to;
+		if (from == view->pos.offset)
+			pos.offset = to;
 
-	case REQ_ENTER:
-		/* After returning the status view has been split to
-		 * show the stage view. No further reloading is
-		 * necessary. */
-		return status_enter(view, line);
+		if (in_chunk && line->type != LINE_DIFF_CHUNK) {
+			char *data = line->data;
 
-	case REQ_REFRESH:
-		/* Load the current branch information and then the view. */
-		load_refs(TRUE);
-		break;
+			if (*data == '\\' && removed) {
+				free(data);
+				continue;
+			}
 
-	default:
-		return request;
+			removed = FALSE;
+			if (stage_line_is_selected(line)) {
+				line->user_flags &= ~STAGE_LINE_SELECTED;
+				if (*data != context_marker) {
+					free(data);
+					removed = TRUE;
+					continue;
+				}
+				*data = ' ';
+				line->type = get_line_type(data);
+			}
+
+			if (*data == '-' || *data == '+')
+				chunk_has_changes = TRUE;
+		}
+
+		if (from != to)
+			view->line[to] = *line;
+		view->line[to].lineno = to + 1;
+		view->line[to].dirty = 1;
+		to++;
 	}
 
-	refresh_view(view);
+	view->lines = to;
+	view->pos = pos;
+	stage_trim_chunks(view);
+	state->selected = 0;
+	state->diff.index_stale = TRUE;
+	state->updated = TRUE;
 
-	return REQ_NONE;
+	if (view->pos.lineno >= view->lines)
+		view->pos.lineno = view->lines ? view->lines - 1 : 0;
+	if (view->pos.offset > view->pos.lineno)
+		view->pos.offset = view->pos.lineno;
+	redraw_view(view);
 }
 
-static bool
-status_stage_info_(char *buf, size_t bufsize,
-		   enum line_type type, struct status *status)
+/* Mark the lines applied by stage_apply_chunk() as selected. */
+static void
+stage_select_applied(struct view *view, struct line *chunk, struct line *line)
 {
-	const char *file = status ? status->new.name : "";
-	const char *info;
+	struct line *pos;
 
-	switch (type) {
-	case LINE_STAT_STAGED:
-		if (status && status->status)
-			info = "Staged changes to %s";
-		else
-			info = "Staged changes";
-		break;
+	if (line) {
+		stage_select_line(view, line, TRUE);
+		return;
+	}
 
-	case LINE_STAT_UNSTAGED:
-		if (status && status->status)
-			info = "Unstaged changes to %s";
-		else
-			info = "Unstaged changes";
-		break;
+	for (pos = chunk + 1; view_has_line(view, pos); pos++) {
+		if (pos->type == LINE_DIFF_CHUNK || pos->type == LINE_DIFF_HEADER)
+			break;
+		if (stage_line_is_change(pos))
+			stage_select_line(view, pos, TRUE);
+	}
+}
 
-	case LINE_STAT_UNTRACKED:
-		info = "Untracked file %s";
-		break;
+/*
+ * After the stage view has been updated in place, the diff is loaded
+ * again in the background to confirm the result. The diff stat and the
+ * blob ids are updated in place, and the lines are only replaced if the
+ * diff itself differs, e.g. because git chose other chunks.
+ */
 
-	case LINE_STAT_HEAD:
-	default:
-		info = "";
-	}
+static struct stage_confirm {
+	struct io io;
+	bool running;
+	char **lines;
+	size_t size;
+} stage_confirm;
 
-	return string_nformat(buf, bufsize, NULL, info, file);
-}
-#define status_stage_info(buf, type, status) \
-	status_stage_info_(buf, sizeof(buf), type, status)
+DEFINE_ALLOCATOR(realloc_stage_confirm_lines, char *, 256)
 
 static void
-status_select(struct view *view, struct line *line)
+stage_confirm_stop(void)
 {
-	struct status *status = line->data;
-	char file[SIZEOF_STR] = "all files";
-	const char *text;
-	const char *key;
+	struct stage_confirm *job = &stage_confirm;
+	size_t i;
 
-	if (status && !string_format(file, "'%s'", status->new.name))
-		return;
+	if (job->running) {
+		io_kill(&job->io);
+		io_done(&job->io);
+	}
+	for (i = 0; i < job->size; i++)
+		free(job->lines[i]);
+	free(job->lines);
+	memset(job, 0, sizeof(*job));
+}
 
-	if (!status && line[1].type == LINE_STAT_NONE)
-		line++;
+static size_t
+stage_first_diff_header(struct view *view)
+{
+	size_t i;
 
-	switch (line->type) {
-	case LINE_STAT_STAGED:
-		text = "Press %s to unstage %s for commit";
-		break;
+	for (i = 0; i < view->lines; i++)
+		if (view->line[i].type == LINE_DIFF_HEADER)
+			break;
+	return i;
+}
 
-	case LINE_STAT_UNSTAGED:
-		text = "Press %s to stage %s for commit";
-		break;
+/* Take the diff stat and the index lines, which change with the blobs,
+ * if the rest of the diff is the same. */
+static bool
+stage_confirm_update(struct view *view, char **lines, size_t size)
+{
+	size_t header = stage_first_diff_header(view);
+	size_t i;
 
-	case LINE_STAT_UNTRACKED:
-		text = "Press %s to stage %s for addition";
-		break;
+	if (size != view->lines)
+		return FALSE;
 
-	case LINE_STAT_HEAD:
-	case LINE_STAT_NONE:
-		text = "Nothing to update";
-		break;
+	for (i = 0; i < size; i++) {
+		const char *data = view->line[i].data;
 
-	default:
-		die("line type %d not handled in switch", line->type);
+		if (i < header ? !prefixcmp(lines[i], "diff --")
+			       : strcmp(lines[i], data) &&
+				 (prefixcmp(lines[i], "index ") || prefixcmp(data, "index ")))
+			return FALSE;
 	}
 
-	if (status && status->status == 'U') {
-		text = "Press %s to resolve conflict in %s";
-		key = get_view_key(view, REQ_STATUS_MERGE);
+	for (i = 0; i < size; i++) {
+		char *data = view->line[i].data;
 
-	} else {
-		key = get_view_key(view, REQ_STATUS_UPDATE);
+		if (strcmp(lines[i], data)) {
+			view->line[i].data = lines[i];
+			view->line[i].dirty = view->line[i].cleareol = 1;
+			lines[i] = data;
+		}
 	}
 
-	string_format(view->ref, text, key, file);
-	status_stage_info(ref_status, line->type, status);
-	if (status)
-		string_copy(opt_file, status->new.name);
+	return TRUE;
 }
 
-static bool
-status_grep(struct view *view, struct line *line)
+/* Find the line at the same offset in the same chunk of the same file,
+ * e.g. after the diff stat above has changed. */
+static size_t
+stage_confirm_find_line(struct view *view, const char *file, size_t file_index,
+			size_t chunk_index, size_t offset)
 {
-	struct status *status = line->data;
+	size_t lineno, next, headers = 0;
 
-	if (status) {
-		const char buf[2] = { status->status, 0 };
-		const char *text[] = { status->new.name, buf, NULL };
+	for (lineno = 0; lineno < view->lines; lineno++) {
+		struct line *line = &view->line[lineno];
 
-		return grep_text(view, text);
+		if (line->type != LINE_DIFF_HEADER)
+			continue;
+		if (!strcmp(line->data, file))
+			break;
+		if (headers++ == file_index) {
+			chunk_index = 1;
+			offset = 0;
+			break;
+		}
 	}
+	if (lineno == view->lines)
+		return lineno;
 
-	return FALSE;
+	for (next = lineno + 1; next < view->lines; next++) {
+		enum line_type type = view->line[next].type;
+
+		if (type == LINE_DIFF_HEADER ||
+		    (type == LINE_DIFF_CHUNK && chunk_index-- == 0))
+			break;
+		if (type == LINE_DIFF_CHUNK)
+			lineno = next;
+	}
+
+	return MIN(lineno + offset, next - 1);
 }
 
-static struct view_ops status_ops = {
-	"file",
-	{ "status" },
-	VIEW_CUSTOM_STATUS | VIEW_SEND_CHILD_ENTER | VIEW_STATUS_LIKE,
-	0,
-	status_open,
-	NULL,
-	status_draw,
-	status_request,
-	status_grep,
-	status_select,
-};
+/* Replace the lines while staying on the same diff line. */
+static void
+stage_confirm_replace(struct view *view, char **lines, size_t size)
+{
+	struct stage_state *state = view->private;
+	struct position pos = view->pos;
+	size_t header = stage_first_diff_header(view);
+	size_t file_index = 0, chunk_index = 0, offset = 0;
+	char file[SIZEOF_STR] = "";
+	size_t i;
 
+	for (i = header; i <= pos.lineno && i < view->lines; i++) {
+		struct line *line = &view->line[i];
 
-struct stage_state {
-	struct diff_state diff;
-	size_t chunks;
-	int *chunk;
-};
+		if (line->type == LINE_DIFF_HEADER) {
+			file_index += !!*file;
+			string_ncopy(file, line->data, strlen(line->data));
+			chunk_index = offset = 0;
+		} else if (line->type == LINE_DIFF_CHUNK) {
+			chunk_index++;
+			offset = 0;
+		} else {
+			offset++;
+		}
+	}
 
-static bool
-stage_diff_write(struct io *io, struct line *line, struct line *end)
-{
-	while (line < end) {
-		if (!io_write(io, line->data, strlen(line->data)) ||
-		    !io_write(io, "\n", 1))
-			return FALSE;
-		line++;
-		if (line->type == LINE_DIFF_CHUNK ||
-		    line->type == LINE_DIFF_HEADER)
+	reset_view(view);
+	memset(state, 0, sizeof(*state));
+	for (i = 0; i < size; i++)
+		if (!view->ops->read(view, lines[i]))
 			break;
-	}
+	view->ops->read(view, NULL);
 
-	return TRUE;
+	if (*file) {
+		size_t scroll = pos.lineno - MIN(pos.offset, pos.lineno);
+
+		pos.lineno = stage_confirm_find_line(view, file, file_index, chunk_index, offset);
+		pos.offset = pos.lineno - MIN(scroll, pos.lineno);
+	}
+	if (pos.lineno >= view->lines)
+		pos.lineno = view->lines ? view->lines - 1 : 0;
+	if (pos.offset > pos.lineno)
+		pos.offset = pos.lineno;
+	view->pos = pos;
+	clear_position(&view->prev_pos);
 }
 
 static bool
-stage_apply_chunk(struct view *view, struct line *chunk, struct line *line, bool revert)
+stage_confirm_poll(void *data)
 {
-	const char *apply_argv[SIZEOF_ARG] = {
-		"git", "apply", "--whitespace=nowarn", NULL
-	};
-	struct line *diff_hdr;
-	struct io io;
-	int argc = 3;
+	struct stage_confirm *job = &stage_confirm;
+	struct view *view = VIEW(REQ_VIEW_STAGE);
+	struct encoding *encoding = view->encoding ? view->encoding : default_encoding;
+	bool can_read = TRUE, ok;
+	char *line, **lines;
+	size_t i, size;
 
-	diff_hdr = find_prev_line_by_type(view, chunk, LINE_DIFF_HEADER);
-	if (!diff_hdr)
+	if (!job->running)
 		return FALSE;
+	if (!io_can_read(&job->io, FALSE))
+		return TRUE;
 
-	if (!revert)
-		apply_argv[argc++] = "--cached";
-	if (line != NULL)
-		apply_argv[argc++] = "--unidiff-zero";
-	if (revert || stage_line_type == LINE_STAT_STAGED)
-		apply_argv[argc++] = "-R";
-	apply_argv[argc++] = "-";
-	apply_argv[argc++] = NULL;
-	if (!io_run(&io, IO_WR, opt_cdup, opt_env, apply_argv))
-		return FALSE;
+	for (; (line = io_get(&job->io, '\n', can_read)); can_read = FALSE) {
+		if (encoding)
+			line = encoding_convert(encoding, line);
+		if (!realloc_stage_confirm_lines(&job->lines, job->size, 1) ||
+		    !(job->lines[job->size] = strdup(line))) {
+			stage_confirm_stop();
+			return FALSE;
+		}
+		job->size++;
+	}
 
-	if (line != NULL) {
-		unsigned long lineno = 0;
-		struct line *context = chunk + 1;
-		const char *markers[] = {
-			line->type == LINE_DIFF_DEL ? ""   : ",0",
-			line->type == LINE_DIFF_DEL ? ",0" : "",
-		};
+	if (!io_eof(&job->io) && !io_error(&job->io))
+		return TRUE;
 
-		parse_chunk_lineno(&lineno, chunk->data, line->type == LINE_DIFF_DEL ? '+' : '-');
+	lines = job->lines;
+	size = job->size;
+	ok = io_done(&job->io);
+	memset(job, 0, sizeof(*job));
 
-		while (context < line) {
-			if (context->type == LINE_DIFF_CHUNK || context->type == LINE_DIFF_HEADER) {
-				break;
-			} else if (context->type != LINE_DIFF_DEL && context->type != LINE_DIFF_ADD) {
-				lineno++;
-			}
-			context++;
-		}
+	ok = ok && !view->pipe;
+	if (ok && stage_confirm_update(view, lines, size)) {
+		io_trace("stage diff confirmed\n");
+		if (view_is_displayed(view))
+			redraw_view_dirty(view);
 
-		if (!stage_diff_write(&io, diff_hdr, chunk) ||
-		    !io_printf(&io, "@@ -%lu%s +%lu%s @@\n",
-			       lineno, markers[0], lineno, markers[1]) ||
-		    !stage_diff_write(&io, line, line + 1)) {
-			chunk = NULL;
+	} else if (ok) {
+		io_trace("stage diff replaced\n");
+		stage_confirm_replace(view, lines, size);
+		if (view_is_displayed(view)) {
+			redraw_view(view);
+			update_view_title(view);
 		}
-	} else {
-		if (!stage_diff_write(&io, diff_hdr, chunk) ||
-		    !stage_diff_write(&io, chunk, view->line + view->lines))
-			chunk = NULL;
 	}
 
-	io_done(&io);
+	for (i = 0; i < size; i++)
+		free(lines[i]);
+	free(lines);
+	return FALSE;
+}
 
-	return chunk ? TRUE : FALSE;
+static void
+stage_confirm_start(struct view *view)
+{
+	struct stage_confirm *job = &stage_confirm;
+
+	stage_confirm_stop();
+	if (view->argv && view->argv[0] &&
+	    io_run(&job->io, IO_RD, view->dir, opt_env, view->argv)) {
+		job->running = TRUE;
+		if (!background_add(stage_confirm_poll, NULL))
+			stage_confirm_stop();
+	}
 }
 
 static bool
 stage_update(struct view *view, struct line *line, bool single)
 {
+	struct stage_state *state = view->private;
 	struct line *chunk = NULL;
 
+	if (state->selected) {
+		if (!stage_apply_selected(view, FALSE)) {
+			report("Failed to apply the selected lines");
+			return FALSE;
+		}
+		stage_update_view(view, stage_line_type == LINE_STAT_STAGED);
+		return TRUE;
+	}
+
 	if (!is_initial_commit() && stage_line_type != LINE_STAT_UNTRACKED)
 		chunk = find_prev_line_by_type(view, line, LINE_DIFF_CHUNK);
 
@@ -7464,15 +12408,13 @@ stage_update(struct view *view, struct line *line, bool single)
 			report("Failed to apply chunk");
 			return FALSE;
 		}
+		stage_select_applied(view, chunk, single ? line : NULL);
+		stage_update_view(view, stage_line_type == LINE_STAT_STAGED);
 
 	} else if (!stage_status.status) {
-		view = view->parent;
+		struct status_section *section = status_get_section(stage_line_type);
 
-		for (line = view->line; view_has_line(view, line); line++)
-			if (line->type == stage_line_type)
-				break;
-
-		if (!status_update_files(view, line + 1)) {
+		if (!status_update_files(view->parent, stage_line_type, 0, section->size)) {
 			report("Failed to update files");
 			return FALSE;
 		}
@@ -7488,8 +12430,21 @@ stage_update(struct view *view, struct line *line, bool single)
 static bool
 stage_revert(struct view *view, struct line *line)
 {
+	struct stage_state *state = view->private;
 	struct line *chunk = NULL;
 
+	if (state->selected && stage_line_type == LINE_STAT_UNSTAGED) {
+		if (!prompt_yesno("Are you sure you want to revert the selected lines?"))
+			return FALSE;
+
+		if (!stage_apply_selected(view, TRUE)) {
+			report("Failed to revert the selected lines");
+			return FALSE;
+		}
+		stage_update_view(view, TRUE);
+		return TRUE;
+	}
+
 	if (!is_initial_commit() && stage_line_type == LINE_STAT_UNSTAGED)
 		chunk = find_prev_line_by_type(view, line, LINE_DIFF_CHUNK);
 
@@ -7501,6 +12456,8 @@ stage_revert(struct view *view, struct line *line)
 			report("Failed to revert chunk");
 			return FALSE;
 		}
+		stage_select_applied(view, chunk, NULL);
+		stage_update_view(view, TRUE);
 		return TRUE;
 
 	} else {
@@ -7513,32 +12470,17 @@ stage_revert(struct view *view, struct line *line)
 static void
 stage_next(struct view *view, struct line *line)
 {
-	struct stage_state *state = view->private;
-	int i;
+	struct line *chunk = find_next_line_by_type(view, &view->line[view->pos.lineno + 1],
+						    LINE_DIFF_CHUNK);
+	struct diff_index *index = diff_get_index(view, LINE_DIFF_CHUNK);
 
-	if (!state->chunks) {
-		for (line = view->line; view_has_line(view, line); line++) {
-			if (line->type != LINE_DIFF_CHUNK)
-				continue;
-
-			if (!realloc_ints(&state->chunk, state->chunks, 1)) {
-				report("Allocation failure");
-				return;
-			}
-
-			state->chunk[state->chunks++] = line - view->line;
-		}
-	}
-
-	for (i = 0; i < state->chunks; i++) {
-		if (state->chunk[i] > view->pos.lineno) {
-			do_scroll_view(view, state->chunk[i] - view->pos.lineno);
-			report("Chunk %d of %zd", i + 1, state->chunks);
-			return;
-		}
+	if (!chunk || !index) {
+		report("No next chunk found");
+		return;
 	}
 
-	report("No next chunk found");
+	do_scroll_view(view, chunk - view->line - view->pos.lineno);
+	report("Chunk %zu of %zu", diff_index_count(index, chunk - view->line), index->size);
 }
 
 static struct line *
@@ -7632,6 +12574,9 @@ stage_split_chunk(struct view *view, struct line *chunk_start)
 	}
 
 	if (chunks) {
+		struct stage_state *state = view->private;
+
+		state->diff.index_stale = TRUE;
 		stage_insert_chunk(view, &header, chunk_start, NULL, NULL);
 		redraw_view(view);
 		report("Split the chunk in %d", chunks + 1);
@@ -7643,14 +12588,18 @@ stage_split_chunk(struct view *view, struct line *chunk_start)
 static enum request
 stage_request(struct view *view, enum request request, struct line *line)
 {
+	struct stage_state *state = view->private;
+
 	switch (request) {
 	case REQ_STATUS_UPDATE:
-		if (!stage_update(view, line, FALSE))
+		if (status_update_is_running(view) || !stage_update(view, line, FALSE))
+			return REQ_NONE;
+		if (status_update_job.running)
 			return REQ_NONE;
 		break;
 
 	case REQ_STATUS_REVERT:
-		if (!stage_revert(view, line))
+		if (status_update_is_running(view) || !stage_revert(view, line))
 			return REQ_NONE;
 		break;
 
@@ -7660,11 +12609,11 @@ stage_request(struct view *view, enum request request, struct line *line)
 			report("Staging single lines is not supported for new files");
 			return REQ_NONE;
 		}
-		if (line->type != LINE_DIFF_DEL && line->type != LINE_DIFF_ADD) {
+		if (!state->selected && !stage_line_is_change(line)) {
 			report("Please select a change to stage");
 			return REQ_NONE;
 		}
-		if (!stage_update(view, line, TRUE))
+		if (status_update_is_running(view) || !stage_update(view, line, TRUE))
 			return REQ_NONE;
 		break;
 
@@ -7677,6 +12626,17 @@ stage_request(struct view *view, enum request request, struct line *line)
 		stage_next(view, line);
 		return REQ_NONE;
 
+	case REQ_STAGE_SELECT_LINE:
+		if (stage_line_type == LINE_STAT_UNTRACKED ||
+		    stage_status.status == 'A') {
+			report("Staging single lines is not supported for new files");
+		} else if (!stage_line_is_change(line) && line->type != LINE_DIFF_CHUNK) {
+			report("Please select a change or chunk");
+		} else {
+			stage_select(view, line);
+		}
+		return REQ_NONE;
+
 	case REQ_STAGE_SPLIT_CHUNK:
 		if (stage_line_type == LINE_STAT_UNTRACKED ||
 		    !(line = find_prev_line_by_type(view, line, LINE_DIFF_CHUNK))) {
@@ -7709,7 +12669,7 @@ stage_request(struct view *view, enum request request, struct line *line)
 
 	case REQ_VIEW_BLAME:
 		if (stage_status.new.name[0]) {
-			string_copy(opt_file, stage_status.new.name);
+			string_ncopy(opt_file, stage_status.new.name, strlen(stage_status.new.name));
 			opt_ref[0] = 0;
 		}
 		return request;
@@ -7717,6 +12677,13 @@ stage_request(struct view *view, enum request request, struct line *line)
 	case REQ_ENTER:
 		return diff_common_enter(view, request, line);
 
+	case REQ_DIFF_NEXT_FILE:
+	case REQ_DIFF_PREV_FILE:
+	case REQ_DIFF_NEXT_CHUNK:
+	case REQ_DIFF_PREV_CHUNK:
+		diff_common_move(view, request, line);
+		return REQ_NONE;
+
 	case REQ_DIFF_CONTEXT_UP:
 	case REQ_DIFF_CONTEXT_DOWN:
 		if (!update_diff_context(request))
@@ -7736,7 +12703,12 @@ stage_request(struct view *view, enum request request, struct line *line)
 		return REQ_VIEW_CLOSE;
 	}
 
-	refresh_view(view);
+	if (state->updated) {
+		state->updated = FALSE;
+		stage_confirm_start(view);
+	} else {
+		refresh_view(view);
+	}
 
 	return REQ_NONE;
 }
@@ -7744,26 +12716,26 @@ stage_request(struct view *view, enum request request, struct line *line)
 static bool
 stage_open(struct view *view, enum open_flags flags)
 {
-	static const char *no_head_diff_argv[] = {
+	const char *no_head_diff_argv[] = {
 		GIT_DIFF_STAGED_INITIAL(encoding_arg, opt_diff_context_arg, opt_ignore_space_arg,
 			stage_status.new.name)
 	};
-	static const char *index_show_argv[] = {
+	const char *index_show_argv[] = {
 		GIT_DIFF_STAGED(encoding_arg, opt_diff_context_arg, opt_ignore_space_arg,
 			stage_status.old.name, stage_status.new.name)
 	};
-	static const char *files_show_argv[] = {
+	const char *files_show_argv[] = {
 		GIT_DIFF_UNSTAGED(encoding_arg, opt_diff_context_arg, opt_ignore_space_arg,
 			stage_status.old.name, stage_status.new.name)
 	};
 	/* Diffs for unmerged entries are empty when passing the new
 	 * path, so leave out the new path. */
-	static const char *files_unmerged_argv[] = {
+	const char *files_unmerged_argv[] = {
 		"git", "diff-files", encoding_arg, "--root", "--patch-with-stat",
 			opt_diff_context_arg, opt_ignore_space_arg, "--",
 			stage_status.old.name, NULL
 	};
-	static const char *file_argv[] = { opt_cdup, stage_status.new.name, NULL };
+	const char *file_argv[] = { opt_cdup, stage_status.new.name, NULL };
 	const char **argv = NULL;
 
 	if (!stage_line_type) {
@@ -7825,6 +12797,27 @@ stage_read(struct view *view, char *data)
 	return pager_read(view, data);
 }
 
+static void
+stage_done(struct view *view)
+{
+	struct stage_state *state = view->private;
+
+	diff_index_free(&state->diff);
+	stage_confirm_stop();
+}
+
+static bool
+stage_draw(struct view *view, struct line *line, unsigned int lineno)
+{
+	struct stage_state *state = view->private;
+
+	if (state->selected &&
+	    draw_text(view, LINE_DIFF_CHUNK, stage_line_is_selected(line) ? "* " : "  "))
+		return TRUE;
+
+	return diff_common_draw(view, line, lineno);
+}
+
 static struct view_ops stage_ops = {
 	"line",
 	{ "stage" },
@@ -7832,10 +12825,11 @@ static struct view_ops stage_ops = {
 	sizeof(struct stage_state),
 	stage_open,
 	stage_read,
-	diff_common_draw,
+	stage_draw,
 	stage_request,
 	pager_grep,
 	pager_select,
+	stage_done,
 };
 
 
@@ -7978,67 +12972,251 @@ main_flush_commit(struct view *view, struct commit *commit)
 }
 
 static bool
-main_has_changes(const char *argv[])
-{
-	struct io io;
-
-	if (!io_run(&io, IO_BG, NULL, opt_env, argv, -1))
-		return FALSE;
-	io_done(&io);
-	return io.status == 1;
-}
-
-static void
-main_add_changes_commit(struct view *view, enum line_type type, const char *parent, const char *title)
+main_add_changes_commit(struct view *view, struct graph *graph, size_t pos,
+			enum line_type type, const char *parent, const char *title)
 {
 	char ids[SIZEOF_STR] = NULL_ID " ";
 	struct main_state *state = view->private;
-	struct commit commit = {};
+	size_t titlelen = strlen(title);
+	struct commit *commit;
 	struct timeval now;
 	struct timezone tz;
+	struct line *line;
 
-	if (!parent)
-		return;
+	line = add_line_at(view, pos, NULL, type, sizeof(*commit) + titlelen, TRUE);
+	if (!line)
+		return FALSE;
+	commit = line->data;
 
 	string_copy_rev(ids + STRING_SIZE(NULL_ID " "), parent);
 
 	if (!gettimeofday(&now, &tz)) {
-		commit.time.tz = tz.tz_minuteswest * 60;
-		commit.time.sec = now.tv_sec - commit.time.tz;
+		commit->time.tz = tz.tz_minuteswest * 60;
+		commit->time.sec = now.tv_sec - commit->time.tz;
+	}
+
+	commit->author = &unknown_ident;
+	strncpy(commit->title, title, titlelen);
+	string_copy_rev(commit->id, ids);
+	if (state->with_graph) {
+		graph_add_commit(graph, &commit->graph, commit->id, ids, FALSE);
+		graph_render_parents(graph);
 	}
 
-	commit.author = &unknown_ident;
-	main_register_commit(view, &commit, ids, FALSE);
-	if (main_add_commit(view, type, &commit, title, TRUE) && state->with_graph)
-		graph_render_parents(&state->graph);
+	return TRUE;
 }
 
+/* Insert the rows above the commit they are based on. Since they are
+ * added after the history has been rendered, their graph is rendered
+ * separately. */
 static void
-main_add_changes_commits(struct view *view, struct main_state *state, const char *parent)
+main_insert_changes_commits(struct view *view, const char *parent, bool staged, bool unstaged)
+{
+	struct graph graph = {};
+	size_t rows = 0;
+
+	if (staged &&
+	    main_add_changes_commit(view, &graph, rows, LINE_STAT_STAGED,
+				    unstaged ? NULL_ID : parent, "Staged changes"))
+		rows++;
+	if (unstaged &&
+	    main_add_changes_commit(view, &graph, rows, LINE_STAT_UNSTAGED,
+				    parent, "Unstaged changes"))
+		rows++;
+	done_graph(&graph);
+
+	/* Stay on the same commit unless the cursor was not yet moved,
+	 * in which case the first of the rows is selected. */
+	if (!rows || (!view->pos.lineno && !view->pos.offset))
+		return;
+
+	view->pos.lineno += rows;
+	if (view->pos.offset)
+		view->pos.offset += rows;
+	else if (view->pos.lineno >= view->height)
+		view->pos.offset = view->pos.lineno - view->height + 1;
+}
+
+/* Look up the tree of HEAD, which only changes together with HEAD. */
+static const char *
+main_head_tree(const char *head)
+{
+	static char head_id[SIZEOF_REV];
+	static char tree_id[SIZEOF_REV];
+	char rev[SIZEOF_REV + STRING_SIZE("^{tree}")];
+	const char *argv[] = { "git", "rev-parse", "--verify", "-q", rev, NULL };
+
+	if (strcmp(head, head_id)) {
+		string_copy_rev(head_id, head);
+		if (!string_format(rev, "%s^{tree}", head_id) ||
+		    !io_run_buf(argv, tree_id, sizeof(tree_id)))
+			tree_id[0] = 0;
+	}
+
+	return tree_id;
+}
+
+/* Changes are first looked for by reading the index, which answers most
+ * checks without running git. Otherwise, checks for staged and unstaged
+ * changes run in the background once the index has been refreshed, so
+ * that loading the history is not delayed. */
+static struct {
+	struct view *view;
+	char parent[SIZEOF_REV];
+	bool running;
+	bool started;
+	bool failed;
+	struct index_diff *worktree;
+	enum index_status staged_status;
+	enum index_status unstaged_status;
+	struct io staged;
+	struct io unstaged;
+} main_changes_job;
+
+static void
+main_changes_stop(void)
+{
+	if (main_changes_job.worktree)
+		index_diff_worktree_done(main_changes_job.worktree);
+	main_changes_job.worktree = NULL;
+
+	if (main_changes_job.started) {
+		if (main_changes_job.staged_status == INDEX_UNKNOWN) {
+			io_kill(&main_changes_job.staged);
+			io_done(&main_changes_job.staged);
+		}
+		if (main_changes_job.unstaged_status == INDEX_UNKNOWN) {
+			io_kill(&main_changes_job.unstaged);
+			io_done(&main_changes_job.unstaged);
+		}
+	}
+	main_changes_job.running = main_changes_job.started = FALSE;
+	main_changes_job.failed = FALSE;
+}
+
+/* With --quiet, git diff exits with 1 if there are changes and with 0
+ * if there are none. Anything else is an error. */
+static bool
+main_changes_status(struct io *io, enum index_status *status)
+{
+	if (io_done(io))
+		*status = INDEX_CLEAN;
+	else if (io->status == 1)
+		*status = INDEX_CHANGED;
+	else
+		return FALSE;
+	return TRUE;
+}
+
+/* Ask git about what could not be answered from the index. A check that
+ * fails leaves its status unknown, so no commit is added for it. */
+static bool
+main_changes_run(void)
 {
 	const char *staged_argv[] = { GIT_DIFF_STAGED_FILES("--quiet") };
 	const char *unstaged_argv[] = { GIT_DIFF_UNSTAGED_FILES("--quiet") };
-	const char *staged_parent = NULL_ID;
-	const char *unstaged_parent = parent;
+	bool staged = main_changes_job.staged_status == INDEX_UNKNOWN;
+	bool unstaged = main_changes_job.unstaged_status == INDEX_UNKNOWN;
 
-	if (!is_head_commit(parent))
-		return;
+	if (!main_changes_job.started) {
+		if (staged && !io_run(&main_changes_job.staged, IO_RD, NULL, opt_env, staged_argv)) {
+			main_changes_job.failed = TRUE;
+			return TRUE;
+		}
+		if (unstaged && !io_run(&main_changes_job.unstaged, IO_RD, NULL, opt_env, unstaged_argv)) {
+			if (staged) {
+				io_kill(&main_changes_job.staged);
+				io_done(&main_changes_job.staged);
+			}
+			main_changes_job.failed = TRUE;
+			return TRUE;
+		}
+		main_changes_job.started = TRUE;
+	}
 
-	state->added_changes_commits = TRUE;
+	/* Both commands produce no output, so wait for end of file. */
+	if ((staged && !io_can_read(&main_changes_job.staged, FALSE)) ||
+	    (unstaged && !io_can_read(&main_changes_job.unstaged, FALSE)))
+		return FALSE;
+
+	if (staged && !main_changes_status(&main_changes_job.staged,
+					   &main_changes_job.staged_status))
+		main_changes_job.failed = TRUE;
+	if (unstaged && !main_changes_status(&main_changes_job.unstaged,
+					     &main_changes_job.unstaged_status))
+		main_changes_job.failed = TRUE;
+
+	main_changes_job.started = FALSE;
+	return TRUE;
+}
+
+static bool
+main_changes_poll(void *data)
+{
+	struct view *view = main_changes_job.view;
+	struct commit *first;
+	bool staged, unstaged;
+
+	if (!main_changes_job.running)
+		return FALSE;
 
-	io_run_bg(update_index_argv);
+	if (main_changes_job.worktree) {
+		if (index_diff_worktree_step(main_changes_job.worktree, BACKGROUND_POLL_DELAY))
+			return TRUE;
+		main_changes_job.unstaged_status = index_diff_worktree_done(main_changes_job.worktree);
+		main_changes_job.worktree = NULL;
+		if (main_changes_job.unstaged_status == INDEX_UNKNOWN)
+			index_refresh();
+	}
 
-	if (!main_has_changes(unstaged_argv)) {
-		unstaged_parent = NULL;
-		staged_parent = parent;
+	if (!main_changes_job.failed &&
+	    (main_changes_job.staged_status == INDEX_UNKNOWN ||
+	     main_changes_job.unstaged_status == INDEX_UNKNOWN)) {
+		if (main_changes_job.unstaged_status == INDEX_UNKNOWN &&
+		    index_refresh_job.running)
+			return TRUE;
+		if (!main_changes_run())
+			return TRUE;
 	}
 
-	if (!main_has_changes(staged_argv)) {
-		staged_parent = NULL;
+	staged = main_changes_job.staged_status == INDEX_CHANGED;
+	unstaged = main_changes_job.unstaged_status == INDEX_CHANGED;
+	main_changes_job.running = FALSE;
+
+	/* Give up if the view has been reloaded with another history. */
+	first = view->lines ? view->line[0].data : NULL;
+	if (!first || view->custom_lines || strcmp(first->id, main_changes_job.parent))
+		return FALSE;
+
+	main_insert_changes_commits(view, main_changes_job.parent, staged, unstaged);
+	if (view_is_displayed(view) && (staged || unstaged)) {
+		redraw_view(view);
+		update_view_title(view);
 	}
 
-	main_add_changes_commit(view, LINE_STAT_STAGED, staged_parent, "Staged changes");
-	main_add_changes_commit(view, LINE_STAT_UNSTAGED, unstaged_parent, "Unstaged changes");
+	return FALSE;
+}
+
+static void
+main_add_changes_commits(struct view *view, struct main_state *state, const char *parent)
+{
+	if (!is_head_commit(parent))
+		return;
+
+	state->added_changes_commits = TRUE;
+
+	main_changes_stop();
+	main_changes_job.view = view;
+	string_copy_rev(main_changes_job.parent, parent);
+	main_changes_job.running = TRUE;
+
+	main_changes_job.staged_status = index_diff_tree(opt_git_dir, main_head_tree(parent));
+	main_changes_job.unstaged_status = INDEX_UNKNOWN;
+	main_changes_job.worktree =
+		index_diff_worktree_start(opt_git_dir, *opt_cdup ? opt_cdup : ".");
+
+	if (!background_add(main_changes_poll, NULL))
+		main_changes_stop();
 }
 
 static bool
@@ -8069,11 +13247,15 @@ main_done(struct view *view)
 		struct commit *commit = view->line[i].data;
 
 		free(commit->graph.symbols);
+		commit->graph.symbols = NULL;
+		commit->graph.size = 0;
 	}
 
 	for (i = 0; i < state->reflogs; i++)
 		free(state->reflog[i]);
 	free(state->reflog);
+	state->reflog = NULL;
+	state->reflogs = 0;
 }
 
 #define MAIN_NO_COMMIT_REFS 1
@@ -8368,6 +13550,52 @@ main_grep(struct view *view, struct line *line)
 	return grep_text(view, text) || grep_refs(line, commit, view->regex);
 }
 
+static void
+diff_prefetch_start(struct view *view, struct line *line)
+{
+	struct diff_prefetch *job = &diff_prefetch;
+	struct view *diff = VIEW(REQ_VIEW_DIFF);
+	unsigned long lineno = line - view->line;
+	bool keep = FALSE;
+	int i;
+
+	if (lineno != job->lineno)
+		job->direction = lineno < job->lineno ? -1 : 1;
+	job->lineno = lineno;
+	job->ids_size = 0;
+
+	if (!opt_diff_prefetch || !opt_diff_cache_size ||
+	    !view_is_displayed(diff) || diff->prev != view) {
+		diff_prefetch_cancel();
+		return;
+	}
+
+	for (i = 1; i <= opt_diff_prefetch; i++) {
+		unsigned long pos = lineno + i * job->direction;
+		struct commit *commit;
+
+		if (pos >= view->lines)
+			break;
+		commit = view->line[pos].data;
+		if (view->line[pos].type == LINE_STAT_STAGED ||
+		    view->line[pos].type == LINE_STAT_UNSTAGED ||
+		    !iscommit(commit->id))
+			continue;
+
+		/* Let the diff already being read finish. */
+		if (job->running && !strcmp(job->commit, commit->id)) {
+			keep = TRUE;
+			continue;
+		}
+		string_copy_rev(job->ids[job->ids_size++], commit->id);
+	}
+
+	if (!keep)
+		diff_prefetch_cancel();
+	if (job->running || job->ids_size)
+		background_add(diff_prefetch_poll, NULL);
+}
+
 static void
 main_select(struct view *view, struct line *line)
 {
@@ -8378,6 +13606,8 @@ main_select(struct view *view, struct line *line)
 	else
 		string_copy_rev(view->ref, commit->id);
 	string_copy_rev(ref_commit, commit->id);
+	if (view == VIEW(REQ_VIEW_MAIN))
+		diff_prefetch_start(view, line);
 }
 
 static struct view_ops main_ops = {
@@ -8427,6 +13657,101 @@ static struct view_ops stash_ops = {
 	stash_select,
 };
 
+/*
+ * Refreshing views on changes
+ */
+
+#define WATCH_DELAY 300		/* Milliseconds without changes before refreshing. */
+
+static enum watch_event watch_pending;
+static struct timeval watch_time;
+
+static void
+watch_refresh_views(enum watch_event events)
+{
+	bool refs_changed = !!(events & (WATCH_HEAD | WATCH_REFS));
+	bool head_moved = FALSE;
+	struct view *view;
+	int i;
+
+	if (refs_changed) {
+		const struct ref *head = get_ref_head();
+		char head_id[SIZEOF_REV] = "";
+
+		if (head)
+			string_copy_rev(head_id, head->id);
+		load_refs(TRUE);
+		head = get_ref_head();
+		head_moved = !head || strcmp(head_id, head->id);
+
+		/* Look up the refs of all commits again. */
+		foreach_view (view, i) {
+			size_t lineno;
+
+			if (view->ops->draw != main_draw)
+				continue;
+			for (lineno = 0; lineno < view->lines; lineno++)
+				view->line[lineno].user_flags &= ~MAIN_NO_COMMIT_REFS;
+		}
+	}
+
+	foreach_displayed_view (view, i) {
+		if (view->pipe)
+			continue;
+
+		if (view == VIEW(REQ_VIEW_STATUS)) {
+			status_reload(view, events);
+		} else if (view == VIEW(REQ_VIEW_MAIN) && head_moved) {
+			refresh_view(view);
+			continue;
+		} else if (!refs_changed) {
+			continue;
+		}
+
+		redraw_view(view);
+		update_view_title(view);
+	}
+}
+
+static bool
+watch_update_poll(void *data)
+{
+	return watch_update();
+}
+
+/* Refresh once no changes have been seen for a while, so that e.g. a
+ * checkout only causes a single refresh. */
+static bool
+watch_refresh(void *data)
+{
+	enum watch_event events = watch_read();
+	struct timeval now;
+	long elapsed;
+
+	gettimeofday(&now, NULL);
+	if (events) {
+		/* Created directories are watched in the background. */
+		background_add(watch_update_poll, NULL);
+		watch_pending |= events;
+		watch_time = now;
+		if (events & WATCH_WORKTREE)
+			index_worktree_changed = TRUE;
+	}
+
+	if (!watch_pending)
+		return FALSE;
+
+	elapsed = (now.tv_sec - watch_time.tv_sec) * 1000 +
+		  (now.tv_usec - watch_time.tv_usec) / 1000;
+	if (elapsed < WATCH_DELAY)
+		return TRUE;
+
+	events = watch_pending;
+	watch_pending = WATCH_NONE;
+	watch_refresh_views(events);
+	return FALSE;
+}
+
 /*
  * Status management
  */
@@ -8571,6 +13896,7 @@ get_input(int prompt_position)
 
 	while (TRUE) {
 		bool loading = FALSE;
+		bool background = background_poll();
 
 		foreach_view (view, i) {
 			update_view(view);
@@ -8582,6 +13908,9 @@ get_input(int prompt_position)
 				loading = TRUE;
 		}
 
+		/* Jobs may have been started when views finished loading. */
+		background = background_jobs_size > 0;
+
 		/* Update the cursor position. */
 		if (prompt_position) {
 			getbegyx(status_win, cursor_y, cursor_x);
@@ -8596,11 +13925,19 @@ get_input(int prompt_position)
 
 		/* Refresh, accept single keystroke of input */
 		doupdate();
-		nodelay(status_win, loading);
-		key = wgetch(status_win);
+		if (!loading && !background && watch_is_active()) {
+			/* Block until there is input or a change. */
+			wtimeout(status_win, 0);
+			key = wgetch(status_win);
+			if (key == ERR && watch_wait(fileno(opt_tty)))
+				background_add(watch_refresh, NULL);
+		} else {
+			wtimeout(status_win, loading ? 0 : background ? BACKGROUND_POLL_DELAY : -1);
+			key = wgetch(status_win);
+		}
 
-		/* wgetch() with nodelay() enabled returns ERR when
-		 * there's no input. */
+		/* wgetch() returns ERR when there's no input before the
+		 * timeout. */
 		if (key == ERR) {
 
 		} else if (key == KEY_RESIZE) {
@@ -8647,10 +13984,12 @@ prompt_input(const char *prompt, input_handler handler, void *data)
 			break;
 
 		case KEY_BACKSPACE:
-			if (pos > 0)
+			if (pos > 0) {
 				buf[--pos] = 0;
-			else
+				handler(data, buf, key);
+			} else {
 				status = INPUT_CANCEL;
+			}
 			break;
 
 		case KEY_ESC:
@@ -9346,6 +14685,10 @@ main(int argc, const char *argv[])
 	if (load_refs(FALSE) == ERR)
 		die("Failed to load refs.");
 
+	if (opt_auto_refresh && opt_is_inside_work_tree == TRUE && !pager_mode &&
+	    watch_start(opt_git_dir, *opt_cdup ? opt_cdup : "."))
+		background_add(watch_update_poll, NULL);
+
 	init_display();
 
 	if (pager_mode)
@@ -9374,6 +14717,9 @@ main(int argc, const char *argv[])
 			break;
 		}
 		case REQ_SEARCH:
+			/* The finder view filters its files instead. */
+			if (view == VIEW(REQ_VIEW_FINDER))
+				break;
 		case REQ_SEARCH_BACK:
 		{
 			const char *prompt = request == REQ_SEARCH ? "/" : "?";
@@ -9394,6 +14740,7 @@ main(int argc, const char *argv[])
 		}
 	}
 
+	tree_lastmod_flush();
 	quit(0);
 
 	return 0;
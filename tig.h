@@ -119,6 +119,9 @@
 #define AUTHOR_WIDTH	18
 #define FILENAME_WIDTH	18
 
+/* The maximum number of commits whose diff is prefetched. */
+#define DIFF_PREFETCH_MAX	16
+
 #define MIN_VIEW_HEIGHT 4
 #define MIN_VIEW_WIDTH  4
 
@@ -378,6 +381,18 @@ strcmp_null(const char *s1, const char *s2)
 	return strcmp(s1, s2);
 }
 
+/* djb2 string hash. */
+static inline size_t
+string_hash(const char *str)
+{
+	size_t hash = 5381;
+
+	while (*str)
+		hash = hash * 33 + (unsigned char) *str++;
+
+	return hash;
+}
+
 /*
  * Enumerations
  */
@@ -0,0 +1,547 @@
+/* Copyright (c) 2006-2013 Jonas Fonseca <fonseca@diku.dk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "tig.h"
+#include "io.h"
+#include "watch.h"
+
+#ifndef NO_INOTIFY
+
+#include <dirent.h>
+#include <sys/inotify.h>
+
+#define WATCH_DIR_MASK \
+	(IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | \
+	 IN_ATTRIB | IN_ONLYDIR)
+
+#define WATCH_SCAN_DIRS	32	/* Directories scanned per update. */
+
+/* Watched directories sorted by watch descriptor. The git directory
+ * itself is watched with WATCH_NONE and its events mapped by name. */
+struct watch_dir {
+	int wd;
+	enum watch_event event;
+	char *path;
+};
+
+static int watch_fd = -1;
+static struct watch_dir *watch_dirs;
+static size_t watch_dirs_size;
+static bool watch_full;		/* Ran out of inotify watches. */
+
+/* Directories still to be watched and scanned for subdirectories. The
+ * working tree is only scanned once the ignored directories are known. */
+struct watch_scan {
+	char *path;
+	enum watch_event event;
+};
+
+static struct watch_scan *watch_scans;
+static size_t watch_scans_size;
+
+/* Ignored directories relative to the top of the working tree, sorted
+ * and with a trailing slash as listed by git ls-files. */
+static const char *watch_worktree;
+static char **watch_ignored;
+static size_t watch_ignored_size;
+static struct io watch_ignored_io;
+static bool watch_listing;
+
+/* Directories created in the working tree, which are checked in batches
+ * with git check-ignore before being scanned. */
+static char **watch_created;
+static size_t watch_created_size;
+static char **watch_checked;
+static size_t watch_checked_size;
+static struct io watch_checked_io;
+static bool watch_checking;
+
+DEFINE_ALLOCATOR(realloc_watch_dirs, struct watch_dir, 256)
+DEFINE_ALLOCATOR(realloc_watch_scans, struct watch_scan, 256)
+DEFINE_ALLOCATOR(realloc_watch_ignored, char *, 256)
+DEFINE_ALLOCATOR(realloc_watch_created, char *, 32)
+
+static int
+watch_ignored_compare(const void *a, const void *b)
+{
+	return strcmp(*(const char **) a, *(const char **) b);
+}
+
+static bool
+watch_queue(const char *path, enum watch_event event)
+{
+	char *dup = strdup(path);
+
+	if (!dup || !realloc_watch_scans(&watch_scans, watch_scans_size, 1)) {
+		free(dup);
+		return FALSE;
+	}
+
+	watch_scans[watch_scans_size].path = dup;
+	watch_scans[watch_scans_size++].event = event;
+	return TRUE;
+}
+
+/* Get the name of a directory in the working tree as git lists it. */
+static bool
+watch_worktree_name(char name[SIZEOF_STR], const char *path)
+{
+	size_t worktreelen = strlen(watch_worktree);
+
+	if (strncmp(path, watch_worktree, worktreelen))
+		return FALSE;
+	for (path += worktreelen; *path == '/'; path++)
+		;
+	return *path && string_nformat(name, SIZEOF_STR, NULL, "%s/", path);
+}
+
+static bool
+watch_is_ignored(const char *path)
+{
+	char name[SIZEOF_STR];
+	const char *key = name;
+
+	return watch_worktree_name(name, path) &&
+	       bsearch(&key, watch_ignored, watch_ignored_size,
+		       sizeof(*watch_ignored), watch_ignored_compare) != NULL;
+}
+
+static void
+watch_read_ignored(void)
+{
+	bool can_read = TRUE;
+	char *name;
+
+	if (!io_can_read(&watch_ignored_io, FALSE))
+		return;
+
+	for (; (name = io_get(&watch_ignored_io, 0, can_read)); can_read = FALSE) {
+		size_t namelen = strlen(name);
+		char *dup;
+
+		if (!namelen || name[namelen - 1] != '/')
+			continue;
+		dup = strdup(name);
+		if (!dup || !realloc_watch_ignored(&watch_ignored, watch_ignored_size, 1)) {
+			free(dup);
+			continue;
+		}
+		watch_ignored[watch_ignored_size++] = dup;
+	}
+
+	if (!io_eof(&watch_ignored_io) && !io_error(&watch_ignored_io))
+		return;
+
+	io_done(&watch_ignored_io);
+	qsort(watch_ignored, watch_ignored_size, sizeof(*watch_ignored), watch_ignored_compare);
+	watch_listing = FALSE;
+	watch_queue(watch_worktree, WATCH_WORKTREE);
+}
+
+/* Scan the created directories git did not list as ignored. */
+static void
+watch_checked_done(void)
+{
+	size_t i;
+
+	for (i = 0; i < watch_checked_size; i++) {
+		if (watch_checked[i])
+			watch_queue(watch_checked[i], WATCH_WORKTREE);
+		free(watch_checked[i]);
+	}
+	free(watch_checked);
+	watch_checked = NULL;
+	watch_checked_size = 0;
+}
+
+static void
+watch_read_checked(void)
+{
+	bool can_read = TRUE;
+	char *ignored;
+
+	if (!io_can_read(&watch_checked_io, FALSE))
+		return;
+
+	for (; (ignored = io_get(&watch_checked_io, 0, can_read)); can_read = FALSE) {
+		size_t i;
+
+		for (i = 0; i < watch_checked_size; i++) {
+			char name[SIZEOF_STR];
+
+			if (watch_checked[i] && watch_worktree_name(name, watch_checked[i]) &&
+			    !strcmp(name, ignored)) {
+				free(watch_checked[i]);
+				watch_checked[i] = NULL;
+				break;
+			}
+		}
+	}
+
+	if (!io_eof(&watch_checked_io) && !io_error(&watch_checked_io))
+		return;
+
+	io_done(&watch_checked_io);
+	watch_checking = FALSE;
+	watch_checked_done();
+}
+
+/* The names are given on stdin since there can be too many for the
+ * command line. All are watched if git cannot be asked. */
+static void
+watch_check_created(void)
+{
+	const char *check_ignore_argv[] = {
+		"git", "check-ignore", "-z", "--stdin", NULL
+	};
+	FILE *names = tmpfile();
+	bool ok = names != NULL;
+	size_t i;
+
+	for (i = 0; ok && i < watch_created_size; i++) {
+		char name[SIZEOF_STR];
+
+		if (watch_worktree_name(name, watch_created[i]))
+			ok = fwrite(name, strlen(name) + 1, 1, names) == 1;
+	}
+
+	watch_checked = watch_created;
+	watch_checked_size = watch_created_size;
+	watch_created = NULL;
+	watch_created_size = 0;
+
+	watch_checking = ok && !fflush(names) && !fseek(names, 0, SEEK_SET) &&
+			 io_run(&watch_checked_io, IO_RD_FD, watch_worktree, NULL,
+				check_ignore_argv, fileno(names));
+	if (names)
+		fclose(names);
+	if (!watch_checking)
+		watch_checked_done();
+}
+
+static void
+watch_add_created(const char *path)
+{
+	char *dup = strdup(path);
+
+	if (!dup || !realloc_watch_created(&watch_created, watch_created_size, 1)) {
+		free(dup);
+		return;
+	}
+	watch_created[watch_created_size++] = dup;
+}
+
+/* Returns the position of the directory or where to insert it. */
+static size_t
+watch_find(int wd, bool *found)
+{
+	size_t from = 0, to = watch_dirs_size;
+
+	*found = FALSE;
+
+	while (from < to) {
+		size_t pos = (from + to) / 2;
+
+		if (watch_dirs[pos].wd == wd) {
+			*found = TRUE;
+			return pos;
+		}
+		if (watch_dirs[pos].wd > wd)
+			to = pos;
+		else
+			from = pos + 1;
+	}
+
+	return from;
+}
+
+static bool
+watch_add(const char *path, enum watch_event event)
+{
+	char *dup;
+	bool found;
+	size_t pos;
+	int wd;
+
+	if (watch_full)
+		return FALSE;
+
+	wd = inotify_add_watch(watch_fd, path, WATCH_DIR_MASK);
+	if (wd == -1) {
+		if (errno == ENOSPC)
+			watch_full = TRUE;
+		return FALSE;
+	}
+
+	pos = watch_find(wd, &found);
+	if (found)
+		return TRUE;
+
+	dup = strdup(path);
+	if (!dup || !realloc_watch_dirs(&watch_dirs, watch_dirs_size, 1)) {
+		free(dup);
+		inotify_rm_watch(watch_fd, wd);
+		return FALSE;
+	}
+
+	memmove(watch_dirs + pos + 1, watch_dirs + pos,
+		(watch_dirs_size - pos) * sizeof(*watch_dirs));
+	watch_dirs_size++;
+
+	watch_dirs[pos].wd = wd;
+	watch_dirs[pos].event = event;
+	watch_dirs[pos].path = dup;
+	return TRUE;
+}
+
+static void
+watch_remove(size_t pos)
+{
+	free(watch_dirs[pos].path);
+	memmove(watch_dirs + pos, watch_dirs + pos + 1,
+		(watch_dirs_size - pos - 1) * sizeof(*watch_dirs));
+	watch_dirs_size--;
+}
+
+/* Watch a directory and queue its subdirectories except .git and those
+ * ignored in the working tree. */
+static void
+watch_scan(const char *path, enum watch_event event)
+{
+	struct dirent *entry;
+	DIR *dir;
+
+	if (!watch_add(path, event) || !(dir = opendir(path)))
+		return;
+
+	while ((entry = readdir(dir)) && !watch_full) {
+		char subpath[SIZEOF_STR];
+		struct stat st;
+
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..") ||
+		    !strcmp(entry->d_name, ".git") ||
+		    (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN) ||
+		    !string_format(subpath, "%s/%s", path, entry->d_name))
+			continue;
+
+		if (entry->d_type == DT_UNKNOWN &&
+		    (lstat(subpath, &st) || !S_ISDIR(st.st_mode)))
+			continue;
+
+		if (event == WATCH_WORKTREE && watch_is_ignored(subpath))
+			continue;
+
+		watch_queue(subpath, event);
+	}
+
+	closedir(dir);
+}
+
+/* Only the git directory is watched right away. The rest is set up by
+ * watch_update(), so that starting does not wait for git or for walking
+ * the working tree. */
+bool
+watch_start(const char *git_dir, const char *worktree)
+{
+	const char *ls_files_argv[] = {
+		"git", "ls-files", "-z", "--others", "--ignored", "--directory",
+			"--exclude-standard", NULL
+	};
+	char refs[SIZEOF_STR];
+
+	if (watch_fd != -1)
+		return TRUE;
+
+	watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch_fd == -1)
+		return FALSE;
+
+	if (!string_format(refs, "%s/refs", git_dir) ||
+	    !watch_add(git_dir, WATCH_NONE)) {
+		close(watch_fd);
+		watch_fd = -1;
+		return FALSE;
+	}
+
+	watch_worktree = worktree;
+	watch_queue(refs, WATCH_REFS);
+
+	watch_listing = io_run(&watch_ignored_io, IO_RD, worktree, NULL, ls_files_argv);
+	if (!watch_listing)
+		watch_queue(worktree, WATCH_WORKTREE);
+	return TRUE;
+}
+
+/* Continue setting up watches, a few directories at a time. Returns TRUE
+ * while there is more to do. */
+bool
+watch_update(void)
+{
+	int dirs;
+
+	if (watch_fd == -1)
+		return FALSE;
+
+	if (watch_listing)
+		watch_read_ignored();
+	if (watch_checking)
+		watch_read_checked();
+	if (!watch_listing && !watch_checking && watch_created_size)
+		watch_check_created();
+
+	for (dirs = 0; dirs < WATCH_SCAN_DIRS && watch_scans_size; dirs++) {
+		struct watch_scan scan = watch_scans[--watch_scans_size];
+
+		watch_scan(scan.path, scan.event);
+		free(scan.path);
+	}
+
+	return watch_listing || watch_checking || watch_created_size || watch_scans_size;
+}
+
+bool
+watch_is_active(void)
+{
+	return watch_fd != -1;
+}
+
+/* Block until there is input or a change, returns TRUE for the latter. */
+bool
+watch_wait(int input_fd)
+{
+	fd_set fds;
+
+	if (watch_fd == -1)
+		return FALSE;
+
+	FD_ZERO(&fds);
+	FD_SET(input_fd, &fds);
+	FD_SET(watch_fd, &fds);
+
+	return select(MAX(input_fd, watch_fd) + 1, &fds, NULL, NULL, NULL) > 0 &&
+	       FD_ISSET(watch_fd, &fds);
+}
+
+static enum watch_event
+watch_event(const struct inotify_event *event)
+{
+	const char *name = event->len ? event->name : "";
+	enum watch_event type;
+	bool found;
+	size_t pos;
+
+	if (event->mask & IN_Q_OVERFLOW)
+		return WATCH_ALL;
+
+	pos = watch_find(event->wd, &found);
+	if (!found)
+		return WATCH_NONE;
+	type = watch_dirs[pos].event;
+
+	if (event->mask & IN_IGNORED) {
+		watch_remove(pos);
+		return WATCH_NONE;
+	}
+
+	if (type == WATCH_NONE) {
+		if (!strcmp(name, "index"))
+			return WATCH_INDEX;
+		if (!strcmp(name, "HEAD"))
+			return WATCH_HEAD;
+		if (!strcmp(name, "packed-refs"))
+			return WATCH_REFS;
+		return WATCH_NONE;
+	}
+
+	if (!strcmp(name, ".git"))
+		return WATCH_NONE;
+
+	/* Lock files are renamed into place once the update is done. */
+	if (type == WATCH_REFS && strlen(name) > STRING_SIZE(".lock") &&
+	    !strcmp(name + strlen(name) - STRING_SIZE(".lock"), ".lock"))
+		return WATCH_NONE;
+
+	/* Created directories are watched by the next watch_update(). */
+	if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+		char path[SIZEOF_STR];
+
+		if (string_format(path, "%s/%s", watch_dirs[pos].path, name)) {
+			if (type == WATCH_WORKTREE)
+				watch_add_created(path);
+			else
+				watch_queue(path, type);
+		}
+	}
+
+	return type;
+}
+
+/* Collect the changes queued since the last call without blocking. */
+enum watch_event
+watch_read(void)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	enum watch_event events = WATCH_NONE;
+	ssize_t size;
+
+	if (watch_fd == -1)
+		return WATCH_NONE;
+
+	while ((size = read(watch_fd, buf, sizeof(buf))) > 0) {
+		const struct inotify_event *event;
+		char *pos;
+
+		for (pos = buf; pos < buf + size; pos += sizeof(*event) + event->len) {
+			event = (const struct inotify_event *) pos;
+			events |= watch_event(event);
+		}
+	}
+
+	return events;
+}
+
+#else
+
+bool
+watch_start(const char *git_dir, const char *worktree)
+{
+	return FALSE;
+}
+
+bool
+watch_is_active(void)
+{
+	return FALSE;
+}
+
+bool
+watch_update(void)
+{
+	return FALSE;
+}
+
+bool
+watch_wait(int input_fd)
+{
+	return FALSE;
+}
+
+enum watch_event
+watch_read(void)
+{
+	return WATCH_NONE;
+}
+
+#endif
+
+/* vim: set ts=8 sw=8 noexpandtab: */
@@ -0,0 +1,42 @@
+/* Copyright (c) 2006-2013 Jonas Fonseca <fonseca@diku.dk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef TIG_WATCH_H
+#define TIG_WATCH_H
+
+#include "tig.h"
+
+/*
+ * Watching the repository for changes made outside of tig. Only
+ * available with inotify; elsewhere watch_start() fails. After starting
+ * and after reading changes, watch_update() must be called until it
+ * returns FALSE to watch the directories found.
+ */
+
+enum watch_event {
+	WATCH_NONE	= 0,
+	WATCH_INDEX	= 1 << 0,	/* The index was written. */
+	WATCH_HEAD	= 1 << 1,	/* HEAD was updated. */
+	WATCH_REFS	= 1 << 2,	/* A ref or packed-refs was updated. */
+	WATCH_WORKTREE	= 1 << 3,	/* A file in the working tree changed. */
+	WATCH_ALL	= WATCH_INDEX | WATCH_HEAD | WATCH_REFS | WATCH_WORKTREE,
+};
+
+bool watch_start(const char *git_dir, const char *worktree);
+bool watch_update(void);
+bool watch_wait(int input_fd);
+enum watch_event watch_read(void);
+bool watch_is_active(void);
+
+#endif
+/* vim: set ts=8 sw=8 noexpandtab: */